@@ -0,0 +1,401 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "path_utils.h"
+#include "Wal.h"
+
+#include "Checkpoint.h"
+
+/**
+ * The image is a header, followed by an entry for every node, and by the table of their names.
+ * The names are null-terminated, and the table is padded with zeros to a multiple of 8 bytes,
+ * so that the whole image is a sequence of 64-bit words, covered by the checksum in the header.
+ * Integers are stored in the byte order of the machine.
+ */
+
+#define MAGIC "TREEIMG1"
+#define MAGIC_LENGTH 8
+
+typedef struct Header {
+	char magic[MAGIC_LENGTH];
+	uint64_t generation;
+	uint64_t count; // Of nodes.
+	uint64_t namesLength; // Including the padding.
+	uint64_t checksum;
+} Header;
+
+typedef struct Entry {
+	uint64_t id;
+	uint64_t name; // Offset in the table of names.
+	uint32_t firstChild;
+	uint32_t childCount;
+} Entry;
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+struct CheckpointWriter {
+	FILE * file;
+	char * path, * newPath;
+	uint64_t generation;
+	uint64_t count;
+	uint64_t referenced; // Nodes counted as children so far, including the root.
+	uint64_t checksum; // Of the entries written so far.
+	char * names;
+	size_t namesLength, namesCapacity;
+};
+
+struct Checkpoint {
+	const char * data;
+	size_t size;
+	const Header * header;
+	const Entry * entries;
+	const char * names;
+	uint32_t * ids; // Open addressing table of node indices plus one, zero in free slots.
+	size_t idsMask;
+};
+
+// Mixes whole words into the checksum, one at a time, which is much faster than byte by byte.
+static uint64_t checksum(uint64_t sum, const void * data, size_t words) {
+	const char * bytes = data;
+	for (size_t i = 0; i < words; i++) {
+		uint64_t word;
+		memcpy(&word, bytes + 8 * i, sizeof(word));
+		sum = (sum ^ word) * FNV_PRIME;
+	}
+	return sum;
+}
+
+static uint64_t finishChecksum(uint64_t sum, const Header * header) {
+	sum = checksum(sum, &header->generation, 1);
+	sum = checksum(sum, &header->count, 1);
+	return checksum(sum, &header->namesLength, 1);
+}
+
+CheckpointWriter * checkpointCreate(const char * path, uint64_t generation) {
+	CheckpointWriter * writer = calloc(1, sizeof(CheckpointWriter));
+	if (writer == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t length = strlen(path);
+	writer->path = malloc(length + 1);
+	writer->newPath = malloc(length + sizeof(".new"));
+	writer->namesCapacity = 4096;
+	writer->names = malloc(writer->namesCapacity);
+	if (writer->path == NULL || writer->newPath == NULL || writer->names == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	memcpy(writer->path, path, length + 1);
+	memcpy(writer->newPath, path, length);
+	memcpy(writer->newPath + length, ".new", sizeof(".new"));
+	writer->generation = generation;
+	writer->referenced = 1;
+	writer->checksum = FNV_OFFSET;
+
+	writer->file = fopen(writer->newPath, "wbe");
+	if (writer->file == NULL) {
+		goto fail;
+	}
+	// The header is written last, once it is known.
+	Header header = {0};
+	if (fwrite(&header, sizeof(header), 1, writer->file) != 1) {
+		int err = errno;
+		fclose(writer->file);
+		unlink(writer->newPath);
+		errno = err;
+		goto fail;
+	}
+	return writer;
+
+fail:;
+	int err = errno;
+	free(writer->names);
+	free(writer->newPath);
+	free(writer->path);
+	free(writer);
+	errno = err;
+	return NULL;
+}
+
+int checkpointAppend(CheckpointWriter * writer, uint64_t id, const char * name, size_t childCount) {
+	// Child ranges are 32-bit.
+	if (writer->referenced + childCount > UINT32_MAX) {
+		return EOVERFLOW;
+	}
+
+	size_t length = strlen(name) + 1;
+	if (writer->namesLength + length > writer->namesCapacity) {
+		size_t capacity = 2 * writer->namesCapacity;
+		char * names = realloc(writer->names, capacity);
+		if (names == NULL) {
+			return ENOMEM;
+		}
+		writer->names = names;
+		writer->namesCapacity = capacity;
+	}
+
+	Entry entry = {
+		.id = id,
+		.name = writer->namesLength,
+		.firstChild = writer->referenced,
+		.childCount = childCount,
+	};
+	if (fwrite(&entry, sizeof(entry), 1, writer->file) != 1) {
+		return errno;
+	}
+	writer->checksum = checksum(writer->checksum, &entry, sizeof(entry) / 8);
+	memcpy(writer->names + writer->namesLength, name, length);
+	writer->namesLength += length;
+	writer->referenced += childCount;
+	writer->count++;
+	return 0;
+}
+
+static void freeWriter(CheckpointWriter * writer) {
+	free(writer->names);
+	free(writer->newPath);
+	free(writer->path);
+	free(writer);
+}
+
+void checkpointAbort(CheckpointWriter * writer) {
+	fclose(writer->file);
+	unlink(writer->newPath);
+	freeWriter(writer);
+}
+
+int checkpointPublish(CheckpointWriter * writer) {
+	if (writer->referenced != writer->count) {
+		// Some of the children counted were never appended.
+		checkpointAbort(writer);
+		return EINVAL;
+	}
+
+	size_t padding = (8 - writer->namesLength % 8) % 8;
+	if (writer->namesLength + padding > writer->namesCapacity) {
+		char * names = realloc(writer->names, writer->namesLength + padding);
+		if (names == NULL) {
+			checkpointAbort(writer);
+			return ENOMEM;
+		}
+		writer->names = names;
+	}
+	memset(writer->names + writer->namesLength, 0, padding);
+	writer->namesLength += padding;
+
+	Header header;
+	memcpy(header.magic, MAGIC, MAGIC_LENGTH);
+	header.generation = writer->generation;
+	header.count = writer->count;
+	header.namesLength = writer->namesLength;
+	header.checksum = checksum(writer->checksum, writer->names, writer->namesLength / 8);
+	header.checksum = finishChecksum(header.checksum, &header);
+
+	int err = 0;
+	if (fwrite(writer->names, 1, writer->namesLength, writer->file) != writer->namesLength
+	    || fseek(writer->file, 0, SEEK_SET) != 0
+	    || fwrite(&header, sizeof(header), 1, writer->file) != 1
+	    || fflush(writer->file) != 0 || fsync(fileno(writer->file)) != 0) {
+		err = errno;
+	}
+	if (fclose(writer->file) != 0 && err == 0) {
+		err = errno;
+	}
+	if (err == 0) {
+		err = walReplaceFile(writer->newPath, writer->path);
+	}
+	if (err != 0) {
+		unlink(writer->newPath);
+	}
+	freeWriter(writer);
+	return err;
+}
+
+static bool isValidName(const char * name, size_t length) {
+	if (length < 1 || length > MAX_FOLDER_NAME_LENGTH) {
+		return false;
+	}
+	for (size_t i = 0; i < length; i++) {
+		if (name[i] < 'a' || name[i] > 'z') {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Checks that the entries describe a tree, with valid names, sorted among siblings.
+static bool isValidTree(Checkpoint * checkpoint) {
+	const Header * header = checkpoint->header;
+	uint64_t referenced = 1;
+	for (uint64_t i = 0; i < header->count; i++) {
+		const Entry * entry = &checkpoint->entries[i];
+		// Every node but the root is a child of a node before it.
+		if (i > 0 && i >= referenced) {
+			return false;
+		}
+		if (entry->firstChild != referenced || entry->childCount > header->count - referenced) {
+			return false;
+		}
+		referenced += entry->childCount;
+
+		if (entry->name >= header->namesLength) {
+			return false;
+		}
+		const char * name = checkpoint->names + entry->name;
+		size_t length = strnlen(name, header->namesLength - entry->name);
+		if (length == header->namesLength - entry->name || (i == 0 ? length != 0 : !isValidName(name, length))) {
+			return false;
+		}
+	}
+	if (referenced != header->count) {
+		return false;
+	}
+
+	// All the names are terminated now.
+	for (uint64_t i = 0; i < header->count; i++) {
+		const Entry * entry = &checkpoint->entries[i];
+		for (uint64_t child = entry->firstChild + 1; child < entry->firstChild + entry->childCount; child++) {
+			if (strcmp(checkpoint->names + checkpoint->entries[child - 1].name,
+			           checkpoint->names + checkpoint->entries[child].name) >= 0) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+Checkpoint * checkpointOpen(const char * path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	size_t size = status.st_size;
+	if (size < sizeof(Header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	void * data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (data == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	Checkpoint * checkpoint = malloc(sizeof(Checkpoint));
+	if (checkpoint == NULL) {
+		munmap(data, size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	checkpoint->data = data;
+	checkpoint->size = size;
+	checkpoint->header = data;
+	checkpoint->entries = (const Entry *)(checkpoint->data + sizeof(Header));
+	checkpoint->ids = NULL;
+
+	const Header * header = checkpoint->header;
+	size_t body = size - sizeof(Header);
+	bool valid = memcmp(header->magic, MAGIC, MAGIC_LENGTH) == 0
+	             && header->count > 0 && header->count <= UINT32_MAX
+	             && header->count * sizeof(Entry) <= body
+	             && header->namesLength == body - header->count * sizeof(Entry)
+	             && header->namesLength % 8 == 0;
+	if (valid) {
+		checkpoint->names = (const char *)(checkpoint->entries + header->count);
+		uint64_t sum = finishChecksum(checksum(FNV_OFFSET, checkpoint->entries, body / 8), header);
+		valid = sum == header->checksum && isValidTree(checkpoint);
+	}
+	if (!valid) {
+		checkpointClose(checkpoint);
+		errno = EINVAL;
+		return NULL;
+	}
+	return checkpoint;
+}
+
+void checkpointClose(Checkpoint * checkpoint) {
+	free(checkpoint->ids);
+	munmap((void *)checkpoint->data, checkpoint->size);
+	free(checkpoint);
+}
+
+uint64_t checkpointGeneration(Checkpoint * checkpoint) {
+	return checkpoint->header->generation;
+}
+
+size_t checkpointCount(Checkpoint * checkpoint) {
+	return checkpoint->header->count;
+}
+
+uint64_t checkpointId(Checkpoint * checkpoint, size_t node) {
+	return checkpoint->entries[node].id;
+}
+
+const char * checkpointName(Checkpoint * checkpoint, size_t node) {
+	return checkpoint->names + checkpoint->entries[node].name;
+}
+
+size_t checkpointChildren(Checkpoint * checkpoint, size_t node, size_t * first) {
+	*first = checkpoint->entries[node].firstChild;
+	return checkpoint->entries[node].childCount;
+}
+
+static size_t idSlot(uint64_t id, size_t mask) {
+	return (id * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+}
+
+int checkpointIndexIds(Checkpoint * checkpoint) {
+	size_t count = checkpoint->header->count;
+	size_t capacity = 2;
+	while (capacity < 2 * count) {
+		capacity *= 2;
+	}
+	uint32_t * ids = calloc(capacity, sizeof(uint32_t));
+	if (ids == NULL) {
+		return ENOMEM;
+	}
+
+	size_t mask = capacity - 1;
+	for (size_t node = 0; node < count; node++) {
+		size_t slot = idSlot(checkpoint->entries[node].id, mask);
+		while (ids[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		ids[slot] = node + 1;
+	}
+	free(checkpoint->ids);
+	checkpoint->ids = ids;
+	checkpoint->idsMask = mask;
+	return 0;
+}
+
+size_t checkpointFind(Checkpoint * checkpoint, uint64_t id) {
+	for (size_t slot = idSlot(id, checkpoint->idsMask); checkpoint->ids[slot] != 0;
+	     slot = (slot + 1) & checkpoint->idsMask) {
+		if (checkpoint->entries[checkpoint->ids[slot] - 1].id == id) {
+			return checkpoint->ids[slot] - 1;
+		}
+	}
+	return SIZE_MAX;
+}
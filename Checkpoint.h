@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A checkpoint image of a tree, from which it can be rebuilt without replaying its history.
+//
+// The image lists the nodes in breadth-first order, each with its name, the range of its
+// children and its identifier (see Wal.h). The children of a node are thus contiguous, sorted
+// by name, and follow all the nodes above them. The image holds no pointers, and is read
+// through a memory mapping, without parsing it first.
+//
+// Every checkpoint has a generation, which the write-ahead log continuing it refers to.
+
+typedef struct CheckpointWriter CheckpointWriter;
+
+typedef struct Checkpoint Checkpoint;
+
+// Starts writing a checkpoint of the given generation, to replace the one at `path`
+// once `checkpointPublish` is called. Returns NULL and sets errno on failure.
+CheckpointWriter * checkpointCreate(const char * path, uint64_t generation);
+
+// Adds the next node in breadth-first order, the root first with an empty name.
+// Siblings must be added in ascending order of their names.
+// Returns 0 on success, and an error code otherwise.
+int checkpointAppend(CheckpointWriter * writer, uint64_t id, const char * name, size_t childCount);
+
+// Finishes the checkpoint, syncs it, and replaces the previous one at its path.
+// Frees the writer in any case. Returns 0 on success, and an error code otherwise.
+int checkpointPublish(CheckpointWriter * writer);
+
+// Discards a checkpoint which was not published, and frees the writer.
+void checkpointAbort(CheckpointWriter * writer);
+
+// Maps the checkpoint at `path`, and checks that it is intact.
+// Returns NULL and sets errno on failure (ENOENT if there is none, EINVAL if it is damaged).
+Checkpoint * checkpointOpen(const char * path);
+
+void checkpointClose(Checkpoint * checkpoint);
+
+uint64_t checkpointGeneration(Checkpoint * checkpoint);
+
+// The number of nodes, which are then indexed from 0 (the root) in breadth-first order.
+size_t checkpointCount(Checkpoint * checkpoint);
+
+uint64_t checkpointId(Checkpoint * checkpoint, size_t node);
+
+// The name of a node, pointing into the mapping.
+const char * checkpointName(Checkpoint * checkpoint, size_t node);
+
+// Returns the number of children of a node, and sets `*first` to the index of the first one.
+size_t checkpointChildren(Checkpoint * checkpoint, size_t node, size_t * first);
+
+// Builds the index of identifiers used by `checkpointFind`.
+// Returns 0 on success, and ENOMEM if there is not enough memory.
+int checkpointIndexIds(Checkpoint * checkpoint);
+
+// Returns the index of the node with the given identifier, or SIZE_MAX if there is none.
+// Requires `checkpointIndexIds`.
+size_t checkpointFind(Checkpoint * checkpoint, uint64_t id);
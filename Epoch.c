@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "err.h"
+
+#include "Epoch.h"
+
+/**
+ * The classic three-epoch scheme:
+ *   Every thread has a record, holding the global epoch it observed when it entered
+ *   its current critical section (or nothing if it is outside of one).
+ *   The global epoch may only be advanced when all active records have observed it,
+ *   so once it is two epochs past the epoch in which an object was retired,
+ *   every reader which could have seen the object has left its critical section.
+ *
+ * Readers only ever write to their own record. Retirement is done by writers,
+ * which are already serialized by the tree protocols, so a single mutex-protected
+ * list of retired objects is enough; the global epoch is only advanced under it.
+ */
+
+#define CACHE_LINE_SIZE 64
+
+// An attempt to advance the epoch and reclaim memory is made every this many retirements.
+#define RECLAIM_BATCH 64
+
+typedef struct EpochRecord EpochRecord;
+
+struct EpochRecord {
+	// (observed epoch << 1) | 1 while inside a critical section, 0 otherwise.
+	_Alignas(CACHE_LINE_SIZE) atomic_ulong state;
+	atomic_bool inUse; // Records of threads that exited are reused.
+	EpochRecord * next; // Immutable once the record is published.
+};
+
+typedef struct Retired Retired;
+
+struct Retired {
+	void * object;
+	void (*reclaim)(void *);
+	unsigned long epoch; // Global epoch at the time of retirement.
+	Retired * next;
+};
+
+static atomic_ulong globalEpoch = 0;
+static _Atomic(EpochRecord *) records = NULL;
+
+static pthread_mutex_t retiredMutex = PTHREAD_MUTEX_INITIALIZER;
+// Retired objects, oldest first, so their epochs are non-decreasing.
+static Retired * retiredHead = NULL;
+static Retired * * retiredTail = &retiredHead;
+static unsigned long retiredSinceReclaim = 0;
+
+static pthread_once_t recordKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t recordKey;
+
+static _Thread_local EpochRecord * threadRecord = NULL;
+static _Thread_local unsigned nesting = 0;
+
+static void releaseRecord(void * record) {
+	EpochRecord * epochRecord = record;
+	atomic_store_explicit(&epochRecord->state, 0, memory_order_release);
+	atomic_store_explicit(&epochRecord->inUse, false, memory_order_release);
+}
+
+static void createRecordKey(void) {
+	int err;
+	if ((err = pthread_key_create(&recordKey, releaseRecord)) != 0) {
+		syserr("epoch key create %d", err);
+	}
+}
+
+static EpochRecord * registerThread(void) {
+	pthread_once(&recordKeyOnce, createRecordKey);
+
+	EpochRecord * record;
+	for (record = atomic_load(&records); record != NULL; record = record->next) {
+		bool unused = false;
+		if (atomic_compare_exchange_strong(&record->inUse, &unused, true)) {
+			break;
+		}
+	}
+
+	if (record == NULL) {
+		record = aligned_alloc(CACHE_LINE_SIZE, sizeof(EpochRecord));
+		if (record == NULL) {
+			syserr("epoch record alloc");
+		}
+		atomic_init(&record->state, 0);
+		atomic_init(&record->inUse, true);
+		record->next = atomic_load(&records);
+		while (!atomic_compare_exchange_weak(&records, &record->next, record));
+	}
+
+	int err;
+	if ((err = pthread_setspecific(recordKey, record)) != 0) {
+		syserr("epoch set specific %d", err);
+	}
+	threadRecord = record;
+	return record;
+}
+
+void epochEnter(void) {
+	if (nesting++ > 0) {
+		return;
+	}
+	EpochRecord * record = threadRecord != NULL ? threadRecord : registerThread();
+	unsigned long epoch = atomic_load_explicit(&globalEpoch, memory_order_relaxed);
+	atomic_store_explicit(&record->state, (epoch << 1) | 1, memory_order_relaxed);
+	// The record must be visible before any shared memory is read.
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epochExit(void) {
+	if (--nesting > 0) {
+		return;
+	}
+	atomic_store_explicit(&threadRecord->state, 0, memory_order_release);
+}
+
+static void lockRetired(void) {
+	int err;
+	if ((err = pthread_mutex_lock(&retiredMutex)) != 0) {
+		syserr("epoch mutex lock %d", err);
+	}
+}
+
+static void unlockRetired(void) {
+	int err;
+	if ((err = pthread_mutex_unlock(&retiredMutex)) != 0) {
+		syserr("epoch mutex unlock %d", err);
+	}
+}
+
+// Advances the global epoch if all active readers have observed it.
+// Requires `retiredMutex`.
+static bool tryAdvance(void) {
+	unsigned long epoch = atomic_load(&globalEpoch);
+	atomic_thread_fence(memory_order_seq_cst);
+	for (EpochRecord * record = atomic_load(&records); record != NULL; record = record->next) {
+		unsigned long state = atomic_load(&record->state);
+		if ((state & 1) != 0 && (state >> 1) != epoch) {
+			return false;
+		}
+	}
+	atomic_store(&globalEpoch, epoch + 1);
+	return true;
+}
+
+// Detaches the retired objects which cannot be accessed anymore.
+// Requires `retiredMutex`. The result should be passed to `reclaimAll` without it.
+static Retired * detachReclaimable(void) {
+	unsigned long epoch = atomic_load(&globalEpoch);
+	retiredSinceReclaim = 0;
+	if (retiredHead == NULL || retiredHead->epoch + 2 > epoch) {
+		return NULL;
+	}
+
+	Retired * head = retiredHead;
+	Retired * last = head;
+	while (last->next != NULL && last->next->epoch + 2 <= epoch) {
+		last = last->next;
+	}
+	retiredHead = last->next;
+	if (retiredHead == NULL) {
+		retiredTail = &retiredHead;
+	}
+	last->next = NULL;
+	return head;
+}
+
+static void reclaimAll(Retired * retired) {
+	while (retired != NULL) {
+		Retired * next = retired->next;
+		retired->reclaim(retired->object);
+		free(retired);
+		retired = next;
+	}
+}
+
+void epochRetire(void * object, void (*reclaim)(void *)) {
+	Retired * retired = malloc(sizeof(Retired));
+	if (retired == NULL) {
+		syserr("epoch retire alloc");
+	}
+	retired->object = object;
+	retired->reclaim = reclaim;
+	retired->next = NULL;
+
+	Retired * reclaimable = NULL;
+	lockRetired();
+	retired->epoch = atomic_load(&globalEpoch);
+	*retiredTail = retired;
+	retiredTail = &retired->next;
+	if (++retiredSinceReclaim >= RECLAIM_BATCH) {
+		tryAdvance();
+		reclaimable = detachReclaimable();
+	}
+	unlockRetired();
+
+	reclaimAll(reclaimable);
+}
+
+void epochSynchronize(void) {
+	lockRetired();
+	unsigned long target = atomic_load(&globalEpoch) + 2;
+	while (atomic_load(&globalEpoch) < target) {
+		if (!tryAdvance()) {
+			unlockRetired();
+			sched_yield();
+			lockRetired();
+		}
+	}
+	Retired * reclaimable = detachReclaimable();
+	unlockRetired();
+
+	reclaimAll(reclaimable);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Epoch-based reclamation, for readers which traverse shared structures without locks.
+//
+// A reader brackets its accesses with `epochEnter` and `epochExit`. Writers still
+// synchronize among themselves, but instead of freeing memory which readers may still
+// be looking at, they hand it to `epochRetire`. Retired memory is reclaimed once every
+// reader that was inside a critical section at the time of retirement has left it.
+//
+// Entering and leaving a critical section only writes to memory owned by the calling
+// thread, so readers do not contend with each other. Critical sections may be nested.
+// Failures are system errors and terminate the program, as in the semaphore protocols.
+
+void epochEnter(void);
+
+void epochExit(void);
+
+// Schedules `reclaim(object)` to be called once no reader can access `object` anymore.
+void epochRetire(void * object, void (*reclaim)(void *));
+
+// Waits until all readers that are currently inside a critical section have left it,
+// then reclaims everything retired before the call. Must not be called from within
+// a critical section.
+void epochSynchronize(void);
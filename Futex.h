@@ -0,0 +1,31 @@
+#pragma once
+
+// Thin wrappers around the futex system call, for the lock implementations built
+// directly on atomic words. Failures other than spurious wake-ups are system errors.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "err.h"
+
+// Sleeps as long as `*address == expected`. May return spuriously.
+// Leaves errno untouched, as the tree operations use it to keep track of their result.
+static inline void futexWait(atomic_uint * address, unsigned expected) {
+	int savedErrno = errno;
+	if (syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0) != 0
+	    && errno != EAGAIN && errno != EINTR) {
+		syserr("futex wait");
+	}
+	errno = savedErrno;
+}
+
+// Wakes up at most `count` threads sleeping on `address`.
+static inline void futexWake(atomic_uint * address, int count) {
+	if (syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) < 0) {
+		syserr("futex wake");
+	}
+}
@@ -1,101 +1,317 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/random.h>
 
 #include "HashMap.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Open addressing with linear probing. Every slot stores the full hash and the
+// length of its key, so probing compares two integers before touching any key bytes,
+// and short keys live inside the slot itself, so a successful lookup of a typical
+// folder name touches a single cache line.
+// Removed entries leave a tombstone behind, so that probe sequences stay intact;
+// tombstones are dropped whenever the table is rehashed.
+//
+// Lookups may run concurrently with a single modifying thread (see `hmap_set_deferred_free`):
+// a slot is filled in before its value is published, taken slots are never reused
+// (only turned into tombstones), and a rehash builds a new table and publishes it
+// with a single pointer store.
 
-typedef struct Pair Pair;
+// Keys shorter than this are stored inline in the slot.
+#define INLINE_KEY_SIZE 16
 
-struct Pair {
-    char* key;
-    void* value;
-    Pair* next; // Next item in a single-linked list.
-};
+// Capacity of the table allocated on the first insert. Always a power of two.
+#define MIN_CAPACITY 8
 
-struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
-    size_t size; // total number of entries in map.
-};
+// The table is rehashed when more than MAX_LOAD_NUM / MAX_LOAD_DEN of its slots
+// are taken (by entries or tombstones), and shrunk when less than 1 / SHRINK_DEN
+// of them hold entries.
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
+#define SHRINK_DEN 8
 
-static unsigned int get_hash(const char* key);
+// Marks a removed entry. Never handed out, as values must not be NULL.
+static char tombstone;
+#define TOMBSTONE ((void*)&tombstone)
+
+typedef struct Slot {
+    uint32_t hash;
+    uint32_t length;      // Length of the key, excluding the terminating null character.
+    _Atomic(void*) value; // NULL for an empty slot, TOMBSTONE for a removed one.
+    union {
+        char inline_key[INLINE_KEY_SIZE];
+        char* heap_key;
+    };
+} Slot;
+
+typedef struct HashMapTable {
+    size_t capacity; // Number of slots, a power of two.
+    Slot slots[];
+} Table;
+
+static void (*deferred_free)(void* ptr) = free;
+
+static uint64_t hash_seed;
+static pthread_once_t hash_seed_once = PTHREAD_ONCE_INIT;
+
+static void init_hash_seed(void)
+{
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+        seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&seed;
+    hash_seed = seed;
+}
+
+// A seeded multiply-xorshift hash, consuming eight bytes at a time.
+static uint64_t get_hash(const char* key, size_t length)
+{
+    const uint64_t m = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = hash_seed ^ (length * m);
+    while (length >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, key, 8);
+        hash = (hash ^ chunk) * m;
+        hash ^= hash >> 29;
+        key += 8;
+        length -= 8;
+    }
+    if (length > 0) {
+        uint64_t chunk = 0;
+        memcpy(&chunk, key, length);
+        hash = (hash ^ chunk) * m;
+        hash ^= hash >> 29;
+    }
+    // Final avalanche (the murmur3 finalizer).
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline const char* slot_key(const Slot* slot)
+{
+    return slot->length < INLINE_KEY_SIZE ? slot->inline_key : slot->heap_key;
+}
+
+static inline void* slot_value(Slot* slot)
+{
+    return atomic_load_explicit(&slot->value, memory_order_acquire);
+}
+
+static inline bool slot_taken(Slot* slot)
+{
+    void* value = slot_value(slot);
+    return value != NULL && value != TOMBSTONE;
+}
+
+// The table, as seen by the only modifying thread.
+static inline Table* own_table(HashMap* map)
+{
+    return atomic_load_explicit(&map->table, memory_order_relaxed);
+}
+
+static inline size_t capacity_of(Table* table)
+{
+    return table == NULL ? 0 : table->capacity;
+}
+
+void hmap_set_deferred_free(void (*free_function)(void* ptr))
+{
+    deferred_free = free_function;
+}
+
+void hmap_init(HashMap* map)
+{
+    pthread_once(&hash_seed_once, init_hash_seed);
+    atomic_init(&map->table, NULL);
+    map->size = 0;
+    map->tombstones = 0;
+}
+
+void hmap_destroy(HashMap* map)
+{
+    Table* table = own_table(map);
+    for (size_t i = 0; i < capacity_of(table); ++i) {
+        Slot* slot = &table->slots[i];
+        if (slot_taken(slot) && slot->length >= INLINE_KEY_SIZE)
+            free(slot->heap_key);
+    }
+    free(table);
+    atomic_store_explicit(&map->table, NULL, memory_order_relaxed);
+    map->size = 0;
+    map->tombstones = 0;
+}
 
 HashMap* hmap_new()
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
-    memset(map, 0, sizeof(HashMap));
+    hmap_init(map);
     return map;
 }
 
 void hmap_free(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
-        for (Pair* p = map->buckets[h]; p;) {
-            Pair* q = p;
-            p = p->next;
-            free(q->key);
-            free(q);
-        }
-    }
+    hmap_destroy(map);
     free(map);
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+// Return the slot of `table` holding `key`, or NULL if not present.
+static Slot* hmap_find(Table* table, uint32_t hash, const char* key, size_t length)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
-            return p;
+    if (table == NULL)
+        return NULL;
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Slot* slot = &table->slots[i];
+        void* value = slot_value(slot);
+        if (value == NULL)
+            return NULL;
+        if (value != TOMBSTONE && slot->hash == hash && slot->length == length
+            && memcmp(slot_key(slot), key, length) == 0)
+            return slot;
     }
-    return NULL;
+}
+
+// Move all entries to a fresh table of `capacity` slots, dropping tombstones.
+// Keys are moved, not copied. Returns false if out of memory.
+static bool hmap_rehash(HashMap* map, size_t capacity)
+{
+    Table* new_table = calloc(1, sizeof(Table) + capacity * sizeof(Slot));
+    if (!new_table)
+        return false;
+    new_table->capacity = capacity;
+    Table* table = own_table(map);
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < capacity_of(table); ++i) {
+        Slot* slot = &table->slots[i];
+        if (!slot_taken(slot))
+            continue;
+        size_t j = slot->hash & mask;
+        while (atomic_load_explicit(&new_table->slots[j].value, memory_order_relaxed) != NULL)
+            j = (j + 1) & mask;
+        Slot* new_slot = &new_table->slots[j];
+        new_slot->hash = slot->hash;
+        new_slot->length = slot->length;
+        memcpy(new_slot->inline_key, slot->inline_key, INLINE_KEY_SIZE);
+        atomic_store_explicit(&new_slot->value, slot_value(slot), memory_order_relaxed);
+    }
+    atomic_store_explicit(&map->table, new_table, memory_order_release);
+    if (table != NULL)
+        deferred_free(table);
+    map->tombstones = 0;
+    return true;
+}
+
+// Smallest capacity able to hold `size` entries below the maximum load factor.
+static size_t capacity_for(size_t size)
+{
+    size_t capacity = MIN_CAPACITY;
+    while (size * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM)
+        capacity *= 2;
+    return capacity;
+}
+
+uint32_t hmap_hash(const char* key, size_t length)
+{
+    pthread_once(&hash_seed_once, init_hash_seed);
+    return (uint32_t)get_hash(key, length);
 }
 
 void* hmap_get(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
-        return p->value;
-    else
+    size_t length = strlen(key);
+    return hmap_get_hashed(map, key, length, (uint32_t)get_hash(key, length));
+}
+
+void* hmap_get_hashed(HashMap* map, const char* key, size_t length, uint32_t hash)
+{
+    Table* table = atomic_load_explicit(&map->table, memory_order_acquire);
+    Slot* slot = hmap_find(table, hash, key, length);
+    if (!slot)
         return NULL;
+    // The entry may have been removed since it was found.
+    void* value = slot_value(slot);
+    return value == TOMBSTONE ? NULL : value;
 }
 
 bool hmap_insert(HashMap* map, const char* key, void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
+    size_t length = strlen(key);
+    uint32_t hash = (uint32_t)get_hash(key, length);
+    if (hmap_find(own_table(map), hash, key, length))
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
-    new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
+
+    // Make room for one more taken slot.
+    if (((size_t)map->size + map->tombstones + 1) * MAX_LOAD_DEN > capacity_of(own_table(map)) * MAX_LOAD_NUM) {
+        if (!hmap_rehash(map, capacity_for(map->size + 1)))
+            return false;
+    }
+
+    char* heap_key = NULL;
+    if (length >= INLINE_KEY_SIZE) {
+        heap_key = strdup(key);
+        if (!heap_key)
+            return false;
+    }
+
+    Table* table = own_table(map);
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (atomic_load_explicit(&table->slots[i].value, memory_order_relaxed) != NULL)
+        i = (i + 1) & mask;
+    Slot* slot = &table->slots[i];
+    slot->hash = hash;
+    slot->length = length;
+    if (heap_key)
+        slot->heap_key = heap_key;
+    else
+        memcpy(slot->inline_key, key, length + 1);
+    // Publish the slot to concurrent readers.
+    atomic_store_explicit(&slot->value, value, memory_order_release);
     map->size++;
     return true;
 }
 
+bool hmap_reserve(HashMap* map, size_t size)
+{
+    if ((size + map->tombstones) * MAX_LOAD_DEN <= capacity_of(own_table(map)) * MAX_LOAD_NUM)
+        return true;
+    return hmap_rehash(map, capacity_for(size));
+}
+
 bool hmap_remove(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-    while (*pp) {
-        Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
-            return true;
-        }
-        pp = &(p->next);
+    size_t length = strlen(key);
+    Table* table = own_table(map);
+    Slot* slot = hmap_find(table, (uint32_t)get_hash(key, length), key, length);
+    if (!slot)
+        return false;
+    atomic_store_explicit(&slot->value, TOMBSTONE, memory_order_release);
+    if (slot->length >= INLINE_KEY_SIZE)
+        deferred_free(slot->heap_key);
+    map->size--;
+    map->tombstones++;
+
+    if (map->size == 0) {
+        // Drop the table altogether, empty directories are by far the most common.
+        atomic_store_explicit(&map->table, NULL, memory_order_release);
+        deferred_free(table);
+        map->tombstones = 0;
+    } else if (table->capacity > MIN_CAPACITY && (size_t)map->size * SHRINK_DEN < table->capacity) {
+        // Failing to shrink is harmless, the old table stays valid.
+        hmap_rehash(map, capacity_for(map->size));
     }
-    return false;
+    return true;
 }
 
 size_t hmap_size(HashMap* map)
@@ -105,30 +321,22 @@ size_t hmap_size(HashMap* map)
 
 HashMapIterator hmap_iterator(HashMap* map)
 {
-    HashMapIterator it = { 0, map->buckets[0] };
+    HashMapIterator it = { atomic_load_explicit(&map->table, memory_order_acquire), 0 };
     return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
-    Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
-        p = map->buckets[++it->bucket];
+    (void)map;
+    while (it->slot < capacity_of(it->table)) {
+        Slot* slot = &it->table->slots[it->slot++];
+        // The entry may be removed concurrently, load its value only once.
+        void* slot_entry = slot_value(slot);
+        if (slot_entry != NULL && slot_entry != TOMBSTONE) {
+            *key = slot_key(slot);
+            *value = slot_entry;
+            return true;
+        }
     }
-    if (!p)
-        return false;
-    *key = p->key;
-    *value = p->value;
-    it->pair = p->next;
-    return true;
+    return false;
 }
-
-static unsigned int get_hash(const char* key)
-{
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
-    }
-    return hash % N_BUCKETS;
-}
\ No newline at end of file
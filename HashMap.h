@@ -4,7 +4,9 @@
  * File kindly provided by the university.
  */
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 // A structure representing a mapping from keys to values.
@@ -19,15 +21,33 @@ HashMap* hmap_new();
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
 
+// Same as `hmap_new` and `hmap_free`, for a map embedded in another structure
+// (see `struct HashMap` below). An empty map does not allocate any memory.
+void hmap_init(HashMap* map);
+void hmap_destroy(HashMap* map);
+
 // Get the value stored under `key`, or NULL if not present.
+// May run concurrently with another thread modifying the map (see `hmap_set_deferred_free`).
 void* hmap_get(HashMap* map, const char* key);
 
+// Return the hash of the first `length` bytes of `key`, as used by all maps.
+// The hash function is seeded once per process.
+uint32_t hmap_hash(const char* key, size_t length);
+
+// Same as `hmap_get`, for a key of `length` bytes which need not be null-terminated,
+// whose hash `hmap_hash` returned.
+void* hmap_get_hashed(HashMap* map, const char* key, size_t length, uint32_t hash);
+
 // Insert a `value` under `key` and return true,
 // or do nothing and return false if `key` already exists in the map.
 // `value` must not be NULL.
 // (The caller can free `key` at any time - the map internally uses a copy of it).
 bool hmap_insert(HashMap* map, const char* key, void* value);
 
+// Make room for `size` entries in total, so that inserting up to that many does not rehash.
+// Return false if out of memory.
+bool hmap_reserve(HashMap* map, size_t size);
+
 // Remove the value under `key` and return true (the value is not free'd),
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
@@ -35,17 +55,26 @@ bool hmap_remove(HashMap* map, const char* key);
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Set the function used to free memory that concurrent `hmap_get` calls may still be
+// reading (old tables and keys of removed entries). It should delay the actual `free`
+// until all such lookups are done. The default is `free`, which is only correct if maps
+// are never read while modified. The setting is process-wide.
+void hmap_set_deferred_free(void (*free_function)(void* ptr));
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
 HashMapIterator hmap_iterator(HashMap* map);
 
 // Set `*key` and `*value` to the current element pointed by iterator and
-// move the iterator to the next element.
+// move the iterator to the next element. `*key` points into the map and stays
+// valid until the map is modified.
 // If there are no more elements, leaves `*key` and `*value` unchanged and
 // returns false.
 //
-// The map cannot be modified between calls to `hmap_iterator` and `hmap_next`.
+// The map cannot be modified between calls to `hmap_iterator` and `hmap_next`,
+// except by a single other thread, as with `hmap_get`. The iteration then goes over
+// the entries as they were when it started, or may see some of the changes since.
 //
 // Usage: ```
 //     const char* key;
@@ -57,6 +86,14 @@ HashMapIterator hmap_iterator(HashMap* map);
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
 struct HashMapIterator {
-    int bucket;
-    void* pair;
-};
\ No newline at end of file
+    struct HashMapTable* table;
+    size_t slot;
+};
+
+// The fields are private; the definition is public only so that maps can be embedded.
+// Counts are 32-bit, so that an embedded map takes only three words.
+struct HashMap {
+    _Atomic(struct HashMapTable*) table; // NULL while the map is empty.
+    uint32_t size;                       // Number of entries in the map.
+    uint32_t tombstones;                 // Number of removed entries still occupying slots.
+};
@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "Listing.h"
+
+TreeListing * listingNew(NameIndex * ni) {
+	size_t length = niListingLength(ni);
+	TreeListing * listing = malloc(sizeof(TreeListing) + length + 1);
+	if (listing == NULL) {
+		return NULL;
+	}
+	atomic_init(&listing->references, 1);
+	listing->length = length;
+	niWriteListing(ni, listing->contents);
+	return listing;
+}
+
+TreeListing * listingJoin(const char * const * names, size_t count) {
+	size_t length = count > 0 ? count - 1 : 0;
+	for (size_t i = 0; i < count; i++) {
+		length += strlen(names[i]);
+	}
+	TreeListing * listing = malloc(sizeof(TreeListing) + length + 1);
+	if (listing == NULL) {
+		return NULL;
+	}
+	atomic_init(&listing->references, 1);
+	listing->length = length;
+
+	char * end = listing->contents;
+	for (size_t i = 0; i < count; i++) {
+		if (i > 0) {
+			*end++ = ',';
+		}
+		size_t nameLength = strlen(names[i]);
+		memcpy(end, names[i], nameLength);
+		end += nameLength;
+	}
+	*end = '\0';
+	return listing;
+}
+
+void listingAcquire(const TreeListing * listing) {
+	TreeListing * mutableListing = (TreeListing *)listing;
+	atomic_fetch_add_explicit(&mutableListing->references, 1, memory_order_relaxed);
+}
+
+void listingRelease(const TreeListing * listing) {
+	if (listing == NULL) {
+		return;
+	}
+	TreeListing * mutableListing = (TreeListing *)listing;
+	if (atomic_fetch_sub_explicit(&mutableListing->references, 1, memory_order_acq_rel) == 1) {
+		free(mutableListing);
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "NameIndex.h"
+#include "Tree.h"
+
+// An immutable, reference-counted listing of a directory, as returned by `tree_list`.
+// Each node caches the listing of its contents until the next write to it,
+// so readers of an unchanged directory share a single buffer.
+struct TreeListing {
+	atomic_size_t references;
+	size_t length; // Excluding the terminating null character.
+	char contents[];
+};
+
+// Builds a listing of the names in the index, with a single reference.
+// Returns NULL if out of memory.
+TreeListing * listingNew(NameIndex * ni);
+
+// Builds a listing of `count` names, in the given order, with a single reference.
+// Returns NULL if out of memory.
+TreeListing * listingJoin(const char * const * names, size_t count);
+
+// Adds a reference to the listing.
+void listingAcquire(const TreeListing * listing);
+
+// Drops a reference to the listing, freeing it if it was the last one.
+void listingRelease(const TreeListing * listing);
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "NameIndex.h"
+
+// Enough for any AVL tree that fits in memory (the height is below 1.45 log2(n + 2)).
+#define MAX_HEIGHT 96
+
+struct NameIndexNode {
+	NameIndexNode * left, * right;
+	int height;
+	uint32_t length;
+	char name[]; // Null-terminated.
+};
+
+static int height(NameIndexNode * node) {
+	return node == NULL ? 0 : node->height;
+}
+
+static void update(NameIndexNode * node) {
+	int l = height(node->left), r = height(node->right);
+	node->height = (l > r ? l : r) + 1;
+}
+
+static NameIndexNode * rotateRight(NameIndexNode * node) {
+	NameIndexNode * left = node->left;
+	node->left = left->right;
+	left->right = node;
+	update(node);
+	update(left);
+	return left;
+}
+
+static NameIndexNode * rotateLeft(NameIndexNode * node) {
+	NameIndexNode * right = node->right;
+	node->right = right->left;
+	right->left = node;
+	update(node);
+	update(right);
+	return right;
+}
+
+// Restores the AVL invariant at `node`, assuming it holds in both subtrees.
+static NameIndexNode * rebalance(NameIndexNode * node) {
+	update(node);
+	int balance = height(node->left) - height(node->right);
+	if (balance > 1) {
+		if (height(node->left->left) < height(node->left->right)) {
+			node->left = rotateLeft(node->left);
+		}
+		return rotateRight(node);
+	} else if (balance < -1) {
+		if (height(node->right->right) < height(node->right->left)) {
+			node->right = rotateRight(node->right);
+		}
+		return rotateLeft(node);
+	}
+	return node;
+}
+
+// Inserts `inserted` into the subtree, unless its name is already there,
+// in which case `*found` is set. Returns the new root of the subtree.
+static NameIndexNode * insertInto(NameIndexNode * node, NameIndexNode * inserted, bool * found) {
+	if (node == NULL) {
+		return inserted;
+	}
+	int cmp = strcmp(inserted->name, node->name);
+	if (cmp == 0) {
+		*found = true;
+		return node;
+	} else if (cmp < 0) {
+		node->left = insertInto(node->left, inserted, found);
+	} else {
+		node->right = insertInto(node->right, inserted, found);
+	}
+	return *found ? node : rebalance(node);
+}
+
+// Detaches the minimum of a non-empty subtree into `*min`. Returns the new root of the subtree.
+static NameIndexNode * detachMin(NameIndexNode * node, NameIndexNode * * min) {
+	if (node->left == NULL) {
+		*min = node;
+		return node->right;
+	}
+	node->left = detachMin(node->left, min);
+	return rebalance(node);
+}
+
+// Removes `name` from the subtree, setting `*removed` to the removed node.
+// Returns the new root of the subtree.
+static NameIndexNode * removeFrom(NameIndexNode * node, const char * name, NameIndexNode * * removed) {
+	if (node == NULL) {
+		return NULL;
+	}
+	int cmp = strcmp(name, node->name);
+	if (cmp < 0) {
+		node->left = removeFrom(node->left, name, removed);
+	} else if (cmp > 0) {
+		node->right = removeFrom(node->right, name, removed);
+	} else {
+		*removed = node;
+		if (node->left == NULL) {
+			return node->right;
+		} else if (node->right == NULL) {
+			return node->left;
+		}
+		NameIndexNode * successor;
+		NameIndexNode * right = detachMin(node->right, &successor);
+		successor->left = node->left;
+		successor->right = right;
+		return rebalance(successor);
+	}
+	return *removed == NULL ? node : rebalance(node);
+}
+
+static void freeSubtree(NameIndexNode * node) {
+	while (node != NULL) {
+		freeSubtree(node->left);
+		NameIndexNode * right = node->right;
+		free(node);
+		node = right;
+	}
+}
+
+void niInit(NameIndex * ni) {
+	ni->root = NULL;
+	ni->count = 0;
+	ni->bytes = 0;
+}
+
+void niDestroy(NameIndex * ni) {
+	freeSubtree(ni->root);
+	niInit(ni);
+}
+
+bool niInsert(NameIndex * ni, const char * name) {
+	size_t length = strlen(name);
+	NameIndexNode * inserted = malloc(sizeof(NameIndexNode) + length + 1);
+	if (inserted == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	inserted->left = inserted->right = NULL;
+	inserted->height = 1;
+	inserted->length = length;
+	memcpy(inserted->name, name, length + 1);
+
+	bool found = false;
+	ni->root = insertInto(ni->root, inserted, &found);
+	if (found) {
+		free(inserted);
+		return false;
+	}
+	ni->count++;
+	ni->bytes += length;
+	return true;
+}
+
+// Builds a balanced subtree of the sorted names into `*result`, adding their lengths to `*bytes`.
+// Returns false if out of memory, with nothing left allocated.
+static bool build(const char * const * names, size_t count, NameIndexNode * * result, size_t * bytes) {
+	*result = NULL;
+	if (count == 0) {
+		return true;
+	}
+
+	size_t middle = count / 2;
+	NameIndexNode * left, * right;
+	if (!build(names, middle, &left, bytes)) {
+		return false;
+	}
+	if (!build(names + middle + 1, count - middle - 1, &right, bytes)) {
+		freeSubtree(left);
+		return false;
+	}
+
+	size_t length = strlen(names[middle]);
+	NameIndexNode * node = malloc(sizeof(NameIndexNode) + length + 1);
+	if (node == NULL) {
+		freeSubtree(left);
+		freeSubtree(right);
+		return false;
+	}
+	node->left = left;
+	node->right = right;
+	node->length = length;
+	memcpy(node->name, names[middle], length + 1);
+	update(node);
+	*bytes += length;
+	*result = node;
+	return true;
+}
+
+bool niBuild(NameIndex * ni, const char * const * names, size_t count) {
+	size_t bytes = 0;
+	if (!build(names, count, &ni->root, &bytes)) {
+		errno = ENOMEM;
+		return false;
+	}
+	ni->count = count;
+	ni->bytes = bytes;
+	return true;
+}
+
+bool niRemove(NameIndex * ni, const char * name) {
+	NameIndexNode * removed = NULL;
+	ni->root = removeFrom(ni->root, name, &removed);
+	if (removed == NULL) {
+		return false;
+	}
+	ni->count--;
+	ni->bytes -= removed->length;
+	free(removed);
+	return true;
+}
+
+size_t niListingLength(NameIndex * ni) {
+	// Names, with a comma between each two of them.
+	return ni->count == 0 ? 0 : ni->bytes + ni->count - 1;
+}
+
+void niWriteListing(NameIndex * ni, char * buffer) {
+	char * position = buffer;
+	NameIndexNode * stack[MAX_HEIGHT];
+	int depth = 0;
+	NameIndexNode * node = ni->root;
+	while (node != NULL || depth > 0) {
+		if (node != NULL) {
+			stack[depth++] = node;
+			node = node->left;
+		} else {
+			node = stack[--depth];
+			memcpy(position, node->name, node->length);
+			position += node->length;
+			*position++ = ',';
+			node = node->right;
+		}
+	}
+
+	if (position != buffer) {
+		position--; // Overwrite the trailing comma.
+	}
+	*position = '\0';
+}
+
+char * niMakeListing(NameIndex * ni) {
+	char * result = malloc(niListingLength(ni) + 1);
+	if (result == NULL) {
+		return NULL;
+	}
+	niWriteListing(ni, result);
+	return result;
+}
+
+// Pushes the path to the first node whose name follows `after` (or to the first node, if `after`
+// is NULL) onto the stack, so that popping it yields the following nodes in order.
+static int seek(NameIndex * ni, const char * after, NameIndexNode * stack[MAX_HEIGHT]) {
+	int depth = 0;
+	NameIndexNode * node = ni->root;
+	while (node != NULL) {
+		if (after == NULL || strcmp(node->name, after) > 0) {
+			stack[depth++] = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return depth;
+}
+
+// Pops the next node in order from a stack filled by `seek`.
+static NameIndexNode * popNext(NameIndexNode * stack[MAX_HEIGHT], int * depth) {
+	NameIndexNode * result = stack[--*depth];
+	for (NameIndexNode * node = result->right; node != NULL; node = node->left) {
+		stack[(*depth)++] = node;
+	}
+	return result;
+}
+
+char * niMakePage(NameIndex * ni, const char * after, size_t count, char * last) {
+	NameIndexNode * stack[MAX_HEIGHT];
+	int depth = seek(ni, after, stack);
+	size_t listed = 0, length = 0;
+	while (depth > 0 && listed < count) {
+		length += popNext(stack, &depth)->length + (listed > 0 ? 1 : 0);
+		listed++;
+	}
+
+	char * result = malloc(length + 1);
+	if (result == NULL) {
+		return NULL;
+	}
+
+	char * position = result;
+	depth = seek(ni, after, stack);
+	for (size_t i = 0; i < listed; i++) {
+		NameIndexNode * node = popNext(stack, &depth);
+		if (i > 0) {
+			*position++ = ',';
+		}
+		memcpy(position, node->name, node->length);
+		position += node->length;
+		if (i == listed - 1) {
+			memcpy(last, node->name, node->length + 1);
+		}
+	}
+	*position = '\0';
+	return result;
+}
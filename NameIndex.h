@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// An ordered set of folder names, kept next to the HashMap of a node so that
+// listing a directory does not have to sort its contents every time.
+// It is an AVL tree, and it keeps track of the total length of all names,
+// so the comma-separated listing can be produced with a single allocation and
+// a single in-order pass.
+// The index is not synchronized, the protocols of the owning node protect it.
+
+typedef struct NameIndexNode NameIndexNode;
+
+typedef struct NameIndex {
+	NameIndexNode * root;
+	size_t count; // Number of names.
+	size_t bytes; // Total length of all names, excluding terminating null characters.
+} NameIndex;
+
+void niInit(NameIndex * ni);
+
+void niDestroy(NameIndex * ni);
+
+// Inserts a copy of `name`. Returns false if `name` is already present,
+// or if there is not enough memory (in which case errno is set to ENOMEM).
+bool niInsert(NameIndex * ni, const char * name);
+
+// Fills an empty index with `count` distinct names, sorted in ascending order, in linear time.
+// Returns false and sets errno to ENOMEM if there is not enough memory, leaving the index empty.
+bool niBuild(NameIndex * ni, const char * const * names, size_t count);
+
+// Removes `name`. Returns false if it was not present.
+bool niRemove(NameIndex * ni, const char * name);
+
+// Returns the length of the listing of the index (see `niMakeListing`),
+// excluding the terminating null character.
+size_t niListingLength(NameIndex * ni);
+
+// Writes the listing of the index to `buffer`, which should have room for
+// `niListingLength(ni) + 1` characters.
+void niWriteListing(NameIndex * ni, char * buffer);
+
+// Returns a string containing all names, sorted, comma-separated, or NULL if out of memory.
+// The result has no trailing comma. An empty index yields an empty string.
+// The caller should free the result.
+char * niMakeListing(NameIndex * ni);
+
+// Like `niMakeListing`, but lists only the first `count` names which follow `after`
+// (or the first `count` names, if `after` is NULL). The last name listed, if any, is copied
+// to `last`, which should have room for the longest name and its terminating null character.
+char * niMakePage(NameIndex * ni, const char * after, size_t count, char * last);
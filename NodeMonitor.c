@@ -1,12 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
-
-#include <sys/types.h>
-#include <unistd.h>
-#include <sys/syscall.h>
+#include <string.h>
+#include <time.h>
 
 #include "Semaphore.h"
+#include "Trace.h"
 
 #include "NodeMonitor.h"
 
@@ -29,21 +29,30 @@
  *     to obtain a read lock on the parent of the node, then it will receive a read lock on the
  *     node (if it exists), and lastly, it will release the read lock on the parent.
  *   move: requires a write lock on the parent of the source and the parent of the target.
- *     Requires also a write lock on the source to set proper flags and parent pointers.
+ *     The source itself is not locked, threads may keep working inside it during the move.
  * 
  * 2) The problem
  *   The only problem with a standard approach, assuming the above locks, would be the appearance of
  *   race conditions between two threads, one working on a folder in a subtree before a move, the other
  *   working on the same subtree, but after a move, resulting in a different path. Were the second thread
- *   to finish its job before the first, weird things would happen in all kinds of scenarios.
+ *   to finish its job before the first, weird things would happen in all kinds of scenarios, e.g. the
+ *   second thread would not see a folder the first one created, though it created it before the move.
  * 
  * 3) The solution
- *   For each subtree, we remember how many threads are doing something inside it. Then, if a subtree
- *   gets moved, we do not let in any new threads inside until all previous threads have exited.
- *   This means we disable entry protocols, but keep the exit protocols enabled.
- *   This means that it will be necessary to backtrack up the filesystem structure, to decrement
- *   the thread counters. This also means, that we need to keep track of the parent of a node
- *   (not here, in `struct Tree`), and additionally, the new parent (brought to you by yours truly, tree_move).
+ *   For each subtree, we remember how many threads are doing something inside it, so that a remove
+ *   can wait for them. Every thread also remembers the trail of nodes it entered (not here, in Tree.c),
+ *   and backtracks along it to decrement the thread counters, instead of following parent pointers.
+ *   A thread which was inside a subtree when it got moved thus leaves through its old ancestors,
+ *   whose counters it incremented, while new threads enter through the new ones right away.
+ *   Threads which take the locks hand-over-hand cannot overtake the earlier ones: to get anywhere
+ *   below the moved node, they have to lock every node on the way, including the one the earlier
+ *   thread holds (or is waiting for), so they queue up behind it like they would without a move.
+ *   Threads which skip locks, that is optimistic descents and lock-free readers, could overtake it.
+ *   So each move also starts a new generation of the moved node, and counts the threads inside it
+ *   as earlier ones, tagged with the old generation, until they leave. While any are left, the node
+ *   is draining, and the threads which skip locks take them instead when they come across it.
+ *   An optimistic descent counts itself inside its target before validating its walk, so it is
+ *   either an earlier thread, or sees that the old parent changed and starts over.
  * 
  * 4) Addendum: guarantee of liveness
  *   Each operation obtains locks lexicographically. Assuming a finite amount of threads (given by the project statment)
@@ -52,13 +61,476 @@
  *   must separately find the LCA in order to not look for it again, as looking for it again, either
  *   by tracing back up the structure or by going down from the root would contradict the condition
  *   that locks are to be taken lexicographically.
+ *   Moves do not lock the moved node, so they could also move the first of the two nodes below
+ *   the path to the second one, which the operation would then lock after it, out of order.
+ *   The operation thus keeps the read locks on the path to the first node until it has the second.
  */
 
+// With TREE_STATS, entries are counted with a relaxed increment each, and only waiting
+// threads read the clock, so uncontended entries stay cheap.
+#if NM_STATS
+
+static void statsInit(NodeMonitor * nm) {
+	atomic_init(&nm->stats.readerEntries, 0);
+	atomic_init(&nm->stats.writerEntries, 0);
+	atomic_init(&nm->stats.waits, 0);
+	atomic_init(&nm->stats.waitNanoseconds, 0);
+}
+
+static void countEntry(NodeMonitor * nm, bool writer) {
+	atomic_fetch_add_explicit(writer ? &nm->stats.writerEntries : &nm->stats.readerEntries, 1, memory_order_relaxed);
+}
+
+// Returns the time at which a wait begins.
+static uint64_t beginWait(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void countWait(NodeMonitor * nm, uint64_t begin) {
+	atomic_fetch_add_explicit(&nm->stats.waits, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&nm->stats.waitNanoseconds, beginWait() - begin, memory_order_relaxed);
+}
+
+void nmCounters(NodeMonitor * nm, NodeMonitorCounters * counters) {
+	counters->readerEntries = atomic_load_explicit(&nm->stats.readerEntries, memory_order_relaxed);
+	counters->writerEntries = atomic_load_explicit(&nm->stats.writerEntries, memory_order_relaxed);
+	counters->waits = atomic_load_explicit(&nm->stats.waits, memory_order_relaxed);
+	counters->waitNanoseconds = atomic_load_explicit(&nm->stats.waitNanoseconds, memory_order_relaxed);
+}
+
+#else
+
+static void statsInit(NodeMonitor * nm) {
+	(void)nm;
+}
+
+static void countEntry(NodeMonitor * nm, bool writer) {
+	(void)nm;
+	(void)writer;
+}
+
+static uint64_t beginWait(void) {
+	return 0;
+}
+
+static void countWait(NodeMonitor * nm, uint64_t begin) {
+	(void)nm;
+	(void)begin;
+}
+
+void nmCounters(NodeMonitor * nm, NodeMonitorCounters * counters) {
+	(void)nm;
+	memset(counters, 0, sizeof(NodeMonitorCounters));
+}
+
+#endif
+
+#ifdef TREE_ATOMIC_NODE_MONITOR
+
+#include "Futex.h"
+
+/**
+ * The atomic variant keeps the whole state of the monitor in a single word:
+ * the number of active readers, of readers waiting to be let in and of waiting writers,
+ * and a flag for an active writer.
+ *
+ * The rules are those of the semaphore protocols below:
+ *   new readers wait while there is an active or a waiting writer,
+ *   writers wait while the node is being read or written,
+ *   an exiting writer lets in all the waiting readers at once, and only if there are none,
+ *   gives way to a waiting writer.
+ * Waiting readers are let in by the exiting writer itself, which counts them as active
+ * and flips PHASE to tell them so. Waiting writers compete for the node once it is free,
+ * but new writers cannot barge in before them.
+ *
+ * Waiting threads park on one of two futex words. Waiting readers and writers are counted
+ * in the state, so whoever lets them in knows whether to wake them up: all the readers at once,
+ * or a single writer.
+ * A thread reads the futex word before it inspects the state, and a waking thread bumps it
+ * after changing the state, so no wake-up is lost in between.
+ *
+ * With NM_BIAS, busy nodes are read with a bias (as in BRAVO), so that their readers stop
+ * bouncing the line of the state between them. Once NM_BIAS_THRESHOLD reader entries since
+ * the last writer found other readers inside or lost a race for the state, the node is BIASED.
+ * A reader of a biased node does not write to its state at all: it publishes the node in a slot
+ * of its own thread, and is in if the node is still BIASED afterwards. Writers clear
+ * BIASED and set REVOKED instead, so that new readers take the state again, and the writer
+ * which gets the node then waits until no slot of any thread holds it (DRAINING meanwhile).
+ * Publishing a slot before reading the state and changing the state before reading the slots
+ * are all sequentially consistent, so either the reader sees the bias gone or the writer
+ * sees the reader. Readers in slots are not counted in the state, which is why the writer
+ * waits for them only once it has the node.
+ */
+
+#define READER ((uint64_t)1)
+#define READERS_MASK ((uint64_t)0xFFFFF)
+#define WAITING_READERS_SHIFT 20
+#define WAITING_READER ((uint64_t)1 << WAITING_READERS_SHIFT)
+#define WAITING_READERS_MASK ((uint64_t)0xFFFFF << WAITING_READERS_SHIFT)
+#define WAITING_WRITERS_SHIFT 40
+#define WAITING_WRITER ((uint64_t)1 << WAITING_WRITERS_SHIFT)
+#define WAITING_WRITERS_MASK ((uint64_t)0xFFFF << WAITING_WRITERS_SHIFT)
+#define WRITER ((uint64_t)1 << 56)
+#define PHASE ((uint64_t)1 << 57)
+#define BIASED ((uint64_t)1 << 58)
+#define REVOKED ((uint64_t)1 << 59)
+#define DRAINING ((uint64_t)1 << 60)
+
+// Contended reader entries after which a node becomes biased.
+#ifndef NM_BIAS_THRESHOLD
+	#define NM_BIAS_THRESHOLD 64
+#endif
+
+static void traceState(TraceType type, NodeMonitor * nm) {
+	if (traceOn()) {
+		uint64_t state = atomic_load(&nm->state);
+		traceRecord(type, 0, nm,
+			tracePackCounters(state & READERS_MASK, (state & WRITER) != 0,
+				(state & WAITING_READERS_MASK) >> WAITING_READERS_SHIFT,
+				(state & WAITING_WRITERS_MASK) >> WAITING_WRITERS_SHIFT));
+	}
+}
+
+static void wake(atomic_uint * sequence, int count) {
+	atomic_fetch_add(sequence, 1);
+	futexWake(sequence, count);
+}
+
+int nmInit(NodeMonitor * nm) {
+	if (nm == NULL) {
+		return 0;
+	}
+
+	atomic_init(&nm->state, 0);
+	atomic_init(&nm->readersSequence, 0);
+	atomic_init(&nm->writersSequence, 0);
+	atomic_init(&nm->version, 0);
+	atomic_init(&nm->drainSequence, 0);
+	atomic_init(&nm->contention, 0);
+	statsInit(nm);
+	return 0;
+}
+
+int nmDestroy(NodeMonitor * nm) {
+	(void)nm;
+	return 0;
+}
+
+#if NM_BIAS
+
+#define CACHE_LINE_SIZE 64
+
+// Biased nodes a thread can read at once. A thread reading more takes the state of the rest.
+#define BIAS_SLOTS 6
+
+typedef struct ReaderSlots ReaderSlots;
+
+// The slots of a thread, registered like the records of Epoch.c.
+struct ReaderSlots {
+	_Alignas(CACHE_LINE_SIZE) _Atomic(NodeMonitor *) held[BIAS_SLOTS]; // Written only by the owner.
+	atomic_bool inUse;
+	ReaderSlots * next; // Immutable once the slots are published.
+};
+
+static _Atomic(ReaderSlots *) readerSlots = NULL;
+
+static pthread_once_t slotsKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t slotsKey;
+
+static _Thread_local ReaderSlots * threadSlots = NULL;
+// The number of slots of the thread which hold a node, so that other exits skip them.
+static _Thread_local int threadHeld = 0;
+
+static void releaseSlots(void * slots) {
+	atomic_store_explicit(&((ReaderSlots *)slots)->inUse, false, memory_order_release);
+}
+
+static void createSlotsKey(void) {
+	int err;
+	if ((err = pthread_key_create(&slotsKey, releaseSlots)) != 0) {
+		syserr("reader slots key create %d", err);
+	}
+}
+
+static ReaderSlots * registerReader(void) {
+	pthread_once(&slotsKeyOnce, createSlotsKey);
+
+	ReaderSlots * slots;
+	for (slots = atomic_load(&readerSlots); slots != NULL; slots = slots->next) {
+		bool unused = false;
+		if (atomic_compare_exchange_strong(&slots->inUse, &unused, true)) {
+			break;
+		}
+	}
+
+	if (slots == NULL) {
+		slots = aligned_alloc(CACHE_LINE_SIZE, sizeof(ReaderSlots));
+		if (slots == NULL) {
+			syserr("reader slots alloc");
+		}
+		for (int i = 0; i < BIAS_SLOTS; i++) {
+			atomic_init(&slots->held[i], NULL);
+		}
+		atomic_init(&slots->inUse, true);
+		slots->next = atomic_load(&readerSlots);
+		while (!atomic_compare_exchange_weak(&readerSlots, &slots->next, slots));
+	}
+
+	int err;
+	if ((err = pthread_setspecific(slotsKey, slots)) != 0) {
+		syserr("reader slots set specific %d", err);
+	}
+	threadSlots = slots;
+	return slots;
+}
+
+// Empties a slot of the calling thread, waking up the writer waiting for it, if any.
+static void releaseSlot(NodeMonitor * nm, int i) {
+	atomic_store(&threadSlots->held[i], NULL);
+	threadHeld--;
+	if ((atomic_load(&nm->state) & DRAINING) != 0) {
+		wake(&nm->drainSequence, 1);
+	}
+}
+
+// Tries to enter a biased node through a slot. Returns whether it did.
+static bool biasedEnter(NodeMonitor * nm) {
+	ReaderSlots * slots = threadSlots != NULL ? threadSlots : registerReader();
+	for (int i = 0; i < BIAS_SLOTS; i++) {
+		if (atomic_load_explicit(&slots->held[i], memory_order_relaxed) == NULL) {
+			atomic_store(&slots->held[i], nm);
+			threadHeld++;
+			if ((atomic_load(&nm->state) & BIASED) != 0) {
+				return true;
+			}
+			releaseSlot(nm, i);
+			return false;
+		}
+	}
+	return false;
+}
+
+// Leaves a node entered through a slot. Returns false if it was entered through the state.
+static bool biasedExit(NodeMonitor * nm) {
+	for (int i = 0; threadHeld > 0 && i < BIAS_SLOTS; i++) {
+		if (atomic_load_explicit(&threadSlots->held[i], memory_order_relaxed) == nm) {
+			releaseSlot(nm, i);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Counts a contended reader entry, and makes the node biased once there were enough of them.
+static void countContention(NodeMonitor * nm) {
+	if (atomic_fetch_add_explicit(&nm->contention, 1, memory_order_relaxed) + 1 < NM_BIAS_THRESHOLD) {
+		return;
+	}
+	uint64_t state = atomic_load(&nm->state);
+	while ((state & (BIASED | WRITER | WAITING_WRITERS_MASK)) == 0) {
+		if (atomic_compare_exchange_weak(&nm->state, &state, state | BIASED)) {
+			atomic_store_explicit(&nm->contention, 0, memory_order_relaxed);
+			traceState(TRACE_BIAS, nm);
+			return;
+		}
+	}
+}
+
+// The state with the bias revoked.
+static uint64_t revokeBias(uint64_t state) {
+	return (state & BIASED) != 0 ? (state & ~BIASED) | REVOKED : state;
+}
+
+// Called by a writer which has just got the node. Waits for the readers which entered it
+// through slots before the bias was revoked, and starts counting contention anew.
+static void finishWriterEntry(NodeMonitor * nm, uint64_t state) {
+	if (atomic_load_explicit(&nm->contention, memory_order_relaxed) != 0) {
+		atomic_store_explicit(&nm->contention, 0, memory_order_relaxed);
+	}
+	if ((state & REVOKED) == 0) {
+		return;
+	}
+
+	atomic_fetch_or(&nm->state, DRAINING);
+	for (ReaderSlots * slots = atomic_load(&readerSlots); slots != NULL; slots = slots->next) {
+		for (int i = 0; i < BIAS_SLOTS; i++) {
+			while (atomic_load(&slots->held[i]) == nm) {
+				unsigned sequence = atomic_load(&nm->drainSequence);
+				if (atomic_load(&slots->held[i]) == nm) {
+					uint64_t begin = beginWait();
+					futexWait(&nm->drainSequence, sequence);
+					countWait(nm, begin);
+				}
+			}
+		}
+	}
+	atomic_fetch_and(&nm->state, ~(DRAINING | REVOKED));
+	traceState(TRACE_REVOKE, nm);
+}
+
+#else
+
+static bool biasedEnter(NodeMonitor * nm) {
+	(void)nm;
+	return false;
+}
+
+static bool biasedExit(NodeMonitor * nm) {
+	(void)nm;
+	return false;
+}
+
+static void countContention(NodeMonitor * nm) {
+	(void)nm;
+}
+
+static uint64_t revokeBias(uint64_t state) {
+	return state;
+}
+
+static void finishWriterEntry(NodeMonitor * nm, uint64_t state) {
+	(void)nm;
+	(void)state;
+}
+
+#endif
+
+void nmReaderEnter(NodeMonitor * nm) {
+	uint64_t state = atomic_load(&nm->state);
+	if ((state & BIASED) != 0 && biasedEnter(nm)) {
+		countEntry(nm, false);
+		traceState(TRACE_READER_ENTRY, nm);
+		return;
+	}
+
+	bool contended = false;
+	for (;;) {
+		if ((state & (WRITER | WAITING_WRITERS_MASK)) == 0) {
+			contended |= (state & READERS_MASK) != 0;
+			if (atomic_compare_exchange_weak(&nm->state, &state, state + READER)) {
+				countEntry(nm, false);
+				if (contended) {
+					countContention(nm);
+				}
+				traceState(TRACE_READER_ENTRY, nm);
+				return;
+			}
+			contended = true;
+		} else if (atomic_compare_exchange_weak(&nm->state, &state, state + WAITING_READER)) {
+			break;
+		}
+	}
+
+	// Wait until an exiting writer lets us in.
+	uint64_t begin = beginWait();
+	uint64_t phase = state & PHASE;
+	unsigned sequence = atomic_load(&nm->readersSequence);
+	while ((atomic_load(&nm->state) & PHASE) == phase) {
+		futexWait(&nm->readersSequence, sequence);
+		sequence = atomic_load(&nm->readersSequence);
+	}
+	countWait(nm, begin);
+	countEntry(nm, false);
+	traceState(TRACE_READER_ENTRY, nm);
+}
+
+void nmReaderExit(NodeMonitor * nm) {
+	traceState(TRACE_READER_EXIT, nm);
+	if (biasedExit(nm)) {
+		return;
+	}
+	uint64_t state = atomic_fetch_sub(&nm->state, READER) - READER;
+	if ((state & READERS_MASK) == 0 && (state & WAITING_WRITERS_MASK) != 0) {
+		wake(&nm->writersSequence, 1);
+	}
+}
+
+void nmWriterEnter(NodeMonitor * nm) {
+	uint64_t state = atomic_load(&nm->state);
+	for (;;) {
+		if ((state & (READERS_MASK | WRITER | WAITING_WRITERS_MASK)) == 0) {
+			if (atomic_compare_exchange_weak(&nm->state, &state, revokeBias(state) | WRITER)) {
+				finishWriterEntry(nm, revokeBias(state));
+				countEntry(nm, true);
+				traceState(TRACE_WRITER_ENTRY, nm);
+				return;
+			}
+		} else if (atomic_compare_exchange_weak(&nm->state, &state, revokeBias(state) + WAITING_WRITER)) {
+			// New readers wait for waiting writers, also those of a biased node.
+			break;
+		}
+	}
+
+	// Wait until the node is neither read nor written.
+	uint64_t begin = beginWait();
+	unsigned sequence = atomic_load(&nm->writersSequence);
+	state = atomic_load(&nm->state);
+	for (;;) {
+		if ((state & (READERS_MASK | WRITER)) != 0) {
+			futexWait(&nm->writersSequence, sequence);
+			sequence = atomic_load(&nm->writersSequence);
+			state = atomic_load(&nm->state);
+		} else if (atomic_compare_exchange_weak(&nm->state, &state, revokeBias(state) - WAITING_WRITER + WRITER)) {
+			countWait(nm, begin);
+			finishWriterEntry(nm, revokeBias(state));
+			countEntry(nm, true);
+			traceState(TRACE_WRITER_ENTRY, nm);
+			return;
+		}
+	}
+}
+
+// Revoking the bias of the node would mean waiting for its biased readers.
+bool nmWriterTryEnter(NodeMonitor * nm) {
+	uint64_t state = atomic_load(&nm->state);
+	while ((state & (READERS_MASK | WRITER | WAITING_WRITERS_MASK | BIASED | REVOKED)) == 0) {
+		if (atomic_compare_exchange_weak(&nm->state, &state, state | WRITER)) {
+			finishWriterEntry(nm, state);
+			countEntry(nm, true);
+			traceState(TRACE_WRITER_ENTRY, nm);
+			return true;
+		}
+	}
+	return false;
+}
+
+void nmWriterExit(NodeMonitor * nm) {
+	traceState(TRACE_WRITER_EXIT, nm);
+	uint64_t state = atomic_load(&nm->state);
+	uint64_t desired;
+	do {
+		desired = state - WRITER;
+		if ((desired & WAITING_READERS_MASK) != 0) {
+			// Let all the waiting readers in.
+			desired += (desired & WAITING_READERS_MASK) >> WAITING_READERS_SHIFT;
+			desired &= ~WAITING_READERS_MASK;
+			desired ^= PHASE;
+		}
+	} while (!atomic_compare_exchange_weak(&nm->state, &state, desired));
+
+	if ((state & WAITING_READERS_MASK) != 0) {
+		wake(&nm->readersSequence, INT_MAX);
+	} else if ((state & WAITING_WRITERS_MASK) != 0) {
+		wake(&nm->writersSequence, 1);
+	}
+}
+
+#else
+
 /**
  * The protocols are mostly copied from the provided .pdf on Moodle.
  * The protocols make use of critical section inheritance.
  */
 
+// Requires `mutex`, which protects the counters.
+static void traceState(TraceType type, NodeMonitor * nm) {
+	if (traceOn()) {
+		traceRecord(type, 0, nm, tracePackCounters(nm->reading, nm->writing, nm->waitingR, nm->waitingW));
+	}
+}
+
 int nmInit(NodeMonitor * nm) {
 	if (nm == NULL) {
 		return 0;
@@ -70,26 +542,21 @@ int nmInit(NodeMonitor * nm) {
 		errno = err;
 		return errno;
 	}
-	if ((err = semInit(&nm->entryMutex, 1)) != 0) {
-		// Ignore possible errors.
-		semDestroy(&nm->mutex);
-		errno = err;
-		return errno;
-	}
 	if ((err = semInit(&nm->readers, 0)) != 0) {
+		// Ignore possible errors.
 		semDestroy(&nm->mutex);
-		semDestroy(&nm->entryMutex);
 		errno = err;
 		return errno;
 	}
 	if ((err = semInit(&nm->writers, 0)) != 0) {
 		semDestroy(&nm->mutex);
-		semDestroy(&nm->entryMutex);
 		semDestroy(&nm->readers);
 		// I think I understand the appeal of RAII.
 		errno = err;
 		return errno;
 	}
+	atomic_init(&nm->version, 0);
+	statsInit(nm);
 
 	return 0;
 }
@@ -102,13 +569,6 @@ int nmDestroy(NodeMonitor * nm) {
 	int err;
 	if ((err = semDestroy(&nm->mutex)) != 0) {
 		// Ignore possible errors.
-		semDestroy(&nm->entryMutex);
-		semDestroy(&nm->readers);
-		semDestroy(&nm->writers);
-		errno = err;
-		return errno;
-	}
-	if ((err = semDestroy(&nm->entryMutex)) != 0) {
 		semDestroy(&nm->readers);
 		semDestroy(&nm->writers);
 		errno = err;
@@ -128,19 +588,18 @@ int nmDestroy(NodeMonitor * nm) {
 }
 
 void nmReaderEnter(NodeMonitor * nm) {
-	semP(&nm->entryMutex);
 	semP(&nm->mutex);
-	semV(&nm->entryMutex);
-	if (PROTOCOL_DEBUG != 0) {
-		fprintf(stderr, "Thread %ld: Reader Entry at %p.\n%d, %d, %d, %d\n\n", syscall(__NR_gettid), nm, nm->reading, nm->writing, nm->waitingR, nm->waitingW);
-	}
 	if (nm->writing + nm->waitingW > 0) {
 		nm->waitingR++;
 		semV(&nm->mutex);
+		uint64_t begin = beginWait();
 		semP(&nm->readers);
+		countWait(nm, begin);
 		nm->waitingR--;
 	}
 	nm->reading++;
+	countEntry(nm, false);
+	traceState(TRACE_READER_ENTRY, nm);
 	if (nm->waitingR > 0) {
 		semV(&nm->readers);
 	} else {
@@ -150,9 +609,7 @@ void nmReaderEnter(NodeMonitor * nm) {
 
 void nmReaderExit(NodeMonitor * nm) {
 	semP(&nm->mutex);
-	if (PROTOCOL_DEBUG != 0) {
-		fprintf(stderr, "Thread %ld: Reader Exit at %p.\n%d, %d, %d, %d\n\n", syscall(__NR_gettid), nm, nm->reading, nm->writing, nm->waitingR, nm->waitingW);
-	}
+	traceState(TRACE_READER_EXIT, nm);
 	nm->reading--;
 	if (nm->reading == 0 && nm->waitingW > 0) {
 		semV(&nm->writers);
@@ -162,27 +619,38 @@ void nmReaderExit(NodeMonitor * nm) {
 }
 
 void nmWriterEnter(NodeMonitor * nm) {
-	semP(&nm->entryMutex);
 	semP(&nm->mutex);
-	semV(&nm->entryMutex);
-	if (PROTOCOL_DEBUG != 0) {
-		fprintf(stderr, "Thread %ld: Writer Entry at %p.\n%d, %d, %d, %d\n\n", syscall(__NR_gettid), nm, nm->reading, nm->writing, nm->waitingR, nm->waitingW);
-	}
 	if (nm->reading + nm->writing > 0) {
 		nm->waitingW++;
 		semV(&nm->mutex);
+		uint64_t begin = beginWait();
 		semP(&nm->writers);
+		countWait(nm, begin);
 		nm->waitingW--;
 	}
 	nm->writing++;
+	countEntry(nm, true);
+	traceState(TRACE_WRITER_ENTRY, nm);
 	semV(&nm->mutex);
 }
 
-void nmWriterExit(NodeMonitor * nm) {
+// Only waits for `mutex`, which is held briefly, and never while waiting for the node.
+bool nmWriterTryEnter(NodeMonitor * nm) {
 	semP(&nm->mutex);
-	if (PROTOCOL_DEBUG != 0) {
-		fprintf(stderr, "Thread %ld: Writer Exit at %p.\n%d, %d, %d, %d\n\n", syscall(__NR_gettid), nm, nm->reading, nm->writing, nm->waitingR, nm->waitingW);
+	if (nm->reading + nm->writing + nm->waitingW > 0) {
+		semV(&nm->mutex);
+		return false;
 	}
+	nm->writing++;
+	countEntry(nm, true);
+	traceState(TRACE_WRITER_ENTRY, nm);
+	semV(&nm->mutex);
+	return true;
+}
+
+void nmWriterExit(NodeMonitor * nm) {
+	semP(&nm->mutex);
+	traceState(TRACE_WRITER_EXIT, nm);
 	nm->writing--;
 	if (nm->waitingR > 0) {
 		semV(&nm->readers);
@@ -193,16 +661,4 @@ void nmWriterExit(NodeMonitor * nm) {
 	}
 }
 
-void nmLock(NodeMonitor * nm) {
-	if (PROTOCOL_DEBUG != 0) {
-		fprintf(stderr, "Thread %ld: Lock at %p.\n%d, %d, %d, %d\n\n", syscall(__NR_gettid), nm, nm->reading, nm->writing, nm->waitingR, nm->waitingW);
-	}
-	semP(&nm->entryMutex);
-}
-
-void nmUnlock(NodeMonitor * nm) {
-	if (PROTOCOL_DEBUG != 0) {
-		fprintf(stderr, "Thread %ld: Unlock at %p.\n%d, %d, %d, %d\n\n", syscall(__NR_gettid), nm, nm->reading, nm->writing, nm->waitingR, nm->waitingW);
-	}
-	semV(&nm->entryMutex);
-}
\ No newline at end of file
+#endif
@@ -1,17 +1,69 @@
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "Semaphore.h"
 
-#define PROTOCOL_DEBUG 0
+// Contention counters of a node, kept only if built with TREE_STATS.
+#ifdef TREE_STATS
+	#define NM_STATS 1
+#else
+	#define NM_STATS 0
+#endif
+
+typedef struct NodeMonitorCounters {
+	uint64_t readerEntries, writerEntries;
+	uint64_t waits; // Entries which had to wait for other threads, once for every reason.
+	uint64_t waitNanoseconds;
+} NodeMonitorCounters;
+
+// Reader bias of busy nodes, only in the atomic variant, see NodeMonitor.c.
+#if defined(TREE_READER_BIAS) && defined(TREE_ATOMIC_NODE_MONITOR)
+	#define NM_BIAS 1
+#else
+	#define NM_BIAS 0
+#endif
+
+#if NM_STATS
+typedef struct NodeMonitorStats {
+	atomic_ulong readerEntries, writerEntries, waits, waitNanoseconds;
+} NodeMonitorStats;
+#endif
+
+#ifdef TREE_ATOMIC_NODE_MONITOR
+
+// The whole state of the monitor in one word, so that an uncontended entry or exit
+// is a single compare-and-swap. Threads which have to wait park on a futex.
+typedef struct NodeMonitor {
+	_Atomic(uint64_t) state; // Counters and flags, see NodeMonitor.c.
+	// Futex words of parked readers and writers, bumped whenever they are woken up.
+	atomic_uint readersSequence, writersSequence;
+	atomic_uint version; // See `nmVersion`. Takes the padding after the futex words.
+	// Futex word of a writer waiting for biased readers to leave, and contended reader
+	// entries since the last writer, which enable the bias once they reach NM_BIAS_THRESHOLD.
+	atomic_uint drainSequence, contention;
+#if NM_STATS
+	// Next to the state, whose cache line entries take over anyway.
+	NodeMonitorStats stats;
+#endif
+} NodeMonitor;
+
+#else
 
 typedef struct NodeMonitor {
 	int reading, writing, waitingR, waitingW; // waiting for R(eading), W(riting).
-	Semaphore mutex, entryMutex; // pthread_mutex_t does not allow semaphore inheritance.
+	Semaphore mutex; // pthread_mutex_t does not allow semaphore inheritance.
 	Semaphore readers, writers;
+	atomic_uint version; // See `nmVersion`.
+#if NM_STATS
+	NodeMonitorStats stats;
+#endif
 } NodeMonitor;
 
+#endif
+
 // `Readers` are threads executing the `list` and `find` operations.
 // `Writers` are threads executing the `create`, `remove`, and `move` operations.
 
@@ -29,11 +81,24 @@ void nmReaderExit(NodeMonitor * nm);
 
 void nmWriterEnter(NodeMonitor * nm);
 
+// Enters as a writer only if that needs no waiting for other threads, and returns whether it did.
+bool nmWriterTryEnter(NodeMonitor * nm);
+
 void nmWriterExit(NodeMonitor * nm);
 
-// Locks the node to prevent threads from gaining access to it just after a move operation,
-// before all threads from before the move have exited. In short -- disables entry protocols.
-void nmLock(NodeMonitor * nm);
+// Reads the contention counters of the node, all zero unless built with TREE_STATS.
+// They are updated without synchronization, so they may be slightly behind each other.
+void nmCounters(NodeMonitor * nm, NodeMonitorCounters * counters);
+
+// The version of the node, which its writers bump with `nmBumpVersion` both before and after
+// removing any of its children (or moving them away), so that it is odd meanwhile. A thread
+// which found a child without holding a lock on the node knows that it is still there,
+// as long as the version it read before the lookup was even and has not changed since.
+// Both are sequentially consistent, and do not synchronize with the protocols above.
+static inline unsigned nmVersion(NodeMonitor * nm) {
+	return atomic_load(&nm->version);
+}
 
-// Unlocks the node and lets the protocols continue as normal.
-void nmUnlock(NodeMonitor * nm);
\ No newline at end of file
+static inline void nmBumpVersion(NodeMonitor * nm) {
+	atomic_fetch_add(&nm->version, 1);
+}
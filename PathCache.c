@@ -0,0 +1,275 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PathCache.h"
+
+/**
+ * The cache is a set-associative table: the hash of a path prefix selects a bucket,
+ * and the prefix may be cached in any of its ways, replaced in round-robin order.
+ *
+ * Each bucket is protected by a sequence lock. Writers take it with a compare-and-swap
+ * and give up if it is taken. Readers copy an entry optimistically, and treat a concurrent
+ * write as a miss. All the fields of an entry are atomic words, accessed with relaxed
+ * operations and ordered by fences around the sequence number.
+ */
+
+#define CACHE_LINE_SIZE 64
+
+#define WAYS 4
+
+// How many of the deepest prefixes of a path are looked up before giving up.
+#define PROBES 3
+
+#define PATH_WORDS (PATH_CACHE_MAX_LENGTH / 8)
+
+// Hit and miss counters are spread over several cache lines, to keep lookups
+// from different threads from contending on them.
+#define STRIPES 16
+
+typedef struct Entry {
+	_Atomic(uint64_t) hash; // Zero for an empty entry.
+	_Atomic(uint64_t) stamp;
+	_Atomic(uint64_t) shape; // Length of the prefix, and its depth in the upper half.
+	_Atomic(void *) node;
+	_Atomic(Generation *) chain[PATH_CACHE_MAX_DEPTH];
+	_Atomic(uint64_t) path[PATH_WORDS]; // The prefix, padded with zeros.
+} Entry;
+
+typedef struct Bucket {
+	_Alignas(CACHE_LINE_SIZE) atomic_uint sequence; // Odd while an entry is being written.
+	unsigned next; // Way to be replaced next. Protected by `sequence`.
+	Entry entries[WAYS];
+} Bucket;
+
+typedef struct Counters {
+	_Alignas(CACHE_LINE_SIZE) atomic_ulong hits;
+	atomic_ulong misses;
+} Counters;
+
+struct PathCache {
+	Counters counters[STRIPES];
+	size_t mask; // Number of buckets minus one.
+	Bucket buckets[];
+};
+
+// Generations and stamps are read from the same clock, which advances on every invalidation.
+static _Atomic(uint64_t) generationClock = 0;
+// Entries stamped before this time are expired, see `pcExpire`.
+static _Atomic(uint64_t) expiryTime = 0;
+
+static atomic_uint nextStripe = 0;
+static _Thread_local unsigned threadStripe = STRIPES;
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t hashStep(uint64_t hash, char c) {
+	return (hash ^ (unsigned char)c) * FNV_PRIME;
+}
+
+static uint64_t hashFinish(uint64_t hash, size_t length) {
+	hash ^= length;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash | 1; // Never zero, which marks empty entries.
+}
+
+static uint64_t hashPrefix(const char * path, size_t length) {
+	uint64_t hash = FNV_OFFSET;
+	for (size_t i = 0; i < length; i++) {
+		hash = hashStep(hash, path[i]);
+	}
+	return hashFinish(hash, length);
+}
+
+static void packPath(const char * path, size_t length, uint64_t words[PATH_WORDS]) {
+	memset(words, 0, PATH_WORDS * sizeof(uint64_t));
+	memcpy(words, path, length);
+}
+
+static Counters * threadCounters(PathCache * cache) {
+	if (threadStripe == STRIPES) {
+		threadStripe = atomic_fetch_add_explicit(&nextStripe, 1, memory_order_relaxed) % STRIPES;
+	}
+	return &cache->counters[threadStripe];
+}
+
+PathCache * pcNew(size_t budget) {
+	size_t buckets = 1;
+	while (sizeof(PathCache) + 2 * buckets * sizeof(Bucket) <= budget) {
+		buckets *= 2;
+	}
+
+	PathCache * cache = aligned_alloc(CACHE_LINE_SIZE, sizeof(PathCache) + buckets * sizeof(Bucket));
+	if (cache == NULL) {
+		return NULL;
+	}
+	// All-zero is a valid, empty state of every field.
+	memset(cache, 0, sizeof(PathCache) + buckets * sizeof(Bucket));
+	cache->mask = buckets - 1;
+	return cache;
+}
+
+void pcFree(PathCache * cache) {
+	free(cache);
+}
+
+uint64_t pcStamp(void) {
+	return atomic_load(&generationClock);
+}
+
+void pcInvalidate(Generation * generation) {
+	// The node must look invalidated before the clock advances. Otherwise, a walk stamped
+	// with the new time could still validate an older entry through it, and cache a deeper
+	// entry which the final generation would not invalidate.
+	atomic_store(generation, UINT64_MAX);
+	atomic_store(generation, atomic_fetch_add(&generationClock, 1) + 1);
+}
+
+void pcExpire(void) {
+	// The nodes removed before the call were invalidated at the latest at this time,
+	// so only entries stamped earlier can lead through them.
+	uint64_t now = atomic_load(&generationClock);
+	uint64_t expired = atomic_load(&expiryTime);
+	while (expired < now && !atomic_compare_exchange_weak(&expiryTime, &expired, now));
+}
+
+// Looks up a single prefix. Returns its node and fills `chain` on a valid hit.
+static void * probe(PathCache * cache, const char * path, size_t length, uint64_t hash,
+                    int depth, Generation * chain[PATH_CACHE_MAX_DEPTH]) {
+	Bucket * bucket = &cache->buckets[hash & cache->mask];
+	unsigned sequence = atomic_load_explicit(&bucket->sequence, memory_order_acquire);
+	if ((sequence & 1) != 0) {
+		return NULL;
+	}
+
+	Entry * entry = NULL;
+	for (int way = 0; way < WAYS; way++) {
+		if (atomic_load_explicit(&bucket->entries[way].hash, memory_order_relaxed) == hash) {
+			entry = &bucket->entries[way];
+			break;
+		}
+	}
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	uint64_t shape = atomic_load_explicit(&entry->shape, memory_order_relaxed);
+	uint64_t stamp = atomic_load_explicit(&entry->stamp, memory_order_relaxed);
+	void * node = atomic_load_explicit(&entry->node, memory_order_relaxed);
+	uint64_t words[PATH_WORDS];
+	for (int i = 0; i < PATH_WORDS; i++) {
+		words[i] = atomic_load_explicit(&entry->path[i], memory_order_relaxed);
+	}
+	for (int i = 0; i < depth; i++) {
+		chain[i] = atomic_load_explicit(&entry->chain[i], memory_order_relaxed);
+	}
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&bucket->sequence, memory_order_relaxed) != sequence) {
+		return NULL;
+	}
+
+	// The copy is consistent, check that it is the right prefix...
+	uint64_t expected[PATH_WORDS];
+	packPath(path, length, expected);
+	if (shape != (length | (uint64_t)depth << 32) || memcmp(words, expected, sizeof(words)) != 0) {
+		return NULL;
+	}
+	// ...and that it still leads to the same node, whose memory is still there if it has not expired.
+	if (stamp < atomic_load(&expiryTime)) {
+		return NULL;
+	}
+	for (int i = 0; i < depth; i++) {
+		if (atomic_load(chain[i]) > stamp) {
+			return NULL;
+		}
+	}
+	return node;
+}
+
+void * pcLookup(PathCache * cache, const char * path, size_t * length,
+                Generation * chain[PATH_CACHE_MAX_DEPTH], int * depth) {
+	// Hash all the cacheable prefixes in a single pass.
+	size_t lengths[PATH_CACHE_MAX_DEPTH];
+	uint64_t hashes[PATH_CACHE_MAX_DEPTH];
+	int prefixes = 0;
+	uint64_t hash = hashStep(FNV_OFFSET, path[0]);
+	for (size_t i = 1; path[i] != '\0' && i < PATH_CACHE_MAX_LENGTH && prefixes < PATH_CACHE_MAX_DEPTH; i++) {
+		hash = hashStep(hash, path[i]);
+		if (path[i] == '/') {
+			lengths[prefixes] = i + 1;
+			hashes[prefixes] = hashFinish(hash, i + 1);
+			prefixes++;
+		}
+	}
+
+	for (int probes = 0; probes < PROBES && prefixes > 0; probes++) {
+		prefixes--;
+		void * node = probe(cache, path, lengths[prefixes], hashes[prefixes], prefixes + 1, chain);
+		if (node != NULL) {
+			atomic_fetch_add_explicit(&threadCounters(cache)->hits, 1, memory_order_relaxed);
+			*length = lengths[prefixes];
+			*depth = prefixes + 1;
+			return node;
+		}
+	}
+
+	atomic_fetch_add_explicit(&threadCounters(cache)->misses, 1, memory_order_relaxed);
+	return NULL;
+}
+
+void pcInsert(PathCache * cache, const char * path, size_t length, uint64_t stamp,
+              Generation * const chain[], int depth, void * node) {
+	if (depth < 1 || depth > PATH_CACHE_MAX_DEPTH || length > PATH_CACHE_MAX_LENGTH) {
+		return;
+	}
+
+	uint64_t hash = hashPrefix(path, length);
+	Bucket * bucket = &cache->buckets[hash & cache->mask];
+	unsigned sequence = atomic_load_explicit(&bucket->sequence, memory_order_relaxed);
+	if ((sequence & 1) != 0 || !atomic_compare_exchange_strong_explicit(&bucket->sequence,
+	    &sequence, sequence + 1, memory_order_relaxed, memory_order_relaxed)) {
+		return;
+	}
+	atomic_thread_fence(memory_order_release);
+
+	// Overwrite an older entry for the same prefix, or the next way in turn.
+	int way;
+	for (way = 0; way < WAYS; way++) {
+		if (atomic_load_explicit(&bucket->entries[way].hash, memory_order_relaxed) == hash) {
+			break;
+		}
+	}
+	if (way == WAYS) {
+		way = bucket->next;
+		bucket->next = (bucket->next + 1) % WAYS;
+	}
+
+	Entry * entry = &bucket->entries[way];
+	uint64_t words[PATH_WORDS];
+	packPath(path, length, words);
+	atomic_store_explicit(&entry->hash, hash, memory_order_relaxed);
+	atomic_store_explicit(&entry->stamp, stamp, memory_order_relaxed);
+	atomic_store_explicit(&entry->shape, length | (uint64_t)depth << 32, memory_order_relaxed);
+	atomic_store_explicit(&entry->node, node, memory_order_relaxed);
+	for (int i = 0; i < PATH_WORDS; i++) {
+		atomic_store_explicit(&entry->path[i], words[i], memory_order_relaxed);
+	}
+	for (int i = 0; i < depth; i++) {
+		atomic_store_explicit(&entry->chain[i], chain[i], memory_order_relaxed);
+	}
+
+	atomic_store_explicit(&bucket->sequence, sequence + 2, memory_order_release);
+}
+
+void pcStats(PathCache * cache, uint64_t * hits, uint64_t * misses) {
+	*hits = *misses = 0;
+	for (int i = 0; i < STRIPES; i++) {
+		*hits += atomic_load_explicit(&cache->counters[i].hits, memory_order_relaxed);
+		*misses += atomic_load_explicit(&cache->counters[i].misses, memory_order_relaxed);
+	}
+}
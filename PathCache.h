@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A cache of path-to-node lookups, in the spirit of the kernel's dentry cache,
+// for the lock-free lookups of the tree.
+//
+// Every node has a generation number, which is bumped whenever the node is moved or removed.
+// An entry remembers the chain of nodes along its path, together with a stamp taken before
+// the walk which found them, and stays valid as long as no node on the chain has a newer
+// generation than the stamp. A hit thus lets a lookup start at the deepest cached prefix
+// of its path, and walk only the rest of it.
+//
+// Lookups and insertions never block. A lookup which races with an insertion into the same
+// bucket simply misses, and an insertion which races with another one is dropped.
+//
+// Validation may read the generation of a node which has been freed since the entry was
+// inserted, so the memory of nodes must be type-stable: reused only for other nodes,
+// which keep their generation numbers. Everything else about a node is only accessed
+// after validation, so the usual epoch rules (see Epoch.h) keep it alive.
+
+// Only prefixes of up to this many components and bytes are cached.
+#define PATH_CACHE_MAX_DEPTH 8
+#define PATH_CACHE_MAX_LENGTH 64
+
+typedef _Atomic(uint64_t) Generation;
+
+typedef struct PathCache PathCache;
+
+// Creates a cache taking at most `budget` bytes (but at least one bucket).
+// Returns NULL if out of memory.
+PathCache * pcNew(size_t budget);
+
+void pcFree(PathCache * cache);
+
+// Returns the stamp to remember for a walk which is about to start.
+uint64_t pcStamp(void);
+
+// Invalidates all the entries going through the node with the given generation.
+// Must be called after the move or removal of the node has been published.
+void pcInvalidate(Generation * generation);
+
+// Makes all the entries inserted so far miss, in every cache. The nodes they lead through
+// may be freed once the lookups in progress are over, as lookups are done in epoch critical
+// sections (see Epoch.h). Only nodes removed before the call may be freed this way.
+void pcExpire(void);
+
+// Finds the deepest cached prefix of `path`, trying at most a few of the deepest ones.
+// On a hit, returns the node at the prefix, sets `*length` to the length of the prefix
+// and `*depth` to the number of its components, and fills `chain` with the generations
+// of the nodes along it. Returns NULL on a miss.
+void * pcLookup(PathCache * cache, const char * path, size_t * length,
+                Generation * chain[PATH_CACHE_MAX_DEPTH], int * depth);
+
+// Caches the first `length` bytes of `path`, made of `depth` components and leading to `node`
+// through nodes with the given generations, as found by a walk which started at `stamp`.
+// Does nothing if the prefix is too long or too deep.
+void pcInsert(PathCache * cache, const char * path, size_t length, uint64_t stamp,
+              Generation * const chain[], int depth, void * node);
+
+// Returns the number of lookups which hit and missed so far.
+void pcStats(PathCache * cache, uint64_t * hits, uint64_t * misses);
@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Ring.h"
+
+/**
+ * The cell at position p (modulo the capacity) holds the sequence number p while it is free
+ * for the push at p, and p + 1 once that push has copied its element in. The pop at p then
+ * copies it out and sets the sequence number to p + capacity, freeing it for the next turn.
+ * A thread reads the sequence number of the cell at the position it would take next:
+ * if it is ready, it claims the position by advancing the head or the tail, and otherwise
+ * the queue is either full (or empty), or another thread claimed the position meanwhile.
+ */
+
+typedef struct RingCell {
+	atomic_size_t sequence;
+	_Alignas(max_align_t) unsigned char element[];
+} RingCell;
+
+static RingCell * ringCell(Ring * ring, size_t position) {
+	return (RingCell *)(ring->cells + (position & ring->mask) * ring->stride);
+}
+
+int ringInit(Ring * ring, size_t capacity, size_t elementSize) {
+	size_t cells = 1;
+	while (cells < capacity) {
+		cells *= 2;
+	}
+	ring->mask = cells - 1;
+	ring->elementSize = elementSize;
+	ring->stride = (sizeof(RingCell) + elementSize + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+	ring->cells = aligned_alloc(RING_CACHE_LINE_SIZE, (cells * ring->stride + RING_CACHE_LINE_SIZE - 1) & ~(size_t)(RING_CACHE_LINE_SIZE - 1));
+	if (ring->cells == NULL) {
+		return ENOMEM;
+	}
+	for (size_t i = 0; i < cells; i++) {
+		atomic_init(&ringCell(ring, i)->sequence, i);
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+void ringDestroy(Ring * ring) {
+	free(ring->cells);
+}
+
+bool ringPush(Ring * ring, const void * element) {
+	size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	RingCell * cell;
+	while (true) {
+		cell = ringCell(ring, position);
+		intptr_t difference = (intptr_t)(atomic_load_explicit(&cell->sequence, memory_order_acquire) - position);
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (difference < 0) {
+			// The cell still holds the element pushed a turn ago.
+			return false;
+		} else {
+			position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		}
+	}
+	memcpy(cell->element, element, ring->elementSize);
+	atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+	return true;
+}
+
+bool ringPop(Ring * ring, void * element) {
+	size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	RingCell * cell;
+	while (true) {
+		cell = ringCell(ring, position);
+		intptr_t difference = (intptr_t)(atomic_load_explicit(&cell->sequence, memory_order_acquire) - (position + 1));
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (difference < 0) {
+			// Nothing was pushed at this position yet.
+			return false;
+		} else {
+			position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		}
+	}
+	memcpy(element, cell->element, ring->elementSize);
+	atomic_store_explicit(&cell->sequence, position + ring->mask + 1, memory_order_release);
+	return true;
+}
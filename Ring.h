@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A bounded queue of fixed-size elements, which any number of threads may push to and pop from
+// without locks. Every cell has a sequence number telling which turn of the queue it is ready for,
+// so that pushing or popping claims a position with a single compare-and-swap, and copying the
+// element in or out never contends with the threads at the other positions.
+// Used for the submission and completion rings of the tree (see `tree_ring_open`).
+
+#define RING_CACHE_LINE_SIZE 64
+
+typedef struct Ring {
+	size_t mask; // The capacity minus one, a power of two.
+	size_t elementSize;
+	size_t stride; // The size of a cell, with its sequence number.
+	unsigned char * cells;
+	_Alignas(RING_CACHE_LINE_SIZE) atomic_size_t head; // The position of the next pop.
+	_Alignas(RING_CACHE_LINE_SIZE) atomic_size_t tail; // The position of the next push.
+} Ring;
+
+// Initializes an empty queue of at least `capacity` elements of `elementSize` bytes.
+// Returns 0 on success, and ENOMEM otherwise.
+int ringInit(Ring * ring, size_t capacity, size_t elementSize);
+
+void ringDestroy(Ring * ring);
+
+// Copies the element to the back of the queue. Returns false if the queue is full.
+bool ringPush(Ring * ring, const void * element);
+
+// Moves the element at the front of the queue into `element`. Returns false if the queue is empty.
+// An element whose push is still in progress counts as not being there yet.
+bool ringPop(Ring * ring, void * element);
@@ -5,6 +5,57 @@
 
 #include "Semaphore.h"
 
+#ifdef TREE_FUTEX_SEMAPHORE
+
+#include "Futex.h"
+
+int semInit (Semaphore * s, int permits) {
+	if (s == NULL) {
+		return 0;
+	}
+
+	atomic_init(&s->value, permits);
+	atomic_init(&s->wakeups, 0);
+	return 0;
+}
+
+int semDestroy (Semaphore * s) {
+	(void)s;
+	return 0;
+}
+
+void semP (Semaphore * s) {
+	// Fast path: a free permit, and nobody waiting for one.
+	if (atomic_fetch_sub(&s->value, 1) > 0) {
+		return;
+	}
+
+	// Otherwise, wait until a permit is handed over.
+	for (;;) {
+		unsigned wakeups = atomic_load(&s->wakeups);
+		if (wakeups > 0) {
+			if (atomic_compare_exchange_weak(&s->wakeups, &wakeups, wakeups - 1)) {
+				return;
+			}
+		} else {
+			futexWait(&s->wakeups, 0);
+		}
+	}
+}
+
+void semV (Semaphore * s) {
+	// Fast path: nobody is waiting, so the permit is just returned.
+	if (atomic_fetch_add(&s->value, 1) >= 0) {
+		return;
+	}
+
+	// Otherwise, hand the permit over to one of the waiting threads.
+	atomic_fetch_add(&s->wakeups, 1);
+	futexWake(&s->wakeups, 1);
+}
+
+#else
+
 int semInit (Semaphore * s, int permits) {
 	if (s == NULL) {
 		return 0;
@@ -83,4 +134,6 @@ void semV (Semaphore * s) {
 	if ((err = pthread_mutex_unlock(&s->mutex)) != 0) {
 		syserr("semV mutex unlock %d", err);
 	}
-}
\ No newline at end of file
+}
+
+#endif
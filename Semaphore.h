@@ -4,12 +4,29 @@
 
 #include <pthread.h>
 
+#ifdef TREE_FUTEX_SEMAPHORE
+
+#include <stdatomic.h>
+
+// A semaphore built directly on futexes: P and V are a single atomic operation when
+// there is no contention, and only make a system call when a thread has to wait or
+// has to be woken up. A permit released while threads are waiting is always handed
+// over to one of them, so newly arriving threads cannot barge in.
+typedef struct Semaphore {
+	atomic_int value; // Free permits if non-negative, minus the number of waiting threads otherwise.
+	atomic_uint wakeups; // Permits handed over to waiting threads, not yet taken. The futex word.
+} Semaphore;
+
+#else
+
 typedef struct Semaphore {
 	int permits, waiting;
 	pthread_mutex_t mutex;
 	pthread_cond_t forPermit;
 } Semaphore;
 
+#endif
+
 // Init and Destroy functions return 0 if and only if they succeed.
 // Failure of the other functions result in the total collapse of the known universe
 // and the universe beyond what is known, including the protocols, which are left
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "err.h"
+
+#include "Trace.h"
+
+/**
+ * Buffers are registered like the records of Epoch.c: in a list which only grows,
+ * with the buffers of threads that exited reused by new ones. A reused buffer keeps
+ * the events of its previous thread until they are overwritten.
+ *
+ * Only the owner writes to a buffer, but a dump may read it at the same time. Every slot
+ * is thus guarded by its own sequence number, as in a seqlock: the owner invalidates it,
+ * writes the event, and then stores the index of the event in it. A dump keeps only the events
+ * whose slots held the expected index both before and after reading them, so it never returns
+ * an event torn by an overwrite, and the owner never waits for it.
+ */
+
+#define CACHE_LINE_SIZE 64
+
+#define EMPTY_SLOT UINT64_MAX
+
+_Static_assert((TRACE_BUFFER_EVENTS & (TRACE_BUFFER_EVENTS - 1)) == 0, "TRACE_BUFFER_EVENTS must be a power of two");
+
+typedef struct TraceSlot {
+	_Atomic(uint64_t) sequence; // The index of the event in the slot, EMPTY_SLOT while written.
+	_Atomic(uint64_t) words[4]; // The event, packed by `traceRecord`.
+} TraceSlot;
+
+typedef struct TraceBuffer TraceBuffer;
+
+struct TraceBuffer {
+	_Alignas(CACHE_LINE_SIZE) _Atomic(uint64_t) head; // The number of events ever recorded.
+	atomic_bool inUse;
+	TraceBuffer * next; // Immutable once the buffer is published.
+	TraceSlot slots[TRACE_BUFFER_EVENTS];
+};
+
+atomic_bool traceEnabled = false;
+
+static _Atomic(TraceBuffer *) buffers = NULL;
+
+static pthread_once_t bufferKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t bufferKey;
+
+static _Thread_local TraceBuffer * threadBuffer = NULL;
+static _Thread_local uint32_t threadId = 0;
+
+static void releaseBuffer(void * buffer) {
+	threadBuffer = NULL;
+	atomic_store_explicit(&((TraceBuffer *)buffer)->inUse, false, memory_order_release);
+}
+
+static void createBufferKey(void) {
+	int err;
+	if ((err = pthread_key_create(&bufferKey, releaseBuffer)) != 0) {
+		syserr("trace key create %d", err);
+	}
+}
+
+static TraceBuffer * registerThread(void) {
+	pthread_once(&bufferKeyOnce, createBufferKey);
+
+	TraceBuffer * buffer;
+	for (buffer = atomic_load(&buffers); buffer != NULL; buffer = buffer->next) {
+		bool unused = false;
+		if (atomic_compare_exchange_strong(&buffer->inUse, &unused, true)) {
+			break;
+		}
+	}
+
+	if (buffer == NULL) {
+		buffer = aligned_alloc(CACHE_LINE_SIZE, sizeof(TraceBuffer));
+		if (buffer == NULL) {
+			syserr("trace buffer alloc");
+		}
+		atomic_init(&buffer->head, 0);
+		atomic_init(&buffer->inUse, true);
+		for (size_t i = 0; i < TRACE_BUFFER_EVENTS; i++) {
+			atomic_init(&buffer->slots[i].sequence, EMPTY_SLOT);
+		}
+		buffer->next = atomic_load(&buffers);
+		while (!atomic_compare_exchange_weak(&buffers, &buffer->next, buffer));
+	}
+
+	int err;
+	if ((err = pthread_setspecific(bufferKey, buffer)) != 0) {
+		syserr("trace set specific %d", err);
+	}
+	threadBuffer = buffer;
+	if (threadId == 0) {
+		threadId = (uint32_t)syscall(SYS_gettid);
+	}
+	return buffer;
+}
+
+void traceSetEnabled(bool enabled) {
+	atomic_store(&traceEnabled, enabled);
+}
+
+void traceRecord(TraceType type, unsigned flags, const void * node, uint64_t argument) {
+	TraceBuffer * buffer = threadBuffer != NULL ? threadBuffer : registerThread();
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+	TraceSlot * slot = &buffer->slots[head & (TRACE_BUFFER_EVENTS - 1)];
+	atomic_store_explicit(&slot->sequence, EMPTY_SLOT, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&slot->words[0], (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec, memory_order_relaxed);
+	atomic_store_explicit(&slot->words[1], (uint64_t)(uintptr_t)node, memory_order_relaxed);
+	atomic_store_explicit(&slot->words[2], argument, memory_order_relaxed);
+	atomic_store_explicit(&slot->words[3], threadId | (uint64_t)type << 32 | (uint64_t)flags << 48, memory_order_relaxed);
+	atomic_store_explicit(&slot->sequence, head, memory_order_release);
+	atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+// Copies the events of a buffer which are not being overwritten, oldest first.
+// Returns their number.
+static size_t collect(TraceBuffer * buffer, TraceEvent * events) {
+	uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+	uint64_t first = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+	size_t count = 0;
+	for (uint64_t i = first; i < head; i++) {
+		TraceSlot * slot = &buffer->slots[i & (TRACE_BUFFER_EVENTS - 1)];
+		if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != i) {
+			continue;
+		}
+		uint64_t words[4];
+		for (int j = 0; j < 4; j++) {
+			words[j] = atomic_load_explicit(&slot->words[j], memory_order_relaxed);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != i) {
+			continue;
+		}
+		events[count++] = (TraceEvent){
+			.timestamp = words[0],
+			.node = words[1],
+			.argument = words[2],
+			.thread = (uint32_t)words[3],
+			.type = (uint16_t)(words[3] >> 32),
+			.flags = (uint16_t)(words[3] >> 48),
+		};
+	}
+	return count;
+}
+
+int traceDump(const char * path) {
+	TraceEvent * events = malloc(TRACE_BUFFER_EVENTS * sizeof(TraceEvent));
+	if (events == NULL) {
+		return ENOMEM;
+	}
+	FILE * file = fopen(path, "wb");
+	if (file == NULL) {
+		int err = errno;
+		free(events);
+		return err;
+	}
+
+	// Buffers are only ever added in front, so walking from the same one counts and writes the same.
+	TraceBuffer * head = atomic_load(&buffers);
+	TraceDumpHeader header = {.magic = TRACE_DUMP_MAGIC, .buffers = 0};
+	for (TraceBuffer * buffer = head; buffer != NULL; buffer = buffer->next) {
+		header.buffers++;
+	}
+
+	errno = 0;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (TraceBuffer * buffer = head; buffer != NULL && written; buffer = buffer->next) {
+		uint64_t count = collect(buffer, events);
+		written = fwrite(&count, sizeof(count), 1, file) == 1
+		          && fwrite(events, sizeof(TraceEvent), count, file) == count;
+	}
+	int err = written ? 0 : (errno != 0 ? errno : EIO);
+	free(events);
+	if (fclose(file) != 0 && err == 0) {
+		err = errno;
+	}
+	return err;
+}
+
+const char * traceTypeName(TraceType type) {
+	static const char * names[TRACE_TYPES] = {
+		[TRACE_READER_ENTRY] = "reader-entry",
+		[TRACE_READER_EXIT] = "reader-exit",
+		[TRACE_WRITER_ENTRY] = "writer-entry",
+		[TRACE_WRITER_EXIT] = "writer-exit",
+		[TRACE_TRACEBACK_BEGIN] = "traceback-begin",
+		[TRACE_TRACEBACK_END] = "traceback-end",
+		[TRACE_FIND_TWO_BEGIN] = "find-two-begin",
+		[TRACE_FIND_TWO_END] = "find-two-end",
+		[TRACE_RESTART] = "restart",
+		[TRACE_BIAS] = "bias",
+		[TRACE_REVOKE] = "revoke",
+	};
+	return type > 0 && type < TRACE_TYPES ? names[type] : "unknown";
+}
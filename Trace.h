@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Tracing of the synchronization protocols, cheap enough to be left enabled under load.
+//
+// Every thread records fixed-size binary events into a ring buffer of its own, without locks
+// or system calls, keeping only its latest TRACE_BUFFER_EVENTS events. `traceDump` writes out
+// all the buffers at any time, and the `tree_trace` tool merges them by timestamp.
+// While tracing is disabled, which is the default, an event costs a single relaxed load.
+
+// Events kept by every thread. Must be a power of two.
+#ifndef TRACE_BUFFER_EVENTS
+	#define TRACE_BUFFER_EVENTS 4096
+#endif
+
+typedef enum TraceType {
+	// Monitor events, whose argument holds the counters of the monitor (see `traceCounter`).
+	TRACE_READER_ENTRY = 1,
+	TRACE_READER_EXIT,
+	TRACE_WRITER_ENTRY,
+	TRACE_WRITER_EXIT,
+	// The argument is the node the traceback goes up to.
+	TRACE_TRACEBACK_BEGIN,
+	TRACE_TRACEBACK_END,
+	// Of `tree_find_two`, at the root. The argument of the end is the lowest common ancestor.
+	TRACE_FIND_TWO_BEGIN,
+	TRACE_FIND_TWO_END,
+	// An optimistic descent starting over, at the node whose version changed.
+	// The argument is the version the descent had seen.
+	TRACE_RESTART,
+	// Monitor events: a node becoming biased towards readers, and a writer done revoking the bias.
+	TRACE_BIAS,
+	TRACE_REVOKE,
+	TRACE_TYPES
+} TraceType;
+
+// Flags of events.
+#define TRACE_WRITE_LOCK 2 // The traceback started with a write lock.
+#define TRACE_INCLUDING 4 // The traceback also released the node it went up to.
+
+typedef struct TraceEvent {
+	uint64_t timestamp; // In nanoseconds of CLOCK_MONOTONIC.
+	uint64_t node; // The identifier of the node, its address (see Wal.h).
+	uint64_t argument; // Depends on the type.
+	uint32_t thread; // The kernel identifier of the thread.
+	uint16_t type;
+	uint16_t flags;
+} TraceEvent;
+
+typedef enum TraceCounter {
+	TRACE_READING,
+	TRACE_WRITING,
+	TRACE_WAITING_READERS,
+	TRACE_WAITING_WRITERS,
+} TraceCounter;
+
+// Packs the counters of a monitor into the argument of an event, 16 bits each, saturating.
+static inline uint64_t tracePackCounters(uint64_t reading, uint64_t writing,
+                                         uint64_t waitingReaders, uint64_t waitingWriters) {
+	uint64_t counters[] = {reading, writing, waitingReaders, waitingWriters};
+	uint64_t argument = 0;
+	for (int i = 0; i < 4; i++) {
+		argument |= (counters[i] < 0xFFFF ? counters[i] : 0xFFFF) << (16 * i);
+	}
+	return argument;
+}
+
+static inline unsigned traceCounter(uint64_t argument, TraceCounter counter) {
+	return (argument >> (16 * counter)) & 0xFFFF;
+}
+
+extern atomic_bool traceEnabled;
+
+// Whether events should be recorded. Callers check it first, so that nothing is computed
+// for events while tracing is disabled.
+static inline bool traceOn(void) {
+	return atomic_load_explicit(&traceEnabled, memory_order_relaxed);
+}
+
+void traceSetEnabled(bool enabled);
+
+// Records an event into the buffer of the calling thread.
+void traceRecord(TraceType type, unsigned flags, const void * node, uint64_t argument);
+
+// A dump starts with this header, followed by the buffers, each of them a uint64_t number
+// of events and then the events, oldest first. Everything is in the byte order of the machine.
+#define TRACE_DUMP_MAGIC "TREETRC1"
+
+typedef struct TraceDumpHeader {
+	char magic[8];
+	uint64_t buffers;
+} TraceDumpHeader;
+
+// Writes the events of all the threads to `path`, while they may still be recording.
+// Returns 0 on success, and an error code otherwise.
+int traceDump(const char * path);
+
+// The name of an event type, for printing.
+const char * traceTypeName(TraceType type);
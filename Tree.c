@@ -1,117 +1,555 @@
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "HashMap.h"
+#include "NameIndex.h"
+#include "Listing.h"
+#include "PathCache.h"
 #include "path_utils.h"
+#include "err.h"
 
 #include "Semaphore.h"
 #include "NodeMonitor.h"
+#include "Epoch.h"
+#include "Wal.h"
+#include "Checkpoint.h"
+#include "Trace.h"
+#include "Ring.h"
+#include "Futex.h"
 
 #include "Tree.h"
 
-#ifndef PROTOCOL_DEBUG
-	#define PROTOCOL_DEBUG 0
+// `inSubTree` counts the threads inside the subtree of a node, and has SUBTREE_WATCHED set while
+// a remove of the node waits for them to leave (see `tree_watch_subtree`).
+// Threads enter and leave with a single atomic operation, and only take the mutex of the node
+// when it is watched. The root is never removed, so it is SUBTREE_UNCOUNTED instead.
+// Each move of the node starts a new generation of it, and counts the threads which were inside
+// until then as earlier ones, until they leave (see `tree_is_draining`). Generations wrap around,
+// which at worst keeps a node draining until it is moved again.
+#define SUBTREE_THREAD ((uint64_t)1)
+#define SUBTREE_THREADS (((uint64_t)1 << 24) - 1)
+#define SUBTREE_EARLIER_SHIFT 24
+#define SUBTREE_EARLIER_THREAD ((uint64_t)1 << SUBTREE_EARLIER_SHIFT)
+#define SUBTREE_EARLIER_THREADS (SUBTREE_THREADS << SUBTREE_EARLIER_SHIFT)
+#define SUBTREE_WATCHED ((uint64_t)1 << 48)
+#define SUBTREE_UNCOUNTED ((uint64_t)1 << 49)
+#define SUBTREE_GENERATION_SHIFT 50
+#define SUBTREE_GENERATION(state) ((unsigned)((state) >> SUBTREE_GENERATION_SHIFT))
+
+// Memory taken by the path cache of each tree, in bytes.
+#ifndef TREE_PATH_CACHE_BUDGET
+	#define TREE_PATH_CACHE_BUDGET (1 << 20)
+#endif
+
+// Nodes whose memory is kept for reuse, see `tree_release_node`. At least 2.
+#ifndef TREE_NODE_POOL_MAX
+	#define TREE_NODE_POOL_MAX 4096
+#endif
+
+// Whether writers find their targets without locking the folders above them,
+// see `tree_find_target`.
+#ifdef TREE_OPTIMISTIC_DESCENT
+	#define OPTIMISTIC_DESCENT 1
+#else
+	#define OPTIMISTIC_DESCENT 0
 #endif
 
+// Optimistic descents which start over this many times fall back to taking the locks.
+#define OPTIMISTIC_ATTEMPTS 4
+
 #include <sys/types.h>
 #include <unistd.h>
-#include <sys/syscall.h>
 
+#define CACHE_LINE_SIZE 64
+
+// Snapshots of a tree are taken at the times of its clock, which advances only when one is taken.
+// Every node remembers the time of its last write, and the first write after a snapshot keeps
+// the contents it is about to change as an immutable version. A snapshot thus shares the current
+// contents of all the nodes written only before it was taken, and sees the right versions of
+// the others. Nodes removed while a snapshot could still see them are kept until it is freed.
+
+typedef struct TreeVersionEntry {
+	const char * name;
+	Tree * child;
+} TreeVersionEntry;
+
+typedef struct TreeVersion TreeVersion;
+
+// The contents of a node, as seen by the snapshots taken before `until`
+// (and not before the next older version).
+struct TreeVersion {
+	uint64_t until;
+	_Atomic(TreeVersion *) older; // Cut off once no snapshot needs the older versions.
+	TreeListing * listing;
+	size_t count;
+	TreeVersionEntry entries[]; // Sorted by name, and followed by the names.
+};
+
+typedef struct TreeHistory {
+	atomic_uint sequence; // Odd while the node is being written.
+	_Atomic(uint64_t) written; // The time of the last write.
+	_Atomic(TreeVersion *) versions; // Newest first.
+} TreeHistory;
+
+// The whole node is a single cache-aligned allocation. The fields touched at every level
+// of `tree_find` come first, so that with the futex-based synchronization primitives,
+// descending through a node touches only its first cache line.
 struct Tree {
-	Tree * parent;
-	Tree * newParent;  // For `move`.
-	int inSubTree;     // Also for `move`.
-	Semaphore * mutex; // For the protection of the above.
-	Semaphore * removeSemaphore; // For safe tracebacks.
+	// Hot: entry protocols, `inSubTree` bookkeeping and the lookup of a child.
+	_Alignas(CACHE_LINE_SIZE) NodeMonitor monitor;
+	_Atomic(uint64_t) inSubTree; // For `remove` and moves, see `tree_enter_subtree`.
+	HashMap contents;
+
+	// Cold: listings, moves and removals.
+	Tree * parent; // Changed by moves between folders, under the rename mutex of the tree.
+	_Atomic(TreeListing *) listing; // Cached listing of `names`, NULL when stale.
+	Semaphore mutex;   // For the protection of `isARemoveWaiting` once watched.
 	bool isARemoveWaiting; // For safe tracebacks.
-	HashMap * contents;
-	NodeMonitor * monitor;
+	Semaphore removeSemaphore; // For safe tracebacks.
+	NameIndex names; // The keys of `contents`, in order, for listing.
+	Generation generation; // Bumped when the node is moved or removed, see PathCache.h.
+	TreeHistory history; // For snapshots, see `tree_begin_write`.
+	// A node removed while snapshots could still see it is kept in the graveyard of the tree,
+	// together with its subtree. Only snapshots taken before `removedAt` can see it.
+	uint64_t removedAt;
+	Tree * nextGrave;
+	uint64_t id; // Identifies the node in the write-ahead log, see `tree_id`.
 };
 
-Tree * tree_new_node(Tree * parent) {
-	Tree * result = (Tree *)malloc(sizeof(Tree));
+struct TreeRoot;
+
+// The snapshots of a tree, see `tree_snapshot`.
+typedef struct TreeSnapshots {
+	_Atomic(uint64_t) clock;
+	atomic_size_t live; // Including the ones being taken.
+	Semaphore mutex;
+	// The list of snapshots, oldest first, and the graveyard, protected by `mutex`.
+	struct TreeRoot * oldest, * newest;
+	Tree * graveyard;
+	// The time of `oldest`, or UINT64_MAX if there is none, readable without the mutex.
+	_Atomic(uint64_t) oldestTime;
+} TreeSnapshots;
+
+// The root of a tree also owns the state shared by the whole tree.
+typedef struct TreeRoot {
+	Tree node;
+	PathCache * cache;
+	// Serializes the moves between directories, the only operations which change
+	// the ancestors of a node, like the rename mutex of a filesystem.
+	Semaphore renameMutex;
+	Wal * wal; // NULL unless the tree was opened with `tree_open`.
+	_Atomic(uint64_t) nextId; // The identifier of the next node created, see `tree_id`.
+	Semaphore ringsMutex; // Guards starting `workers` and changing the list of their rings.
+	struct TreeWorkers * workers; // NULL until the first ring is opened, see `tree_ring_open`.
+	TreeSnapshots snapshots;
+
+	// Snapshots are handles shaped like roots (see `tree_snapshot`), which use only these
+	// fields. `snapshotOf` is NULL in the roots of live trees.
+	Tree * snapshotOf;
+	uint64_t snapshotTime;
+	struct TreeRoot * olderSnapshot, * newerSnapshot;
+} TreeRoot;
+
+// Path cache entries may outlive the nodes they lead through, and read their generations.
+// The memory of nodes is thus kept in a pool, linked through `parent`. Once it holds more than
+// TREE_NODE_POOL_MAX nodes, half of them are handed back to the system: the path caches
+// forget all their entries first, and the nodes are freed after the lookups which could
+// still be validating old ones are over. All of the pool is freed once no trees are left.
+static pthread_mutex_t nodePoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static Tree * nodePool = NULL;
+static size_t pooledNodes = 0;
+static size_t liveTrees = 0;
+
+void tree_lock_node_pool() {
+	int err;
+	if ((err = pthread_mutex_lock(&nodePoolMutex)) != 0) {
+		syserr("node pool lock %d", err);
+	}
+}
+
+void tree_unlock_node_pool() {
+	int err;
+	if ((err = pthread_mutex_unlock(&nodePoolMutex)) != 0) {
+		syserr("node pool unlock %d", err);
+	}
+}
+
+// Returns uninitialized memory for a node, apart from its generation.
+Tree * tree_alloc_node() {
+	tree_lock_node_pool();
+	Tree * result = nodePool;
+	if (result != NULL) {
+		nodePool = result->parent;
+		pooledNodes--;
+	}
+	tree_unlock_node_pool();
+
 	if (result == NULL) {
-		return NULL;
+		result = (Tree *)aligned_alloc(CACHE_LINE_SIZE, sizeof(Tree));
+		if (result != NULL) {
+			atomic_init(&result->generation, 0);
+		}
 	}
+	return result;
+}
 
-	result->parent = parent;
-	result->newParent = NULL;
-	result->inSubTree = 0;
-	result->isARemoveWaiting = false;
+// Frees a list of pooled nodes, linked through `parent`.
+void tree_free_pooled_nodes(void * nodes) {
+	Tree * node = nodes;
+	while (node != NULL) {
+		Tree * next = node->parent;
+		free(node);
+		node = next;
+	}
+}
 
-	result->mutex = (Semaphore *)malloc(sizeof(Semaphore));
-	result->removeSemaphore = (Semaphore *)malloc(sizeof(Semaphore));
-	if (result->mutex == NULL || result->removeSemaphore == NULL ||
-	    semInit(result->mutex, 1) != 0) {
-		free(result->mutex);
-		free(result->removeSemaphore);
-		free(result);
-		return NULL;
+// Returns the memory of a destroyed node to the pool. The generation is kept intact.
+void tree_release_node(Tree * tree) {
+	Tree * excess = NULL;
+	tree_lock_node_pool();
+	tree->parent = nodePool;
+	nodePool = tree;
+	if (++pooledNodes > TREE_NODE_POOL_MAX) {
+		// Keep the nodes released most recently, which are the likeliest to be cached.
+		Tree * last = nodePool;
+		for (size_t i = 1; i < TREE_NODE_POOL_MAX / 2; i++) {
+			last = last->parent;
+		}
+		excess = last->parent;
+		last->parent = NULL;
+		pooledNodes = TREE_NODE_POOL_MAX / 2;
+		pcExpire();
 	}
+	tree_unlock_node_pool();
 
-	if (semInit(result->removeSemaphore, 0) != 0) {
-		semDestroy(result->mutex);
-		free(result->mutex);
-		free(result->removeSemaphore);
-		free(result);
-		return NULL;
+	if (excess != NULL) {
+		epochRetire(excess, tree_free_pooled_nodes);
+	}
+}
+
+// Initializes all of the node except for its generation. Returns 0 on success.
+int tree_init_node(Tree * tree, Tree * parent) {
+	tree->parent = parent;
+	tree->id = 0;
+	atomic_init(&tree->inSubTree, parent == NULL ? SUBTREE_UNCOUNTED : 0);
+	tree->isARemoveWaiting = false;
+	hmap_init(&tree->contents);
+	niInit(&tree->names);
+	atomic_init(&tree->listing, NULL);
+	atomic_init(&tree->history.sequence, 0);
+	atomic_init(&tree->history.written, 0);
+	atomic_init(&tree->history.versions, NULL);
+
+	int err;
+	if ((err = semInit(&tree->mutex, 1)) != 0) {
+		return err;
+	}
+
+	if ((err = semInit(&tree->removeSemaphore, 0)) != 0) {
+		semDestroy(&tree->mutex);
+		return err;
+	}
+
+	if ((err = nmInit(&tree->monitor)) != 0) {
+		semDestroy(&tree->removeSemaphore);
+		semDestroy(&tree->mutex);
+		return err;
 	}
 
-	result->contents = hmap_new();
-	if (result->contents == NULL) {
-		semDestroy(result->removeSemaphore);
-		semDestroy(result->mutex);
-		free(result->removeSemaphore);
-		free(result->mutex);
-		free(result);
+	return 0;
+}
+
+Tree * tree_new_node(Tree * parent) {
+	Tree * result = tree_alloc_node();
+	if (result == NULL) {
 		return NULL;
 	}
 
-	result->monitor = (NodeMonitor *)malloc(sizeof(NodeMonitor));
-	if (result->monitor == NULL || nmInit(result->monitor) != 0) {
-		free(result->monitor);
-		semDestroy(result->removeSemaphore);
-		semDestroy(result->mutex);
-		free(result->removeSemaphore);
-		free(result->mutex);
-		hmap_free(result->contents);
+	if (tree_init_node(result, parent) != 0) {
+		tree_release_node(result);
 		return NULL;
 	}
 
 	return result;
 }
 
+// Memory which lock-free readers may still be accessing is reclaimed
+// only after they have left their epoch critical sections.
+void tree_deferred_free(void * ptr) {
+	epochRetire(ptr, free);
+}
+
+void tree_destroy_node(Tree * tree);
+
+bool tree_is_snapshot(Tree * tree) {
+	return ((TreeRoot *)tree)->snapshotOf != NULL;
+}
+
 Tree * tree_new() {
-	return tree_new_node(NULL);
+	hmap_set_deferred_free(tree_deferred_free);
+
+	TreeRoot * root = (TreeRoot *)aligned_alloc(CACHE_LINE_SIZE, sizeof(TreeRoot));
+	if (root == NULL) {
+		return NULL;
+	}
+	atomic_init(&root->node.generation, 0);
+
+	root->cache = pcNew(TREE_PATH_CACHE_BUDGET);
+	if (root->cache == NULL || tree_init_node(&root->node, NULL) != 0) {
+		if (root->cache != NULL) {
+			pcFree(root->cache);
+		}
+		free(root);
+		return NULL;
+	}
+
+	if (semInit(&root->renameMutex, 1) != 0) {
+		tree_destroy_node(&root->node);
+		pcFree(root->cache);
+		free(root);
+		return NULL;
+	}
+	if (semInit(&root->ringsMutex, 1) != 0) {
+		semDestroy(&root->renameMutex);
+		tree_destroy_node(&root->node);
+		pcFree(root->cache);
+		free(root);
+		return NULL;
+	}
+	if (semInit(&root->snapshots.mutex, 1) != 0) {
+		semDestroy(&root->ringsMutex);
+		semDestroy(&root->renameMutex);
+		tree_destroy_node(&root->node);
+		pcFree(root->cache);
+		free(root);
+		return NULL;
+	}
+	atomic_init(&root->snapshots.clock, 0);
+	atomic_init(&root->snapshots.live, 0);
+	root->snapshots.oldest = root->snapshots.newest = NULL;
+	root->snapshots.graveyard = NULL;
+	atomic_init(&root->snapshots.oldestTime, UINT64_MAX);
+	root->wal = NULL;
+	atomic_init(&root->nextId, 1);
+	root->workers = NULL;
+	root->snapshotOf = NULL;
+
+	tree_lock_node_pool();
+	liveTrees++;
+	tree_unlock_node_pool();
+
+	return &root->node;
 }
 
-void tree_free(Tree * tree) {
+void tree_free_subtree(Tree * tree);
+
+void tree_free_history(TreeHistory * history);
+
+// Destroys the node and frees all of its descendants, but not the memory of the node itself.
+void tree_destroy_node(Tree * tree) {
 	// Free resources not associated with the hashmap.
-	nmDestroy(tree->monitor);
-	free(tree->monitor);
-	semDestroy(tree->mutex);
-	free(tree->mutex);
-	semDestroy(tree->removeSemaphore);
-	free(tree->removeSemaphore);
+	nmDestroy(&tree->monitor);
+	semDestroy(&tree->mutex);
+	semDestroy(&tree->removeSemaphore);
 
 	// Destroy all subtrees.
 	const char * key;
 	void * value;
-	HashMapIterator it = hmap_iterator(tree->contents);
-	while (hmap_next(tree->contents, &it, &key, &value)) {
-		tree_free(value);
+	HashMapIterator it = hmap_iterator(&tree->contents);
+	while (hmap_next(&tree->contents, &it, &key, &value)) {
+		tree_free_subtree(value);
+	}
+
+	// Destroy the hashmap and the index of its keys.
+	hmap_destroy(&tree->contents);
+	niDestroy(&tree->names);
+	listingRelease(atomic_load(&tree->listing));
+	tree_free_history(&tree->history);
+}
+
+// Frees the node and all of its descendants. No thread may access them anymore.
+void tree_free_subtree(Tree * tree) {
+	tree_destroy_node(tree);
+	tree_release_node(tree);
+}
+
+void tree_reclaim_subtree(void * tree) {
+	tree_free_subtree(tree);
+}
+
+void tree_free_snapshot(TreeRoot * snapshot);
+
+void tree_workers_stop(struct TreeWorkers * workers);
+
+void tree_free(Tree * tree) {
+	TreeRoot * root = (TreeRoot *)tree;
+	if (tree_is_snapshot(tree)) {
+		tree_free_snapshot(root);
+		return;
+	}
+	// All the rings were closed, so the workers are idle.
+	if (root->workers != NULL) {
+		tree_workers_stop(root->workers);
+	}
+	if (root->wal != NULL) {
+		walClose(root->wal);
+	}
+	tree_destroy_node(tree);
+	// Reclaim nodes removed earlier, which lock-free readers could still have been accessing.
+	epochSynchronize();
+	semDestroy(&root->renameMutex);
+	semDestroy(&root->ringsMutex);
+	semDestroy(&root->snapshots.mutex);
+	pcFree(root->cache);
+	free(root);
+
+	// With no trees left, there are no path caches which could refer to pooled nodes.
+	tree_lock_node_pool();
+	if (--liveTrees == 0) {
+		tree_free_pooled_nodes(nodePool);
+		nodePool = NULL;
+		pooledNodes = 0;
+	}
+	tree_unlock_node_pool();
+}
+
+// Every thread keeps the trail of the nodes it is inside of, in the order it entered them,
+// and traces back along it instead of following parent pointers. A thread which was inside a node
+// when it was moved thus leaves through the ancestors it entered through, and a move never has to
+// wait for such threads: the parent changes right away, and new threads enter through the new one.
+// A thread is inside at most two paths below their common ancestor (see `tree_find_two`),
+// each at most MAX_PATH_LENGTH / 2 components deep, all of them reached from the root.
+#define MAX_TRAIL_STEPS (MAX_PATH_LENGTH + 1)
+
+// For the first node entered in a path.
+#define NO_STEP (-1)
+
+typedef struct TreeStep {
+	Tree * node; // NULL once the thread has left it.
+	int from; // The step of the node this one was entered from, or NO_STEP.
+	unsigned generation; // Of the node when the thread entered it, see `tree_leave_subtree`.
+} TreeStep;
+
+static _Thread_local TreeStep trail[MAX_TRAIL_STEPS];
+static _Thread_local int trailLength = 0;
+
+// Returns the latest step of the calling thread at the node.
+int tree_trail_find(Tree * tree) {
+	int step = trailLength - 1;
+	while (trail[step].node != tree) {
+		step--;
+	}
+	return step;
+}
+
+// Removes a step from the trail of the calling thread.
+void tree_trail_remove(int step) {
+	trail[step].node = NULL;
+	while (trailLength > 0 && trail[trailLength - 1].node == NULL) {
+		trailLength--;
+	}
+}
+
+// Counts the calling thread inside the subtree of the node, which it entered from the node of
+// the step `from` of its trail, and returns the new step. The thread must hold a lock on the node
+// and, unless it will never trace back above it, also on the node it entered from.
+int tree_enter_subtree(Tree * tree, int from) {
+	if (trailLength == MAX_TRAIL_STEPS) {
+		fatal("trail of the thread is full");
+	}
+	trail[trailLength] = (TreeStep){.node = tree, .from = from, .generation = 0};
+	// Only reading the flag keeps the line of the root shared between the threads.
+	if ((atomic_load_explicit(&tree->inSubTree, memory_order_relaxed) & SUBTREE_UNCOUNTED) == 0) {
+		uint64_t state = atomic_fetch_add(&tree->inSubTree, SUBTREE_THREAD);
+		trail[trailLength].generation = SUBTREE_GENERATION(state);
+	}
+	return trailLength++;
+}
+
+// Stops counting the calling thread inside the subtree of the node, which it entered
+// in the generation `generation`. If the node has been moved since, the thread was
+// counted as an earlier one by the latest move before it leaves, which then waits for
+// one thread less. If a remove is waiting for the threads to leave, lets it proceed
+// after the last of them.
+void tree_leave_subtree(Tree * tree, unsigned generation) {
+	if ((atomic_load_explicit(&tree->inSubTree, memory_order_relaxed) & SUBTREE_UNCOUNTED) != 0) {
+		return;
+	}
+	uint64_t left = atomic_fetch_sub(&tree->inSubTree, SUBTREE_THREAD) - SUBTREE_THREAD;
+	if (SUBTREE_GENERATION(left) != generation) {
+		// Later moves only counted the threads still inside.
+		uint64_t state = atomic_load(&tree->inSubTree);
+		while (SUBTREE_GENERATION(state) == SUBTREE_GENERATION(left)
+		       && !atomic_compare_exchange_weak(&tree->inSubTree, &state, state - SUBTREE_EARLIER_THREAD)) {
+		}
+	}
+	if ((left & SUBTREE_WATCHED) == 0 || (left & SUBTREE_THREADS) > 1) {
+		return;
 	}
 
-	// Destroy the hashmap.
-	hmap_free(tree->contents);
-	// And the tree.
-	free(tree);
+	semP(&tree->mutex);
+	// If a remove operation is waiting, let it remove the node,
+	// now that it is safe for tracebacks.
+	if ((left & SUBTREE_THREADS) == 1 && tree->isARemoveWaiting) {
+		semV(&tree->removeSemaphore);
+	} else {
+		semV(&tree->mutex);
+	}
+}
+
+// Makes the threads leaving the subtree of the node take its mutex when few of them are left,
+// and returns how many are inside. Requires the mutex of the node.
+unsigned tree_watch_subtree(Tree * tree) {
+	return atomic_fetch_or(&tree->inSubTree, SUBTREE_WATCHED) & SUBTREE_THREADS;
+}
+
+// Starts a new generation of the node, which is being moved, and counts the threads inside its
+// subtree as earlier ones. Must be called before the node is reachable at its new path.
+void tree_start_generation(Tree * tree) {
+	uint64_t state = atomic_load(&tree->inSubTree);
+	uint64_t next;
+	do {
+		next = (state & (SUBTREE_THREADS | SUBTREE_WATCHED)) | ((state & SUBTREE_THREADS) << SUBTREE_EARLIER_SHIFT)
+		       | ((uint64_t)(SUBTREE_GENERATION(state) + 1) << SUBTREE_GENERATION_SHIFT);
+	} while (!atomic_compare_exchange_weak(&tree->inSubTree, &state, next));
+}
+
+// Returns whether threads which were inside the subtree of the node when it was last moved,
+// and which thus entered it at its old path, are still inside. Threads which enter it at
+// the new path and take the locks hand-over-hand queue up behind them anyway, while ones
+// which skip the locks above the node could overtake them, so they must take the locks instead.
+// Requires an epoch critical section.
+bool tree_is_draining(Tree * tree) {
+	return (atomic_load(&tree->inSubTree) & SUBTREE_EARLIER_THREADS) != 0;
+}
+
+// Releases the read locks kept by `tree_find_from` on the nodes above `tree` along the trail
+// of the thread, up to the node `upTo`, and also on it if `including`.
+void tree_release_path(Tree * tree, Tree * upTo, bool including) {
+	for (int step = trail[tree_trail_find(tree)].from; step != NO_STEP; step = trail[step].from) {
+		Tree * node = trail[step].node;
+		if (node == upTo && !including) {
+			break;
+		}
+		nmReaderExit(&node->monitor);
+		if (node == upTo) {
+			break;
+		}
+	}
 }
 
 // Starts at a node referenced by the pointer, assuming it has
-// a read lock on it. Travels up the filesystem, reducing
+// a read lock on it. Travels up the trail of the thread, reducing
 // the `inSubTree` counters. Necessary for rollbacks.
 // The `writeLock` argument indicates whether the function starts
 // with a write lock or a read lock.
@@ -119,106 +557,91 @@ void tree_free(Tree * tree) {
 // but must make sure that the nodes it is yet to access, are not removed.
 // Traces back only up to the node pointed to by `upTo` and `including`
 // indicates whether it should also include that node.
+// The trail may end before, at the first node of a path found from below the root.
 void tree_trace_back(Tree * tree, bool writeLock, Tree * upTo, bool including) {
-	if (PROTOCOL_DEBUG) {
-		fprintf(stderr, "Begin traceback at %p %d up to %p %d.\n", tree->monitor, writeLock, upTo->monitor, including);
-	}
 	if (tree == NULL) {
 		return;
 	}
-
-	Tree * parent;
-
-	// Update the inSubTree counter and parent pointer.
-	semP(tree->mutex);
-	parent = tree->parent;
-	tree->inSubTree--;
-	// If there was a move performed and the parent changed,
-	// and no more threads are working in the subtree,
-	// update the parent pointer and unlock entry protocols.
-	if (tree->inSubTree == 0 && tree->newParent != NULL) {
-		tree->parent = tree->newParent;
-		tree->newParent = NULL;
-		nmUnlock(tree->monitor);
+	if (traceOn()) {
+		traceRecord(TRACE_TRACEBACK_BEGIN, (writeLock ? TRACE_WRITE_LOCK : 0) | (including ? TRACE_INCLUDING : 0),
+		            tree, (uintptr_t)upTo);
 	}
-	semV(tree->mutex);
-	// End of update.
 
-	// Release the lock on the starting node.
+	// Update the inSubTree counter, then release the lock on the starting node.
+	int step = tree_trail_find(tree);
+	tree_leave_subtree(tree, trail[step].generation);
 	if (writeLock) {
-		nmWriterExit(tree->monitor);
+		nmWriterExit(&tree->monitor);
 	} else {
-		nmReaderExit(tree->monitor);
-	}
-
-	while ((including && tree != upTo) || (!including && parent != upTo)) {
-		tree = parent;
-		// Update the inSubTree counter and parent pointer.
-		semP(tree->mutex);
-		parent = tree->parent;
-		tree->inSubTree--;
-		// If there was a move performed and the parent changed,
-		// and no more threads are working in the subtree,
-		// update the parent pointer and unlock entry protocols.
-		if (tree->inSubTree == 0 && tree->newParent != NULL) {
-			tree->parent = tree->newParent;
-			tree->newParent = NULL;
-			nmUnlock(tree->monitor);
-			semV(tree->mutex);
-		// If a remove operation is waiting, let it remove the node,
-		// now that it is safe for tracebacks.
-		} else if (tree->inSubTree == 1 && tree->isARemoveWaiting) {
-			semV(tree->removeSemaphore);
-		} else {
-			semV(tree->mutex);
-		}
-		// End of update.
+		nmReaderExit(&tree->monitor);
+	}
+
+	int from = trail[step].from;
+	tree_trail_remove(step);
+	while (from != NO_STEP && ((including && tree != upTo) || (!including && trail[from].node != upTo))) {
+		step = from;
+		tree = trail[step].node;
+		from = trail[step].from;
+		tree_leave_subtree(tree, trail[step].generation);
+		tree_trail_remove(step);
 	}
 
-	if (PROTOCOL_DEBUG) {
-		fprintf(stderr, "End of traceback.\n");
+	if (traceOn()) {
+		traceRecord(TRACE_TRACEBACK_END, 0, tree, (uintptr_t)upTo);
 	}
 }
 
+// Returns the child of `tree` named by the component `i` of `path`, or NULL if there is none.
+// The component is looked up in place, with the hash computed when the path was parsed.
+Tree * tree_child(Tree * tree, const ParsedPath * path, size_t i) {
+	const PathComponent * component = &path->components[i];
+	return hmap_get_hashed(&tree->contents, path_component(path, i), component->length, component->hash);
+}
+
 // Finds the appropriate node by path in the filesystem structure, 
 // returning the pointer to the target node on success, and NULL otherwise.
+// The path followed is made of the components from `first` up to (excluding) `last`
+// of `path`, which may be NULL if there are none, in which case `tree` itself is locked.
 // Guarantees a lock on the target. A read lock if `writeLock` = false,
 // and a write lock if `writeLock` = true. 
 // This function sets errno to 0 on success, and to ENOENT if the path doesn't exist.
 // Anything else means a system error, like a pthread function error.
+// `tree` is entered from the step `from` of the trail of the thread (see `tree_enter_subtree`).
+// With `keepPath`, the read locks on the nodes above the target, from `tree` on, are kept
+// until `tree_release_path` is called, so that none of them can be moved meanwhile.
 
-Tree * tree_find(Tree * tree, const char * path, bool writeLock) {
+Tree * tree_find_from(Tree * tree, int from, const ParsedPath * path, size_t first, size_t last, bool writeLock,
+                      bool keepPath) {
 	Tree * root = tree;
-	if (tree == NULL || path == NULL) {
+	if (tree == NULL) {
 		return NULL;
 	}
 
 	Tree * child;
-	char component[MAX_FOLDER_NAME_LENGTH + 1];
+	Tree * parent = NULL;
 
-	while (!is_root_path(path)) {
+	for (size_t i = first; i < last; i++) {
 		// Gain read access and release read access to parent.
-		nmReaderEnter(tree->monitor);
-		semP(tree->mutex);
-		// This is a funny conditional statement.
-		// If the parent is NULL, that is we are in "/", so we should skip freeing up the parent.
-		// However, if the current vertex is the one we started tree_find in, then we mustn't
+		// If we are in the node we started tree_find in, then we mustn't
 		// meddle with the protocols of its parents.
-		if (tree->parent != NULL && tree != root) {
-			nmReaderExit(tree->parent->monitor);
+		nmReaderEnter(&tree->monitor);
+		from = tree_enter_subtree(tree, from);
+		if (parent != NULL && !keepPath) {
+			nmReaderExit(&parent->monitor);
 		}
-		tree->inSubTree++;
-		semV(tree->mutex);
 
 		// Search for child.
-		path = split_path(path, component);
-		child = hmap_get(tree->contents, component);
+		child = tree_child(tree, path, i);
 		if (child == NULL) {
 			// This is valid, we have a read lock.
+			if (keepPath && tree != root) {
+				tree_release_path(tree, root, true);
+			}
 			tree_trace_back(tree, false, root, true);
 			errno = ENOENT;
 			return NULL;
 		} else {
+			parent = tree;
 			tree = child;
 		}
 	}
@@ -229,36 +652,153 @@ Tree * tree_find(Tree * tree, const char * path, bool writeLock) {
 	// release the lock on the parent, and return.
 
 	if (writeLock) {
-		nmWriterEnter(tree->monitor);
+		nmWriterEnter(&tree->monitor);
 	} else {
-		nmReaderEnter(tree->monitor);
+		nmReaderEnter(&tree->monitor);
 	}
 
-	semP(tree->mutex);
-	if (tree->parent != NULL && tree != root) {
-		nmReaderExit(tree->parent->monitor);
+	tree_enter_subtree(tree, from);
+	if (parent != NULL && !keepPath) {
+		nmReaderExit(&parent->monitor);
 	}
-	tree->inSubTree++;
-	semV(tree->mutex);
 
 	return tree;
 }
 
-// Similar to `tree_find`, but finds two DIFFERENT nodes and acquires ONLY WRITE locks on them.
+Tree * tree_find(Tree * tree, const ParsedPath * path, size_t first, size_t last, bool writeLock) {
+	return tree_find_from(tree, NO_STEP, path, first, last, writeLock, false);
+}
+
+// A node whose child a walk without locks looked up, and its version from before the lookup.
+typedef struct TreeWalkStep {
+	Tree * node;
+	unsigned version;
+} TreeWalkStep;
+
+typedef struct TreeWalk {
+	int depth;
+	bool draining; // Whether a node found was still draining, see `tree_is_draining`.
+	TreeWalkStep steps[MAX_PATH_LENGTH / 2];
+} TreeWalk;
+
+// Follows the first `depth` components of `path` as far as they exist without taking any locks,
+// and records the walk for `tree_validate_walk`. Returns the deepest node found, and sets `*found`
+// to the number of components found, that is, the index of the first missing one.
+// Requires an epoch critical section, which keeps the nodes from being freed.
+Tree * tree_walk(Tree * tree, const ParsedPath * path, size_t depth, TreeWalk * walk, size_t * found) {
+	size_t i = 0;
+	walk->depth = 0;
+	walk->draining = false;
+	for (; i < depth; i++) {
+		walk->steps[walk->depth++] = (TreeWalkStep){.node = tree, .version = nmVersion(&tree->monitor)};
+		Tree * child = tree_child(tree, path, i);
+		if (child == NULL) {
+			break;
+		}
+		tree = child;
+		walk->draining |= tree_is_draining(tree);
+	}
+	*found = i;
+	return tree;
+}
+
+// Returns whether no node of the walk has had a child removed since it was looked up,
+// so that the whole walk is still valid: the path it found is there, and the component
+// it found missing was indeed missing when it was looked up.
+bool tree_validate_walk(const TreeWalk * walk) {
+	// Keeps the lookups of the walk from being reordered after the versions are read again.
+	atomic_thread_fence(memory_order_acquire);
+	for (int i = 0; i < walk->depth; i++) {
+		unsigned version = walk->steps[i].version;
+		if ((version & 1) != 0 || nmVersion(&walk->steps[i].node->monitor) != version) {
+			if (traceOn()) {
+				traceRecord(TRACE_RESTART, 0, walk->steps[i].node, version);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+// Removes the child `component` of the write-locked `parent` from its contents,
+// letting optimistic walks through the parent know (see `nmVersion`).
+void tree_remove_entry(Tree * parent, const char * component) {
+	nmBumpVersion(&parent->monitor);
+	hmap_remove(&parent->contents, component);
+	nmBumpVersion(&parent->monitor);
+}
+
+// Like `tree_find(root, path, 0, depth, true)`, but with the optimistic descent, finds the target without
+// locking the folders above it. Only the target is locked, after which the walk is validated,
+// and it starts over if a folder on the way had a child removed (or moved away) meanwhile.
+// The result is thus the node at `path` at some point while it is locked, as with `tree_find`.
+// Falls back to `tree_find` after a few attempts, or right away if a folder on the way is still
+// draining after a move. Sets `*optimistic` to whether it did not, so that `tree_release_target`
+// knows which locks to release. The epoch critical section of a walk keeps its nodes from being
+// freed, so it must not wait for other threads, which could hold it up for as long as they like,
+// and with it the reclamation of all the removed nodes: a busy target is walked to again instead.
+Tree * tree_find_target(Tree * root, const ParsedPath * path, size_t depth, bool * optimistic) {
+	*optimistic = false;
+	for (int attempt = 0; OPTIMISTIC_DESCENT && attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+		TreeWalk walk;
+		size_t found;
+		epochEnter();
+		Tree * target = tree_walk(root, path, depth, &walk, &found);
+		if (walk.draining) {
+			epochExit();
+			break;
+		}
+		if (found < depth) {
+			bool valid = tree_validate_walk(&walk);
+			epochExit();
+			if (valid) {
+				errno = ENOENT;
+				return NULL;
+			}
+			continue;
+		}
+
+		// A removed target may be locked too, and is only freed once this thread leaves the epoch.
+		// The thread is counted inside before the walk is validated, so that if the target
+		// is being moved, either the move counts it as an earlier thread, or the walk fails.
+		if (!nmWriterTryEnter(&target->monitor)) {
+			epochExit();
+			continue;
+		}
+		tree_enter_subtree(target, NO_STEP);
+		if (tree_validate_walk(&walk)) {
+			epochExit();
+			*optimistic = true;
+			return target;
+		}
+		tree_trace_back(target, true, target, true);
+		epochExit();
+	}
+	return tree_find(root, path, 0, depth, true);
+}
+
+// Releases the write lock on a node found by `tree_find_target`.
+void tree_release_target(Tree * root, Tree * target, bool optimistic) {
+	tree_trace_back(target, true, optimistic ? target : root, true);
+}
+
+// Similar to `tree_find`, but finds two DIFFERENT nodes and acquires ONLY WRITE locks on them,
+// the ones at the first `depth1` components of `path1` and the first `depth2` ones of `path2`.
 
-void tree_find_two(Tree * tree, const char * path1, const char * path2, Tree * * resultLCA, Tree * * result1, Tree * * result2) {
-	if (PROTOCOL_DEBUG) {
-		fprintf(stderr, "Thread %ld: looking for %s and %s\n", syscall(__NR_gettid), path1, path2);
+void tree_find_two(Tree * tree, const ParsedPath * path1, size_t depth1, const ParsedPath * path2, size_t depth2,
+                   Tree * * resultLCA, Tree * * result1, Tree * * result2) {
+	if (traceOn()) {
+		traceRecord(TRACE_FIND_TWO_BEGIN, 0, tree, 0);
 	}
 
 	Tree * root = tree;
-	char LCAPath[MAX_PATH_LENGTH + 1];
-	char SuffixTab1[MAX_PATH_LENGTH + 1];
-	char SuffixTab2[MAX_PATH_LENGTH + 1];
-	char component1[MAX_FOLDER_NAME_LENGTH + 1];
-	char component2[MAX_FOLDER_NAME_LENGTH + 1];
-	char * Suffix1 = SuffixTab1, * Suffix2 = SuffixTab2;
-	split_paths_by_LCA(path1, path2, LCAPath, Suffix1, Suffix2);
+	size_t LCADepth = path_common_depth(path1, path2);
+	if (LCADepth > depth1) {
+		LCADepth = depth1;
+	}
+	if (LCADepth > depth2) {
+		LCADepth = depth2;
+	}
 	*result1 = *result2 = NULL;
 	if (resultLCA) {
 		*resultLCA = NULL;
@@ -267,23 +807,26 @@ void tree_find_two(Tree * tree, const char * path1, const char * path2, Tree * *
 	Tree * LCA, * lesser, * greater;
 	Tree * lesserChild, * greaterChild;
 	bool swappedOrder;
+	const ParsedPath * lesserPath = path1, * greaterPath = path2;
+	size_t lesserDepth = depth1, greaterDepth = depth2;
 
-	if (is_lesser_path(path1, path2)) {
+	if (is_lesser_path_prefix(path1, depth1, path2, depth2)) {
 		swappedOrder = false;
 	} else {
 		swappedOrder = true;
-		char * temp = Suffix1;
-		Suffix1 = Suffix2;
-		Suffix2 = temp;
+		lesserPath = path2;
+		greaterPath = path1;
+		lesserDepth = depth2;
+		greaterDepth = depth1;
 	}
 
 	// Find the LCA.
-	bool isLCAEqualLesser = (is_root_path(Suffix1));
+	bool isLCAEqualLesser = (lesserDepth == LCADepth);
 	if (isLCAEqualLesser) {
-		LCA = tree_find(tree, LCAPath, true);
+		LCA = tree_find(tree, path1, 0, LCADepth, true);
 		lesser = LCA;
 	} else {
-		LCA = tree_find(tree, LCAPath, false);
+		LCA = tree_find(tree, path1, 0, LCADepth, false);
 	}
 	if (LCA == NULL) {
 		return;
@@ -291,9 +834,10 @@ void tree_find_two(Tree * tree, const char * path1, const char * path2, Tree * *
 
 	// Find the lesser node (if not equal to LCA).
 	if (!isLCAEqualLesser) {
-		Suffix1 = (char *)split_path(Suffix1, component1);
-		lesserChild = hmap_get(LCA->contents, component1);
-		lesser = tree_find(lesserChild, Suffix1, true);
+		lesserChild = tree_child(LCA, lesserPath, LCADepth);
+		// The folders on the way stay read-locked until the greater node is found too. Otherwise,
+		// the lesser node could be moved below the greater path, behind threads waiting for it.
+		lesser = tree_find_from(lesserChild, tree_trail_find(LCA), lesserPath, LCADepth + 1, lesserDepth, true, true);
 		if (lesser == NULL) {
 			errno = ENOENT;
 			tree_trace_back(LCA, false, root, true);
@@ -302,9 +846,11 @@ void tree_find_two(Tree * tree, const char * path1, const char * path2, Tree * *
 	}
 
 	// Find the greater node.
-	Suffix2 = (char *)split_path(Suffix2, component2);
-	greaterChild = hmap_get(LCA->contents, component2);
-	greater = tree_find(greaterChild, Suffix2, true);
+	greaterChild = tree_child(LCA, greaterPath, LCADepth);
+	greater = tree_find_from(greaterChild, tree_trail_find(LCA), greaterPath, LCADepth + 1, greaterDepth, true, false);
+	if (!isLCAEqualLesser) {
+		tree_release_path(lesser, LCA, false);
+	}
 	if (greater == NULL) {
 		errno = ENOENT;
 		if (isLCAEqualLesser) {
@@ -320,7 +866,7 @@ void tree_find_two(Tree * tree, const char * path1, const char * path2, Tree * *
 	// (it only ever had a read lock if it wasn't one of the wanted nodes).
 	// Then write the results to the result pointers.
 	if (!isLCAEqualLesser) {
-		nmReaderExit(LCA->monitor);
+		nmReaderExit(&LCA->monitor);
 	}
 	if (swappedOrder) {
 		*result1 = greater;
@@ -333,140 +879,1410 @@ void tree_find_two(Tree * tree, const char * path1, const char * path2, Tree * *
 		*resultLCA = LCA;
 	}
 
-	if (PROTOCOL_DEBUG) {
-		fprintf(stderr, "Thread %ld: found them!\n", syscall(__NR_gettid));
+	if (traceOn()) {
+		traceRecord(TRACE_FIND_TWO_END, 0, root, (uintptr_t)LCA);
 	}
 }
 
-char * tree_list(Tree * tree, const char * path) {
-	Tree * root = tree;
-	errno = 0;
-
-	// Check path validity
-	if (tree == NULL || !is_path_valid(path)) {
-		errno = EINVAL;
-		return NULL;
-	}
-
-	// Obtain a read lock on the target node.
-	tree = tree_find(tree, path, false);
-	if (tree == NULL) {
-		return NULL;
+// Returns the listing of the contents of the node with a reference for the caller,
+// building and caching it first if the cached one is stale.
+// Requires at least a read lock on the node. Returns NULL if out of memory.
+TreeListing * tree_get_listing(Tree * tree) {
+	TreeListing * listing = atomic_load_explicit(&tree->listing, memory_order_acquire);
+	if (listing == NULL) {
+		listing = listingNew(&tree->names);
+		if (listing == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		// Other readers may be building the same listing, keep the one cached first.
+		TreeListing * cached = NULL;
+		if (!atomic_compare_exchange_strong(&tree->listing, &cached, listing)) {
+			listingRelease(listing);
+			listing = cached;
+		}
 	}
-
-	// Create the contents string of the hashmap in the proper filesystem node
-	char * result = make_map_contents_string(tree->contents);
-
-	// Exit the tree structure.
-	tree_trace_back(tree, false, root, true);
-
-	// Return result;
-	return result;
+	listingAcquire(listing);
+	return listing;
 }
 
-int tree_create(Tree * tree, const char * path) {
-	Tree * root = tree;
-	// fprintf(stderr, "\t\t\t\tstart tree_create: %s\n", path);
-
-	errno = 0;
+void tree_release_listing(void * listing) {
+	listingRelease(listing);
+}
 
-	// Check path validity
-	if (tree == NULL || !is_path_valid(path)) {
-		errno = EINVAL;
-		return errno;
-	} else if (is_root_path(path)) {
-		errno = EEXIST;
-		return errno;
+// Drops the cached listing of the node after its contents changed.
+// Requires a write lock on the node.
+void tree_invalidate_listing(Tree * tree) {
+	TreeListing * listing = atomic_exchange(&tree->listing, NULL);
+	if (listing != NULL) {
+		// Lock-free readers may be just about to take a reference to it.
+		epochRetire(listing, tree_release_listing);
 	}
+}
 
-	char parentPath[MAX_PATH_LENGTH + 1];
-	char component[MAX_FOLDER_NAME_LENGTH + 1];
-	make_path_to_parent(path, parentPath, component);
+TreeSnapshots * tree_snapshots(Tree * root) {
+	return &((TreeRoot *)root)->snapshots;
+}
 
-	// Obtain a write lock on the parent of the target node.
-	Tree * parent;
-	parent = tree_find(tree, parentPath, true);
-	if (parent == NULL) {
-		return errno;
+// Keeps the current contents of the write-locked node as a version,
+// for the snapshots taken before `until`. Returns NULL if out of memory.
+TreeVersion * tree_new_version(Tree * tree, uint64_t until) {
+	TreeListing * listing = tree_get_listing(tree);
+	if (listing == NULL) {
+		return NULL;
 	}
-
-	// Create the target node.
-	Tree * target = tree_new_node(parent);
-	if (target == NULL) {
-		tree_trace_back(parent, true, root, true);
-		return errno;
+	size_t count = hmap_size(&tree->contents);
+	TreeVersion * version = malloc(sizeof(TreeVersion) + count * sizeof(TreeVersionEntry) + listing->length + 1);
+	if (version == NULL) {
+		listingRelease(listing);
+		return NULL;
 	}
-
-	// Try inserting. If the node already exists, free memory and return error.
-	if (!hmap_insert(parent->contents, component, target)) {
-		tree_free(target);
-		tree_trace_back(parent, true, root, true);
-		errno = EEXIST;
-		return errno;
-	} else {
-		tree_trace_back(parent, true, root, true);
+	version->until = until;
+	atomic_init(&version->older, NULL);
+	version->listing = listing;
+	version->count = count;
+
+	// The names are a copy of the listing, split at the commas.
+	char * name = (char *)&version->entries[count];
+	memcpy(name, listing->contents, listing->length + 1);
+	for (size_t i = 0; i < count; i++) {
+		char * end = strchr(name, ',');
+		if (end != NULL) {
+			*end = '\0';
+		}
+		version->entries[i].name = name;
+		version->entries[i].child = hmap_get(&tree->contents, name);
+		name += strlen(name) + 1;
 	}
+	return version;
+}
 
-	// fprintf(stderr, "\t\t\t\tend tree_create: %s\n", path);
-
-	return errno;
+void tree_free_version(void * version) {
+	listingRelease(((TreeVersion *)version)->listing);
+	free(version);
 }
 
-int tree_remove(Tree * tree, const char * path) {
-	Tree * root = tree;
-	// fprintf(stderr, "\t\t\t\tstart tree_remove: %s\n", path);
+void tree_free_history(TreeHistory * history) {
+	TreeVersion * version = atomic_load(&history->versions);
+	while (version != NULL) {
+		TreeVersion * older = atomic_load(&version->older);
+		tree_free_version(version);
+		version = older;
+	}
+}
 
-	errno = 0;
+// Drops the versions of the write-locked node which no snapshot, the oldest of them
+// taken at `oldest`, can see anymore.
+void tree_prune_versions(TreeHistory * history, uint64_t oldest) {
+	_Atomic(TreeVersion *) * link = &history->versions;
+	TreeVersion * version;
+	while ((version = atomic_load_explicit(link, memory_order_relaxed)) != NULL && version->until > oldest) {
+		link = &version->older;
+	}
+	if (version == NULL) {
+		return;
+	}
 
-	// Check path validity
-	if (tree == NULL || !is_path_valid(path)) {
-		errno = EINVAL;
-		return errno;
-	} else if (is_root_path(path)) {
-		errno = EBUSY;
-		return errno;
+	atomic_store_explicit(link, NULL, memory_order_relaxed);
+	while (version != NULL) {
+		TreeVersion * older = atomic_load_explicit(&version->older, memory_order_relaxed);
+		// Snapshot readers may still be walking past it.
+		epochRetire(version, tree_free_version);
+		version = older;
 	}
+}
 
-	char parentPath[MAX_PATH_LENGTH + 1];
-	char component[MAX_FOLDER_NAME_LENGTH + 1];
-	Tree * parent, * target;
+// Makes lock-free snapshot readers of the write-locked node wait.
+void tree_mark_write(Tree * tree) {
+	atomic_fetch_add(&tree->history.sequence, 1);
+}
 
-	make_path_to_parent(path, parentPath, component);
+// Keeps the contents of the write-locked node for the snapshots taken since its last write,
+// if any, before it is written at time `now`. Returns 0, or ENOMEM.
+int tree_keep_contents(TreeSnapshots * snapshots, Tree * tree, uint64_t now) {
+	TreeHistory * history = &tree->history;
+	if (now <= atomic_load_explicit(&history->written, memory_order_relaxed)) {
+		return 0;
+	}
+	// The oldest snapshot must be read after the clock, see `tree_snapshot`.
+	tree_prune_versions(history, atomic_load(&snapshots->oldestTime));
+	if (atomic_load(&snapshots->live) > 0) {
+		TreeVersion * version = tree_new_version(tree, now);
+		if (version == NULL) {
+			return ENOMEM;
+		}
+		atomic_init(&version->older, atomic_load_explicit(&history->versions, memory_order_relaxed));
+		atomic_store_explicit(&history->versions, version, memory_order_release);
+	}
+	atomic_store_explicit(&history->written, now, memory_order_release);
+	return 0;
+}
 
-	// Obtain write locks on both the target and the parent of the target.
-	tree_find_two(tree, parentPath, path, NULL, &parent, &target);
+// Ends a write begun with `tree_begin_write`.
+void tree_end_write(Tree * tree, Tree * other) {
+	atomic_fetch_add_explicit(&tree->history.sequence, 1, memory_order_release);
+	if (other != NULL && other != tree) {
+		atomic_fetch_add_explicit(&other->history.sequence, 1, memory_order_release);
+	}
+}
 
-	if (target == NULL) {
-		errno = ENOENT;
-		return errno;
+// Must be called before the contents of the write-locked node of the tree of `root` change,
+// together with another write-locked node changed at the same time, if `other` is not NULL.
+// Snapshots then see either all the changes, or none of them. Must be followed by `tree_end_write`,
+// unless it fails: returns 0, or ENOMEM if the contents could not be kept for the snapshots,
+// in which case they must not change. Every write marks its nodes, so that a snapshot taken
+// meanwhile knows to wait for it, and taking one never has to wait for the writes in progress.
+int tree_begin_write(Tree * root, Tree * tree, Tree * other) {
+	TreeSnapshots * snapshots = tree_snapshots(root);
+	bool two = other != NULL && other != tree;
+	tree_mark_write(tree);
+	if (two) {
+		tree_mark_write(other);
+	}
+	// The clock must be read after the nodes are marked, see `tree_snapshot_version`.
+	uint64_t now = atomic_load(&snapshots->clock);
+	int err = tree_keep_contents(snapshots, tree, now);
+	if (err == 0 && two) {
+		err = tree_keep_contents(snapshots, other, now);
 	}
+	if (err != 0) {
+		// A version kept for only one of the nodes holds its current contents anyway.
+		tree_end_write(tree, other);
+	}
+	return err;
+}
 
-	// Now, `parent` is pointing to the node from which the given node needs to be removed,
-	// and `target` points to the node to be removed. We must check if it's empty, then remove,
-	// but only after there are no operations left to trace back through that node.
-	if (hmap_size(target->contents) != 0) {
-		tree_trace_back(target, true, target, true);
-		tree_trace_back(parent, true, root, true);
-		errno = ENOTEMPTY;
-		return errno;
+// Retires a node removed from the tree of `root`, together with its subtree, to be freed
+// once neither lock-free readers nor snapshots can see it anymore.
+void tree_retire_subtree(Tree * root, Tree * tree) {
+	TreeSnapshots * snapshots = tree_snapshots(root);
+	if (atomic_load(&snapshots->live) > 0) {
+		semP(&snapshots->mutex);
+		if (snapshots->oldest != NULL) {
+			tree->removedAt = atomic_load(&snapshots->clock);
+			tree->nextGrave = snapshots->graveyard;
+			snapshots->graveyard = tree;
+			semV(&snapshots->mutex);
+			return;
+		}
+		// Snapshots still being taken are taken after the removal.
+		semV(&snapshots->mutex);
 	}
+	epochRetire(tree, tree_reclaim_subtree);
+}
 
-	semP(target->mutex);
-	if (target->inSubTree > 1) {
-		target->isARemoveWaiting = true;
-		semV(target->mutex);
-		semP(target->removeSemaphore);
-		target->isARemoveWaiting = false;
+// Finds the node at `path` without taking any locks. Returns NULL and sets errno to ENOENT
+// if there is none, or to EAGAIN if a node on the way is still draining after a move
+// (see `tree_is_draining`), in which case the locks must be taken instead.
+// Requires an epoch critical section, which keeps the result from being freed,
+// though it may be concurrently moved or removed, like in any RCU scheme.
+// Writers publish each change with a single store (see HashMap.c), so a lock-free
+// reader observes every directory either before or after any given operation.
+// The walk starts at the deepest prefix of `path` found in the path cache,
+// and the prefix it ends up walking through is cached for the next lookups.
+// Nodes draining are never cached, and moving a node invalidates its entries.
+Tree * tree_find_rcu(Tree * tree, const ParsedPath * path) {
+	PathCache * cache = ((TreeRoot *)tree)->cache;
+	Generation * chain[PATH_CACHE_MAX_DEPTH];
+	int depth = 0;
+	size_t length = 1;
+	// The stamp must be taken before anything is looked up.
+	uint64_t stamp = pcStamp();
+	Tree * cached = pcLookup(cache, path->path, &length, chain, &depth);
+	if (cached != NULL) {
+		tree = cached;
 	}
-	semV(target->mutex);
 
-	hmap_remove(parent->contents, component);
-	tree_free(target);
-	tree_trace_back(parent, true, root, true);
+	// The deepest prefix walked through which can be cached.
+	int cachedDepth = depth;
+	Tree * prefixNode = NULL;
+	size_t prefixLength = 0;
 
-	// fprintf(stderr, "\t\t\t\tend tree_remove: %s\n", path);
+	for (size_t i = depth; tree != NULL && i < path->depth; i++) {
+		tree = tree_child(tree, path, i);
+		if (tree != NULL && tree_is_draining(tree)) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		size_t walkedLength = path_prefix_length(path, i + 1);
+		if (tree != NULL && depth < PATH_CACHE_MAX_DEPTH && walkedLength <= PATH_CACHE_MAX_LENGTH) {
+			chain[depth++] = &tree->generation;
+			prefixNode = tree;
+			prefixLength = walkedLength;
+		}
+	}
 
-	return errno;
+	if (depth > cachedDepth) {
+		pcInsert(cache, path->path, prefixLength, stamp, chain, depth, prefixNode);
+	}
+	if (tree == NULL) {
+		errno = ENOENT;
+	}
+	return tree;
+}
+
+// Returns the cached listing of the node at `path`, or NULL if there is no such
+// node, if its listing is not cached, or if it cannot be found without locks.
+// Does not take any locks, nor write to any shared memory. Requires an epoch
+// critical section, which keeps the result valid.
+TreeListing * tree_peek_listing(Tree * tree, const ParsedPath * path) {
+	tree = tree_find_rcu(tree, path);
+	if (tree == NULL) {
+		return NULL;
+	}
+	return atomic_load_explicit(&tree->listing, memory_order_acquire);
+}
+
+// Returns the version of the contents of the node which the snapshot taken at `time` sees,
+// or NULL if it sees the current contents. Those can only be read optimistically, and
+// `tree_snapshot_validate`, given the sequence number set here, then tells
+// whether they were written meanwhile. Requires an epoch critical section.
+TreeVersion * tree_snapshot_version(Tree * tree, uint64_t time, unsigned * sequence) {
+	TreeHistory * history = &tree->history;
+	while (true) {
+		*sequence = atomic_load_explicit(&history->sequence, memory_order_acquire);
+		if ((*sequence & 1) != 0) {
+			// The writer does not block, and marks the node before reading the clock,
+			// so it may still be writing a change the snapshot sees.
+			sched_yield();
+			continue;
+		}
+		if (atomic_load_explicit(&history->written, memory_order_acquire) <= time) {
+			return NULL;
+		}
+
+		// Find the oldest version which is not older than the snapshot.
+		TreeVersion * version = atomic_load_explicit(&history->versions, memory_order_acquire);
+		TreeVersion * older;
+		while ((older = atomic_load_explicit(&version->older, memory_order_acquire)) != NULL && older->until > time) {
+			version = older;
+		}
+		return version;
+	}
+}
+
+bool tree_snapshot_validate(Tree * tree, unsigned sequence) {
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&tree->history.sequence, memory_order_relaxed) == sequence;
+}
+
+Tree * tree_version_child(TreeVersion * version, const char * component) {
+	size_t low = 0, high = version->count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		int order = strcmp(version->entries[middle].name, component);
+		if (order == 0) {
+			return version->entries[middle].child;
+		} else if (order < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return NULL;
+}
+
+// Returns the child `component` of the node, as seen by the snapshot taken at `time`,
+// or NULL if there is none. Requires an epoch critical section.
+Tree * tree_snapshot_child(Tree * tree, uint64_t time, const char * component) {
+	while (true) {
+		unsigned sequence;
+		TreeVersion * version = tree_snapshot_version(tree, time, &sequence);
+		if (version != NULL) {
+			return tree_version_child(version, component);
+		}
+		Tree * child = hmap_get(&tree->contents, component);
+		if (tree_snapshot_validate(tree, sequence)) {
+			return child;
+		}
+	}
+}
+
+int tree_compare_names(const void * a, const void * b) {
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+// Builds a listing of the contents of the node without taking any locks, so from its hashmap,
+// as its name index cannot be read meanwhile. Returns NULL if out of memory.
+// Requires an epoch critical section. The result is inconsistent if the node is written meanwhile.
+TreeListing * tree_collect_listing(Tree * tree) {
+	size_t count = 0, capacity = 16;
+	const char * * names = malloc(capacity * sizeof(const char *));
+	if (names == NULL) {
+		return NULL;
+	}
+
+	const char * key;
+	void * value;
+	HashMapIterator it = hmap_iterator(&tree->contents);
+	while (hmap_next(&tree->contents, &it, &key, &value)) {
+		if (count == capacity) {
+			capacity *= 2;
+			const char * * larger = realloc(names, capacity * sizeof(const char *));
+			if (larger == NULL) {
+				free(names);
+				return NULL;
+			}
+			names = larger;
+		}
+		names[count++] = key;
+	}
+
+	qsort(names, count, sizeof(const char *), tree_compare_names);
+	TreeListing * listing = listingJoin(names, count);
+	free(names);
+	return listing;
+}
+
+// Returns the listing of the node, as seen by the snapshot taken at `time`, with a reference
+// for the caller, or NULL if out of memory. Requires an epoch critical section.
+TreeListing * tree_snapshot_contents(Tree * tree, uint64_t time) {
+	while (true) {
+		unsigned sequence;
+		TreeVersion * version = tree_snapshot_version(tree, time, &sequence);
+		if (version != NULL) {
+			listingAcquire(version->listing);
+			return version->listing;
+		}
+
+		// Prefer the cached listing, which the node shares with its readers.
+		TreeListing * listing = atomic_load_explicit(&tree->listing, memory_order_acquire);
+		if (listing != NULL) {
+			listingAcquire(listing);
+		} else if ((listing = tree_collect_listing(tree)) == NULL) {
+			return NULL;
+		}
+		if (tree_snapshot_validate(tree, sequence)) {
+			return listing;
+		}
+		listingRelease(listing);
+	}
+}
+
+// Returns the listing of the folder at `path` in the snapshot, with a reference for the caller.
+// Returns NULL and sets errno to ENOENT if there is no such folder, or ENOMEM.
+TreeListing * tree_snapshot_listing(TreeRoot * snapshot, const char * path) {
+	Tree * tree = snapshot->snapshotOf;
+	char component[MAX_FOLDER_NAME_LENGTH + 1];
+
+	epochEnter();
+	while (tree != NULL && (path = split_path(path, component)) != NULL) {
+		tree = tree_snapshot_child(tree, snapshot->snapshotTime, component);
+	}
+	TreeListing * listing = NULL;
+	if (tree == NULL) {
+		errno = ENOENT;
+	} else if ((listing = tree_snapshot_contents(tree, snapshot->snapshotTime)) == NULL) {
+		errno = ENOMEM;
+	}
+	epochExit();
+
+	return listing;
+}
+
+Tree * tree_snapshot(Tree * tree) {
+	errno = 0;
+	if (tree == NULL || tree_is_snapshot(tree)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	TreeRoot * snapshot = (TreeRoot *)aligned_alloc(CACHE_LINE_SIZE, sizeof(TreeRoot));
+	if (snapshot == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	snapshot->snapshotOf = tree;
+	snapshot->newerSnapshot = NULL;
+
+	// Writers which read the clock after it is taken see the snapshot counted,
+	// and keep the contents it sees (see `tree_keep_contents`).
+	TreeSnapshots * snapshots = tree_snapshots(tree);
+	atomic_fetch_add(&snapshots->live, 1);
+
+	// Taking the time and publishing the snapshot at once keeps writers which read the clock
+	// after it from dropping versions it needs.
+	semP(&snapshots->mutex);
+	snapshot->snapshotTime = atomic_fetch_add(&snapshots->clock, 1);
+	snapshot->olderSnapshot = snapshots->newest;
+	if (snapshots->newest != NULL) {
+		snapshots->newest->newerSnapshot = snapshot;
+	} else {
+		snapshots->oldest = snapshot;
+		atomic_store(&snapshots->oldestTime, snapshot->snapshotTime);
+	}
+	snapshots->newest = snapshot;
+	semV(&snapshots->mutex);
+
+	return &snapshot->node;
+}
+
+void tree_free_snapshot(TreeRoot * snapshot) {
+	TreeSnapshots * snapshots = tree_snapshots(snapshot->snapshotOf);
+	semP(&snapshots->mutex);
+	if (snapshot->olderSnapshot != NULL) {
+		snapshot->olderSnapshot->newerSnapshot = snapshot->newerSnapshot;
+	} else {
+		snapshots->oldest = snapshot->newerSnapshot;
+	}
+	if (snapshot->newerSnapshot != NULL) {
+		snapshot->newerSnapshot->olderSnapshot = snapshot->olderSnapshot;
+	} else {
+		snapshots->newest = snapshot->olderSnapshot;
+	}
+	uint64_t oldest = snapshots->oldest != NULL ? snapshots->oldest->snapshotTime : UINT64_MAX;
+	atomic_store(&snapshots->oldestTime, oldest);
+
+	// Take the nodes which no remaining snapshot can see out of the graveyard.
+	Tree * reclaimable = NULL;
+	Tree * * link = &snapshots->graveyard;
+	while (*link != NULL) {
+		Tree * grave = *link;
+		if (grave->removedAt <= oldest) {
+			*link = grave->nextGrave;
+			grave->nextGrave = reclaimable;
+			reclaimable = grave;
+		} else {
+			link = &grave->nextGrave;
+		}
+	}
+	semV(&snapshots->mutex);
+	atomic_fetch_sub(&snapshots->live, 1);
+
+	while (reclaimable != NULL) {
+		Tree * next = reclaimable->nextGrave;
+		epochRetire(reclaimable, tree_reclaim_subtree);
+		reclaimable = next;
+	}
+	free(snapshot);
+}
+
+// Like `tree_list_shared`, for a parsed path.
+const TreeListing * tree_list_parsed(Tree * tree, const ParsedPath * path) {
+	Tree * root = tree;
+
+	// Snapshots are read without any locks anyway.
+	if (tree_is_snapshot(tree)) {
+		return tree_snapshot_listing((TreeRoot *)tree, path->path);
+	}
+
+	// Try the lock-free path first: readers of an unchanged directory
+	// only need its cached listing.
+	epochEnter();
+	TreeListing * cached = tree_peek_listing(tree, path);
+	if (cached != NULL) {
+		listingAcquire(cached);
+	}
+	epochExit();
+	if (cached != NULL) {
+		return cached;
+	}
+
+	// Obtain a read lock on the target node.
+	tree = tree_find(tree, path, 0, path->depth, false);
+	if (tree == NULL) {
+		return NULL;
+	}
+
+	// Take a reference to the listing of the proper filesystem node.
+	TreeListing * listing = tree_get_listing(tree);
+
+	// Exit the tree structure.
+	tree_trace_back(tree, false, root, true);
+
+	return listing;
+}
+
+const TreeListing * tree_list_shared(Tree * tree, const char * path) {
+	errno = 0;
+
+	// Check path validity
+	ParsedPath parsed;
+	if (tree == NULL || !parse_path(path, &parsed)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return tree_list_parsed(tree, &parsed);
+}
+
+void tree_path_cache_stats(Tree * tree, size_t * hits, size_t * misses) {
+	if (tree_is_snapshot(tree)) {
+		*hits = *misses = 0;
+		return;
+	}
+	uint64_t cacheHits, cacheMisses;
+	pcStats(((TreeRoot *)tree)->cache, &cacheHits, &cacheMisses);
+	*hits = cacheHits;
+	*misses = cacheMisses;
+}
+
+// The most contended nodes seen so far, at most `limit` of them, in a min-heap
+// by `tree_compare_stats`, so that the root is the one to be replaced.
+typedef struct TreeStatsHeap {
+	TreeNodeStats * entries;
+	size_t count, capacity, limit;
+	bool failed;
+} TreeStatsHeap;
+
+// Orders nodes by the time spent waiting for them, then by the number of waits.
+int tree_compare_stats(const TreeNodeStats * a, const TreeNodeStats * b) {
+	if (a->wait_ns != b->wait_ns) {
+		return a->wait_ns < b->wait_ns ? -1 : 1;
+	}
+	if (a->waits != b->waits) {
+		return a->waits < b->waits ? -1 : 1;
+	}
+	return 0;
+}
+
+int tree_compare_stats_descending(const void * a, const void * b) {
+	return tree_compare_stats(b, a);
+}
+
+void tree_stats_sift_up(TreeStatsHeap * heap, size_t i) {
+	while (i > 0 && tree_compare_stats(&heap->entries[i], &heap->entries[(i - 1) / 2]) < 0) {
+		TreeNodeStats swap = heap->entries[i];
+		heap->entries[i] = heap->entries[(i - 1) / 2];
+		heap->entries[(i - 1) / 2] = swap;
+		i = (i - 1) / 2;
+	}
+}
+
+void tree_stats_sift_down(TreeStatsHeap * heap, size_t i) {
+	while (2 * i + 1 < heap->count) {
+		size_t child = 2 * i + 1;
+		if (child + 1 < heap->count && tree_compare_stats(&heap->entries[child + 1], &heap->entries[child]) < 0) {
+			child++;
+		}
+		if (tree_compare_stats(&heap->entries[child], &heap->entries[i]) >= 0) {
+			return;
+		}
+		TreeNodeStats swap = heap->entries[i];
+		heap->entries[i] = heap->entries[child];
+		heap->entries[child] = swap;
+		i = child;
+	}
+}
+
+// Adds a node to the heap if it is among the most contended so far.
+// Its path is copied only then.
+void tree_stats_offer(TreeStatsHeap * heap, const TreeNodeStats * stats, const char * path) {
+	if (heap->count == heap->limit) {
+		if (tree_compare_stats(stats, &heap->entries[0]) <= 0) {
+			return;
+		}
+		char * copy = strdup(path);
+		if (copy == NULL) {
+			heap->failed = true;
+			return;
+		}
+		free(heap->entries[0].path);
+		heap->entries[0] = *stats;
+		heap->entries[0].path = copy;
+		tree_stats_sift_down(heap, 0);
+		return;
+	}
+
+	if (heap->count == heap->capacity) {
+		size_t capacity = heap->capacity == 0 ? 16 : 2 * heap->capacity;
+		if (capacity > heap->limit) {
+			capacity = heap->limit;
+		}
+		TreeNodeStats * larger = realloc(heap->entries, capacity * sizeof(TreeNodeStats));
+		if (larger == NULL) {
+			heap->failed = true;
+			return;
+		}
+		heap->entries = larger;
+		heap->capacity = capacity;
+	}
+	char * copy = strdup(path);
+	if (copy == NULL) {
+		heap->failed = true;
+		return;
+	}
+	heap->entries[heap->count] = *stats;
+	heap->entries[heap->count].path = copy;
+	tree_stats_sift_up(heap, heap->count++);
+}
+
+// Offers the node, whose path of `length` characters is in `path`, and all of its descendants.
+// The nodes are read without locks, so the caller must be in an epoch section.
+void tree_stats_collect(Tree * tree, char * path, size_t length, TreeStatsHeap * heap) {
+	NodeMonitorCounters counters;
+	nmCounters(&tree->monitor, &counters);
+	TreeNodeStats stats = {
+		.path = NULL,
+		.reader_entries = counters.readerEntries,
+		.writer_entries = counters.writerEntries,
+		.waits = counters.waits,
+		.wait_ns = counters.waitNanoseconds,
+	};
+	tree_stats_offer(heap, &stats, path);
+
+	const char * key;
+	void * value;
+	HashMapIterator it = hmap_iterator(&tree->contents);
+	while (!heap->failed && hmap_next(&tree->contents, &it, &key, &value)) {
+		size_t nameLength = strlen(key);
+		// Only a node moved during the walk can seem to be this deep, skip it.
+		if (length + nameLength + 1 > MAX_PATH_LENGTH) {
+			continue;
+		}
+		memcpy(path + length, key, nameLength);
+		path[length + nameLength] = '/';
+		path[length + nameLength + 1] = '\0';
+		tree_stats_collect(value, path, length + nameLength + 1, heap);
+	}
+	path[length] = '\0';
+}
+
+TreeNodeStats * tree_stats_top(Tree * tree, size_t k, size_t * count) {
+	errno = 0;
+	if (NM_STATS == 0) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	if (tree == NULL || k == 0 || count == NULL || tree_is_snapshot(tree)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	TreeStatsHeap heap = {.entries = NULL, .count = 0, .capacity = 0, .limit = k, .failed = false};
+	char path[MAX_PATH_LENGTH + 1] = "/";
+	epochEnter();
+	tree_stats_collect(tree, path, 1, &heap);
+	epochExit();
+	if (heap.failed) {
+		tree_stats_free(heap.entries, heap.count);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	qsort(heap.entries, heap.count, sizeof(TreeNodeStats), tree_compare_stats_descending);
+	*count = heap.count;
+	return heap.entries;
+}
+
+void tree_stats_free(TreeNodeStats * stats, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		free(stats[i].path);
+	}
+	free(stats);
+}
+
+void tree_trace_enable(bool enabled) {
+	traceSetEnabled(enabled);
+}
+
+int tree_trace_dump(const char * path) {
+	if (path == NULL) {
+		return EINVAL;
+	}
+	return traceDump(path);
+}
+
+const char * tree_listing_contents(const TreeListing * listing) {
+	return listing->contents;
+}
+
+size_t tree_listing_length(const TreeListing * listing) {
+	return listing->length;
+}
+
+void tree_listing_release(const TreeListing * listing) {
+	listingRelease(listing);
+}
+
+char * tree_list(Tree * tree, const char * path) {
+	errno = 0;
+	ParsedPath parsed;
+	if (tree == NULL || !parse_path(path, &parsed)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// If the listing is cached, copy it without even taking a reference.
+	// Snapshots are not in the path cache, see `tree_list_shared`.
+	char * result = NULL;
+	epochEnter();
+	TreeListing * cached = tree_is_snapshot(tree) ? NULL : tree_peek_listing(tree, &parsed);
+	if (cached != NULL) {
+		result = malloc(cached->length + 1);
+		if (result != NULL) {
+			memcpy(result, cached->contents, cached->length + 1);
+		}
+	}
+	epochExit();
+	if (cached != NULL) {
+		return result;
+	}
+
+	const TreeListing * listing = tree_list_parsed(tree, &parsed);
+	if (listing == NULL) {
+		return NULL;
+	}
+
+	// Copy the shared listing for the caller.
+	result = malloc(listing->length + 1);
+	if (result != NULL) {
+		memcpy(result, listing->contents, listing->length + 1);
+	}
+	listingRelease(listing);
+
+	return result;
+}
+
+struct TreeListCursor {
+	Tree * tree;
+	size_t pageSize;
+	bool started; // Whether `last` holds the last name listed so far.
+	char last[MAX_FOLDER_NAME_LENGTH + 1];
+	char path[];
+};
+
+TreeListCursor * tree_list_open(Tree * tree, const char * path, size_t pageSize) {
+	errno = 0;
+	ParsedPath parsed;
+	if (tree == NULL || !parse_path(path, &parsed) || pageSize == 0 || tree_is_snapshot(tree)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// Opening is only a lookup, so it need not take any locks, unless a folder is draining.
+	epochEnter();
+	bool exists = tree_find_rcu(tree, &parsed) != NULL;
+	epochExit();
+	if (!exists && errno == EAGAIN) {
+		Tree * node = tree_find(tree, &parsed, 0, parsed.depth, false);
+		exists = node != NULL;
+		tree_trace_back(node, false, tree, true);
+	}
+	if (!exists) {
+		errno = ENOENT;
+		return NULL;
+	}
+	errno = 0;
+
+	size_t length = parsed.length;
+	TreeListCursor * cursor = malloc(sizeof(TreeListCursor) + length + 1);
+	if (cursor == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	cursor->tree = tree;
+	cursor->pageSize = pageSize;
+	cursor->started = false;
+	memcpy(cursor->path, path, length + 1);
+	return cursor;
+}
+
+char * tree_list_next(TreeListCursor * cursor) {
+	Tree * root = cursor->tree;
+	errno = 0;
+
+	// Obtain a read lock on the folder for this page only.
+	// The cursor keeps only the path, it was checked when the cursor was opened.
+	ParsedPath parsed;
+	parse_path(cursor->path, &parsed);
+	Tree * tree = tree_find(root, &parsed, 0, parsed.depth, false);
+	if (tree == NULL) {
+		return NULL;
+	}
+
+	char * page = niMakePage(&tree->names, cursor->started ? cursor->last : NULL, cursor->pageSize, cursor->last);
+
+	tree_trace_back(tree, false, root, true);
+
+	if (page == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	} else if (page[0] == '\0') {
+		// Nothing follows the last page.
+		free(page);
+		return NULL;
+	}
+	cursor->started = true;
+	return page;
+}
+
+void tree_list_close(TreeListCursor * cursor) {
+	free(cursor);
+}
+
+Wal * tree_wal(Tree * root) {
+	return ((TreeRoot *)root)->wal;
+}
+
+// Inserts the node as the child `component` of `parent`, which must be write-locked,
+// in the tree of `root`. Returns 0 on success, and sets errno to the returned error otherwise.
+// The child is published last, so that walks without locks never see it taken back.
+int tree_insert_child(Tree * root, Tree * parent, const char * component, Tree * child) {
+	int err = tree_begin_write(root, parent, NULL);
+	if (err != 0) {
+		errno = err;
+		return errno;
+	}
+	if (hmap_get(&parent->contents, component) != NULL) {
+		err = EEXIST;
+	} else if (!niInsert(&parent->names, component)) {
+		err = ENOMEM;
+	} else if (!hmap_insert(&parent->contents, component, child)) {
+		niRemove(&parent->names, component);
+		err = ENOMEM;
+	} else {
+		tree_invalidate_listing(parent);
+	}
+	tree_end_write(parent, NULL);
+
+	errno = err;
+	return errno;
+}
+
+// Identifies a node in the write-ahead log. Nodes of logged trees are numbered as they are
+// created, from `nextId` of the root, so an identifier is never reused, even across restarts.
+uint64_t tree_id(Tree * tree) {
+	return tree->id;
+}
+
+// Gives a new node of a logged tree its identifier, before it is published.
+void tree_assign_id(Tree * root, Tree * node) {
+	node->id = atomic_fetch_add(&((TreeRoot *)root)->nextId, 1);
+}
+
+// Creates the child `component` of `parent`, which must be write-locked, in the tree of `root`,
+// and logs it unless the tree has no log (also while it is being replayed).
+// The new node is published write-locked until it is logged, as optimistic descents can reach it
+// without passing `parent`, and their records must follow the one creating it.
+// Returns 0 on success, and sets errno to the returned error otherwise.
+int tree_create_child(Tree * root, Tree * parent, const char * component) {
+	Wal * wal = tree_wal(root);
+	// Create the target node.
+	Tree * target = tree_new_node(parent);
+	if (target == NULL) {
+		return errno;
+	}
+	if (wal != NULL) {
+		tree_assign_id(root, target);
+		nmWriterEnter(&target->monitor);
+	}
+
+	// Try inserting. If the node already exists, free memory and return error.
+	if (tree_insert_child(root, parent, component, target) != 0) {
+		int err = errno;
+		if (wal != NULL) {
+			nmWriterExit(&target->monitor);
+		}
+		tree_free_subtree(target);
+		errno = err;
+		return errno;
+	}
+	if (wal != NULL) {
+		walAppendCreate(wal, tree_id(parent), component, tree_id(target));
+		nmWriterExit(&target->monitor);
+	}
+	return 0;
+}
+
+// Creates the child named by the component `start` of `path` in `parent`, which must be write-locked,
+// together with the folders of the rest of the path below it. The new nodes are linked together before
+// the first one is inserted, so only the lock on `parent` is needed. They are logged
+// as by `tree_create_child`, top-down once they are all in place, and stay write-locked until then.
+// Returns 0 on success, and sets errno to the returned error otherwise.
+int tree_create_chain(Tree * root, Tree * parent, const ParsedPath * path, size_t start) {
+	Wal * wal = tree_wal(root);
+	Tree * first = tree_new_node(parent);
+	if (first == NULL) {
+		return errno;
+	}
+	if (wal != NULL) {
+		tree_assign_id(root, first);
+		nmWriterEnter(&first->monitor);
+	}
+
+	Tree * last = first;
+	char name[MAX_FOLDER_NAME_LENGTH + 1];
+	for (size_t i = start + 1; i < path->depth; i++) {
+		copy_path_component(path, i, name);
+		Tree * child = tree_new_node(last);
+		if (child != NULL && wal != NULL) {
+			tree_assign_id(root, child);
+			nmWriterEnter(&child->monitor);
+		}
+		if (child == NULL || tree_insert_child(root, last, name, child) != 0) {
+			// Nobody else can see the new nodes, so inserting can only run out of memory.
+			if (child != NULL) {
+				tree_free_subtree(child);
+			}
+			tree_free_subtree(first);
+			errno = ENOMEM;
+			return errno;
+		}
+		last = child;
+	}
+
+	copy_path_component(path, start, name);
+	if (tree_insert_child(root, parent, name, first) != 0) {
+		int err = errno;
+		tree_free_subtree(first);
+		errno = err;
+		return errno;
+	}
+
+	if (wal != NULL) {
+		walAppendCreate(wal, tree_id(parent), name, tree_id(first));
+		Tree * node = first;
+		for (size_t i = start + 1; i < path->depth; i++) {
+			Tree * child = tree_child(node, path, i);
+			copy_path_component(path, i, name);
+			walAppendCreate(wal, tree_id(node), name, tree_id(child));
+			nmWriterExit(&node->monitor);
+			node = child;
+		}
+		nmWriterExit(&node->monitor);
+	}
+	return 0;
+}
+
+// Obtains a write lock on the child `component` of `parent`, which must be write-locked,
+// as `tree_find_two` would. Returns NULL and sets errno if there is no such child.
+Tree * tree_lock_child(Tree * parent, const char * component) {
+	Tree * child = hmap_get(&parent->contents, component);
+	if (child == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return tree_find(child, NULL, 0, 0, true);
+}
+
+// Waits until there are no operations left to trace back through the write-locked node.
+// Every thread inside the subtree of the node is counted in its `inSubTree`.
+void tree_wait_for_tracebacks(Tree * target) {
+	semP(&target->mutex);
+	if (tree_watch_subtree(target) > 1) {
+		target->isARemoveWaiting = true;
+		semV(&target->mutex);
+		semP(&target->removeSemaphore);
+		target->isARemoveWaiting = false;
+	}
+	atomic_fetch_and(&target->inSubTree, ~SUBTREE_WATCHED);
+	semV(&target->mutex);
+}
+
+// Unlinks the write-locked child `component` of the write-locked `parent` in the tree of `root`,
+// and logs its removal as by `tree_create_child`.
+// Returns 0 on success, and sets errno to the returned error otherwise.
+int tree_unlink_child(Tree * root, Tree * parent, const char * component, Tree * target) {
+	Wal * wal = tree_wal(root);
+	int err = tree_begin_write(root, parent, NULL);
+	if (err != 0) {
+		errno = err;
+		return errno;
+	}
+	tree_remove_entry(parent, component);
+	niRemove(&parent->names, component);
+	tree_invalidate_listing(parent);
+	tree_end_write(parent, NULL);
+	if (wal != NULL) {
+		walAppendRemove(wal, tree_id(parent), component);
+	}
+	// Cached paths through the descendants all go through the target as well.
+	pcInvalidate(&target->generation);
+	return 0;
+}
+
+// Removes the empty child `component` of `parent`, which must be write-locked, in the tree
+// of `root`, and logs it as by `tree_create_child`.
+// Returns 0 on success, and sets errno to the returned error otherwise.
+int tree_remove_child(Tree * root, Tree * parent, const char * component) {
+	Tree * target = tree_lock_child(parent, component);
+	if (target == NULL) {
+		return errno;
+	}
+
+	// We must check if the target is empty, then remove it,
+	// but only after there are no operations left to trace back through that node.
+	if (hmap_size(&target->contents) != 0) {
+		tree_trace_back(target, true, target, true);
+		errno = ENOTEMPTY;
+		return errno;
+	}
+
+	tree_wait_for_tracebacks(target);
+	int err = tree_unlink_child(root, parent, component, target);
+	// Optimistic descents which found the target before it was unlinked may be waiting for it.
+	// They see that it was and start over, as do lock-free readers and snapshots.
+	tree_trace_back(target, true, target, true);
+	if (err != 0) {
+		errno = err;
+		return errno;
+	}
+	tree_retire_subtree(root, target);
+	return 0;
+}
+
+// Returns whether `ancestor` is `tree` or one of its ancestors, looking no higher than `upTo`.
+// Requires the rename mutex of the tree, so that the ancestors do not change meanwhile.
+bool tree_is_ancestor(Tree * ancestor, Tree * tree, Tree * upTo) {
+	while (tree != NULL && tree != ancestor && tree != upTo) {
+		tree = tree->parent;
+	}
+	return tree == ancestor;
+}
+
+// Moves the child `sourceComponent` of `sourceParent` to the child `targetComponent`
+// of `targetParent` in the tree of `root`. Both parents (which may be the same node) must be
+// write-locked. The move is logged as by `tree_create_child`. Moving between different parents requires
+// the rename mutex of the tree. Threads inside the moved subtree are not waited for: they trace
+// back along their trails (see `tree_trace_back`), through the ancestors they entered it from,
+// and until they do, threads entering it at its new path take all the locks (see `tree_is_draining`).
+// Returns 0 on success, and sets errno to the returned error otherwise.
+int tree_move_child(Tree * root, Tree * sourceParent, const char * sourceComponent, Tree * targetParent, const char * targetComponent) {
+	Wal * wal = tree_wal(root);
+	// Obtain a pointer to the source target and try to obtain one for the target target.
+	Tree * sourceTarget = hmap_get(&sourceParent->contents, sourceComponent);
+	Tree * targetTarget = hmap_get(&targetParent->contents, targetComponent);
+
+	if (sourceTarget == NULL) {
+		errno = ENOENT;
+		return errno;
+	} else if (targetTarget != NULL) {
+		errno = EEXIST;
+		return errno;
+	}
+
+	// All set and all logic conditions were met. Time for the actual move,
+	// which snapshots see in both parents at once.
+	bool inserted = false;
+	int err = tree_begin_write(root, sourceParent, targetParent);
+	if (err != 0) {
+		errno = err;
+		return errno;
+	}
+	// Optimistic walks through the old parent which count themselves inside the node
+	// after the move does, see the old parent changed (see `tree_find_target`).
+	nmBumpVersion(&sourceParent->monitor);
+	tree_start_generation(sourceTarget);
+	if (niInsert(&targetParent->names, targetComponent)) {
+		inserted = hmap_insert(&targetParent->contents, targetComponent, sourceTarget);
+		if (!inserted) {
+			niRemove(&targetParent->names, targetComponent);
+		}
+	}
+	if (inserted) {
+		hmap_remove(&sourceParent->contents, sourceComponent);
+		niRemove(&sourceParent->names, sourceComponent);
+		tree_invalidate_listing(sourceParent);
+		tree_invalidate_listing(targetParent);
+	}
+	nmBumpVersion(&sourceParent->monitor);
+	tree_end_write(sourceParent, targetParent);
+	if (!inserted) {
+		errno = ENOMEM;
+		return errno;
+	}
+	if (wal != NULL) {
+		walAppendMove(wal, tree_id(sourceParent), sourceComponent, tree_id(targetParent), targetComponent);
+	}
+
+	pcInvalidate(&sourceTarget->generation);
+	if (sourceParent != targetParent) {
+		sourceTarget->parent = targetParent;
+	}
+
+	return 0;
+}
+
+// Waits until the changes logged by the calling thread are durable. Called once its locks are
+// released, so that threads waiting meanwhile can have their changes synced together.
+// Returns `err`, the result of the operation, unless it succeeded but the log has failed,
+// in which case its changes are not known to be durable, and the error of the log is returned.
+int tree_commit(Tree * root, int err) {
+	Wal * wal = tree_wal(root);
+	int logErr = wal != NULL ? walSync(wal) : 0;
+	return err != 0 ? err : logErr;
+}
+
+int tree_create(Tree * tree, const char * path) {
+	Tree * root = tree;
+	// fprintf(stderr, "\t\t\t\tstart tree_create: %s\n", path);
+
+	errno = 0;
+
+	// Check path validity
+	ParsedPath parsed;
+	if (tree == NULL || !parse_path(path, &parsed)) {
+		errno = EINVAL;
+		return errno;
+	} else if (tree_is_snapshot(tree)) {
+		errno = EROFS;
+		return errno;
+	} else if (parsed.depth == 0) {
+		errno = EEXIST;
+		return errno;
+	}
+
+	char component[MAX_FOLDER_NAME_LENGTH + 1];
+	copy_path_component(&parsed, parsed.depth - 1, component);
+
+	// Obtain a write lock on the parent of the target node.
+	bool optimistic;
+	Tree * parent = tree_find_target(tree, &parsed, parsed.depth - 1, &optimistic);
+	if (parent == NULL) {
+		return errno;
+	}
+
+	int err = tree_create_child(root, parent, component);
+	tree_release_target(root, parent, optimistic);
+	errno = tree_commit(root, err);
+
+	// fprintf(stderr, "\t\t\t\tend tree_create: %s\n", path);
+
+	return errno;
+}
+
+// Returns whether the node has no child named by the component `i` of `path`, without taking
+// any locks. The node must not be removed meanwhile. The answer is only a hint,
+// as the child may be inserted or removed right afterwards.
+bool tree_peek_missing(Tree * tree, const ParsedPath * path, size_t i) {
+	epochEnter();
+	bool missing = tree_child(tree, path, i) == NULL;
+	epochExit();
+	return missing;
+}
+
+// Like `tree_create_all`, but with the optimistic descent (see `tree_find_target`),
+// which only locks the deepest existing folder, or nothing if the whole path exists.
+// Returns EAGAIN if it gave up, after a few attempts or at a folder still draining after a move.
+int tree_create_all_optimistic(Tree * root, const ParsedPath * path) {
+	for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+		TreeWalk walk;
+		size_t found;
+		epochEnter();
+		Tree * node = tree_walk(root, path, path->depth, &walk, &found);
+		if (walk.draining) {
+			epochExit();
+			break;
+		}
+		if (found == path->depth) {
+			bool valid = tree_validate_walk(&walk);
+			epochExit();
+			if (valid) {
+				errno = 0;
+				return errno;
+			}
+			continue;
+		}
+
+		// As in `tree_find_target`, the node is only locked if it is free,
+		// and the thread is counted inside before the walk is validated.
+		if (!nmWriterTryEnter(&node->monitor)) {
+			epochExit();
+			continue;
+		}
+		tree_enter_subtree(node, NO_STEP);
+		if (!tree_validate_walk(&walk)) {
+			tree_trace_back(node, true, node, true);
+			epochExit();
+			continue;
+		}
+		epochExit();
+
+		// Versions only track removals, so the missing folder may have been created meanwhile.
+		if (tree_child(node, path, found) != NULL) {
+			tree_release_target(root, node, true);
+			continue;
+		}
+
+		int err = tree_create_chain(root, node, path, found);
+		tree_release_target(root, node, true);
+		errno = tree_commit(root, err);
+		return errno;
+	}
+	errno = EAGAIN;
+	return errno;
+}
+
+int tree_create_all(Tree * tree, const char * path) {
+	Tree * root = tree;
+
+	errno = 0;
+
+	// Check path validity
+	ParsedPath parsed;
+	if (tree == NULL || !parse_path(path, &parsed)) {
+		errno = EINVAL;
+		return errno;
+	} else if (tree_is_snapshot(tree)) {
+		errno = EROFS;
+		return errno;
+	} else if (parsed.depth == 0) {
+		errno = EEXIST;
+		return errno;
+	}
+
+	if (OPTIMISTIC_DESCENT && tree_create_all_optimistic(root, &parsed) != EAGAIN) {
+		return errno;
+	}
+
+	errno = 0;
+	while (true) {
+		// Like `tree_find`, descend with read locks. Each node is locked for writing instead
+		// if it seems to lack the next component, so that it can be created right there.
+		size_t i = 0;
+		bool writeLock = tree_peek_missing(tree, &parsed, i);
+		Tree * node = tree_find(tree, NULL, 0, 0, writeLock);
+		int step = tree_trail_find(node);
+		Tree * child;
+
+		while ((child = tree_child(node, &parsed, i)) != NULL && i + 1 < parsed.depth) {
+			bool childWriteLock = tree_peek_missing(child, &parsed, i + 1);
+
+			// We hold a lock on `node`, so `child` cannot be removed nor moved meanwhile.
+			if (childWriteLock) {
+				nmWriterEnter(&child->monitor);
+			} else {
+				nmReaderEnter(&child->monitor);
+			}
+			step = tree_enter_subtree(child, step);
+			if (writeLock) {
+				nmWriterExit(&node->monitor);
+			} else {
+				nmReaderExit(&node->monitor);
+			}
+
+			node = child;
+			writeLock = childWriteLock;
+			i++;
+		}
+
+		if (child != NULL) {
+			// The whole path exists already.
+			tree_trace_back(node, writeLock, root, true);
+			return errno;
+		} else if (!writeLock) {
+			// The component was removed after it was seen. Start over.
+			tree_trace_back(node, false, root, true);
+			continue;
+		}
+
+		int err = tree_create_chain(root, node, &parsed, i);
+		tree_trace_back(node, true, root, true);
+		errno = tree_commit(root, err);
+		return errno;
+	}
+}
+
+int tree_remove(Tree * tree, const char * path) {
+	Tree * root = tree;
+	// fprintf(stderr, "\t\t\t\tstart tree_remove: %s\n", path);
+
+	errno = 0;
+
+	// Check path validity
+	ParsedPath parsed;
+	if (tree == NULL || !parse_path(path, &parsed)) {
+		errno = EINVAL;
+		return errno;
+	} else if (tree_is_snapshot(tree)) {
+		errno = EROFS;
+		return errno;
+	} else if (parsed.depth == 0) {
+		errno = EBUSY;
+		return errno;
+	}
+
+	char component[MAX_FOLDER_NAME_LENGTH + 1];
+	copy_path_component(&parsed, parsed.depth - 1, component);
+
+	// Obtain a write lock on the parent of the target node.
+	// The target itself is locked by `tree_remove_child`.
+	bool optimistic;
+	Tree * parent = tree_find_target(tree, &parsed, parsed.depth - 1, &optimistic);
+	if (parent == NULL) {
+		return errno;
+	}
+
+	int err = tree_remove_child(root, parent, component);
+	tree_release_target(root, parent, optimistic);
+	errno = tree_commit(root, err);
+
+	// fprintf(stderr, "\t\t\t\tend tree_remove: %s\n", path);
+
+	return errno;
+}
+
+// Waits until no thread is inside the subtree of a detached, write-locked node, by write-locking
+// each node of it in turn and waiting for its tracebacks. Threads which were inside a node when it
+// was moved into the subtree are not counted by its new ancestors, only by the node itself, and
+// neither are the ones which found a node with an optimistic descent.
+// The locks are released right away, as such descents may still be waiting to see that they
+// have to start over. Must not hold any other locks, as such threads may still need them to leave.
+void tree_drain_subtree(Tree * tree) {
+	const char * key;
+	void * value;
+	HashMapIterator it = hmap_iterator(&tree->contents);
+	while (hmap_next(&tree->contents, &it, &key, &value)) {
+		Tree * child = value;
+		nmWriterEnter(&child->monitor);
+		tree_enter_subtree(child, NO_STEP);
+		tree_wait_for_tracebacks(child);
+		tree_trace_back(child, true, child, true);
+		tree_drain_subtree(child);
+	}
+}
+
+int tree_remove_recursive(Tree * tree, const char * path) {
+	Tree * root = tree;
+
+	errno = 0;
+
+	// Check path validity
+	ParsedPath parsed;
+	if (tree == NULL || !parse_path(path, &parsed)) {
+		errno = EINVAL;
+		return errno;
+	} else if (tree_is_snapshot(tree)) {
+		errno = EROFS;
+		return errno;
+	} else if (parsed.depth == 0) {
+		errno = EBUSY;
+		return errno;
+	}
+
+	char component[MAX_FOLDER_NAME_LENGTH + 1];
+	copy_path_component(&parsed, parsed.depth - 1, component);
+
+	// Obtain a write lock on the parent of the target node.
+	bool optimistic;
+	Tree * parent = tree_find_target(tree, &parsed, parsed.depth - 1, &optimistic);
+	if (parent == NULL) {
+		return errno;
+	}
+
+	// Detach the target right away. Threads inside its subtree may be waiting for each other,
+	// and some of them for the parent, so they are only waited for once it is unlocked.
+	Tree * target = tree_lock_child(parent, component);
+	int err = target == NULL ? errno : 0;
+	if (target != NULL && (err = tree_unlink_child(root, parent, component, target)) != 0) {
+		tree_trace_back(target, true, target, true);
+		target = NULL;
+	}
+	tree_release_target(root, parent, optimistic);
+	err = tree_commit(root, err);
+
+	// No new threads can enter the subtree now. It is freed as a whole once
+	// the ones inside and lock-free readers are done, without holding any locks.
+	if (target != NULL) {
+		tree_wait_for_tracebacks(target);
+		tree_drain_subtree(target);
+		tree_trace_back(target, true, target, true);
+		tree_retire_subtree(root, target);
+	}
+	errno = err;
+
+	return errno;
 }
 
 int tree_move(Tree * tree, const char * source, const char * target) {
@@ -475,37 +2291,42 @@ int tree_move(Tree * tree, const char * source, const char * target) {
 	errno = 0;
 
 	// Check path validity
-	if (tree == NULL || !(is_path_valid(source) && is_path_valid(target))) {
+	ParsedPath sourcePath, targetPath;
+	if (tree == NULL || !(parse_path(source, &sourcePath) && parse_path(target, &targetPath))) {
 		errno = EINVAL;
 		return errno;
-	} else if (is_root_path(source) || is_proper_prefix_of_path(source, target)) {
+	} else if (tree_is_snapshot(tree)) {
+		errno = EROFS;
+		return errno;
+	} else if (sourcePath.depth == 0 || is_proper_prefix_of_parsed_path(&sourcePath, &targetPath)) {
 		errno = EBUSY;
 		return errno;
-	} else if (is_root_path(target)) {
+	} else if (targetPath.depth == 0) {
 		errno  = EEXIST;
 		return errno;
 	}
 
-	char sourceParentPath[MAX_PATH_LENGTH + 1];
-	char targetParentPath[MAX_PATH_LENGTH + 1];
+	size_t sourceParentDepth = sourcePath.depth - 1;
+	size_t targetParentDepth = targetPath.depth - 1;
 	char sourceComponent[MAX_FOLDER_NAME_LENGTH + 1];
 	char targetComponent[MAX_FOLDER_NAME_LENGTH + 1];
 
-	make_path_to_parent(source, sourceParentPath, sourceComponent);
-	make_path_to_parent(target, targetParentPath, targetComponent);
+	copy_path_component(&sourcePath, sourceParentDepth, sourceComponent);
+	copy_path_component(&targetPath, targetParentDepth, targetComponent);
 
-	bool sameParent = are_same_path(sourceParentPath, targetParentPath);
+	bool sameParent = sourceParentDepth == targetParentDepth
+	                  && path_common_depth(&sourcePath, &targetPath) >= sourceParentDepth;
 
 	Tree * sourceParent;
 	Tree * targetParent;
 	Tree * LCA;
-	Tree * sourceTarget;
-	Tree * targetTarget;
+	bool optimistic = false;
 
 	if (sameParent) {
-		sourceParent = targetParent = tree_find(tree, sourceParentPath, true);
+		sourceParent = targetParent = tree_find_target(tree, &sourcePath, sourceParentDepth, &optimistic);
 	} else {
-		tree_find_two(tree, sourceParentPath, targetParentPath, &LCA, &sourceParent, &targetParent);
+		tree_find_two(tree, &sourcePath, sourceParentDepth, &targetPath, targetParentDepth,
+		              &LCA, &sourceParent, &targetParent);
 	}
 
 	if (sourceParent == NULL) {
@@ -518,64 +2339,833 @@ int tree_move(Tree * tree, const char * source, const char * target) {
 	// (and we have that assumption in the project statement), there will
 	// be no loss of liveness, no deadlocks, no nothing! 🎉
 
-	// Obtain a pointer to the source target and try to obtain one for the target target.
-	sourceTarget = hmap_get(sourceParent->contents, sourceComponent);
-	targetTarget = hmap_get(targetParent->contents, targetComponent);
-
-	if (sourceTarget == NULL) {
-		errno = ENOENT;
-	} else if (targetTarget != NULL) {
-		errno = EEXIST;
+	int err;
+	if (sameParent) {
+		err = tree_move_child(root, sourceParent, sourceComponent, targetParent, targetComponent);
+	} else {
+		// The paths were checked above, but the locked parents may have been moved since
+		// they were found. Another thread holding a lock inside the source might have
+		// moved the target parent into it, and the move would then detach a cycle.
+		// Everything inside the source is met before `sourceParent` on the way up.
+		Semaphore * renameMutex = &((TreeRoot *)root)->renameMutex;
+		semP(renameMutex);
+		Tree * moved = hmap_get(&sourceParent->contents, sourceComponent);
+		if (moved != NULL && tree_is_ancestor(moved, targetParent, sourceParent)) {
+			errno = EBUSY;
+			err = errno;
+		} else {
+			err = tree_move_child(root, sourceParent, sourceComponent, targetParent, targetComponent);
+		}
+		semV(renameMutex);
 	}
 
-	if (errno != 0) {
-		// It doesn't really matter in which order we free the locks,
-		// as it does not depend on obtaining other locks.
-		if (sameParent) {
+	// Perform the tracebacks. It doesn't really matter in which order we free the locks,
+	// as it does not depend on obtaining other locks.
+	if (sameParent) {
+		tree_release_target(root, targetParent, optimistic);
+	} else {
+		if (targetParent == LCA) {
+			tree_trace_back(sourceParent, true, LCA, false);
 			tree_trace_back(targetParent, true, root, true);
 		} else {
-			if (targetParent == LCA) {
-				tree_trace_back(sourceParent, true, LCA, false);
-				tree_trace_back(targetParent, true, root, true);
-			} else {
-				tree_trace_back(targetParent, true, LCA, false);
-				tree_trace_back(sourceParent, true, root, true);
+			tree_trace_back(targetParent, true, LCA, false);
+			tree_trace_back(sourceParent, true, root, true);
+		}
+	}
+	errno = tree_commit(root, err);
+
+	return errno;
+}
+
+// Applies a single operation of a batch on its own.
+int tree_apply(Tree * tree, const TreeOp * op) {
+	switch (op->type) {
+		case TREE_OP_CREATE:
+			return tree_create(tree, op->path);
+		case TREE_OP_REMOVE:
+			return tree_remove(tree, op->path);
+		case TREE_OP_MOVE:
+			return tree_move(tree, op->path, op->target);
+		default:
+			errno = EINVAL;
+			return errno;
+	}
+}
+
+// Returns the error an operation fails with regardless of the contents of the tree,
+// in the same order of checks as the functions applying it, or 0 if there is none.
+int tree_check(const TreeOp * op) {
+	switch (op->type) {
+		case TREE_OP_CREATE:
+			if (!is_path_valid(op->path)) {
+				return EINVAL;
+			}
+			return is_root_path(op->path) ? EEXIST : 0;
+		case TREE_OP_REMOVE:
+			if (!is_path_valid(op->path)) {
+				return EINVAL;
 			}
+			return is_root_path(op->path) ? EBUSY : 0;
+		case TREE_OP_MOVE:
+			if (!(is_path_valid(op->path) && is_path_valid(op->target))) {
+				return EINVAL;
+			} else if (is_root_path(op->path) || is_proper_prefix_of_path(op->path, op->target)) {
+				return EBUSY;
+			}
+			return is_root_path(op->target) ? EEXIST : 0;
+		default:
+			return EINVAL;
+	}
+}
+
+// Returns the length of the path to the parent of a valid, non-root path.
+size_t tree_parent_length(const char * path) {
+	size_t length = strlen(path) - 1;
+	while (path[length - 1] != '/') {
+		length--;
+	}
+	return length;
+}
+
+// Copies the last component of a valid, non-root path into `component`,
+// given the length of the path to its parent (see `tree_parent_length`).
+void tree_last_component(const char * path, size_t parentLength, char * component) {
+	size_t length = strlen(path + parentLength) - 1;
+	memcpy(component, path + parentLength, length);
+	component[length] = '\0';
+}
+
+// An operation of a batch which passed `tree_check`.
+typedef struct TreeBatchEntry {
+	const TreeOp * op;
+	size_t index;
+	size_t parentLength; // The parent path is the prefix of `op->path` of this length.
+	bool deferred; // A move between two different directories.
+} TreeBatchEntry;
+
+// Orders operations by their parent directory, then by submission order.
+// Deferred operations go last.
+int tree_compare_entries(const void * a, const void * b) {
+	const TreeBatchEntry * first = a;
+	const TreeBatchEntry * second = b;
+	if (first->deferred != second->deferred) {
+		return first->deferred ? 1 : -1;
+	}
+	if (!first->deferred) {
+		size_t length = first->parentLength < second->parentLength ? first->parentLength : second->parentLength;
+		int order = memcmp(first->op->path, second->op->path, length);
+		if (order != 0) {
+			return order;
+		} else if (first->parentLength != second->parentLength) {
+			return first->parentLength < second->parentLength ? -1 : 1;
 		}
+	}
+	return first->index < second->index ? -1 : (first->index > second->index ? 1 : 0);
+}
+
+int tree_batch(Tree * tree, const TreeOp * ops, size_t count, int * results) {
+	Tree * root = tree;
+	errno = 0;
+
+	if (tree == NULL || (count > 0 && (ops == NULL || results == NULL))) {
+		errno = EINVAL;
+		return errno;
+	} else if (tree_is_snapshot(tree)) {
+		errno = EROFS;
 		return errno;
 	}
 
-	// All set and all logic conditions were met. Time for the actual move.
+	TreeBatchEntry * entries = malloc(count * sizeof(TreeBatchEntry));
+	if (entries == NULL) {
+		// Apply the operations one by one, which needs no memory up front.
+		for (size_t i = 0; i < count; i++) {
+			results[i] = tree_apply(tree, &ops[i]);
+		}
+		errno = 0;
+		return errno;
+	}
 
-	// Obtain mutex metadata protection for the source node. 
-	semP(sourceTarget->mutex);
-	// Perform the actual move.
-	hmap_remove(sourceParent->contents, sourceComponent);
-	hmap_insert(targetParent->contents, targetComponent, sourceTarget);
-	// Adjust metadata and lock the target if necessary.
-	if (sourceTarget->inSubTree == 0) {
-		// If there was no thread in the subtree, just swap the parent pointer.
-		sourceTarget->parent = targetParent;
+	size_t valid = 0;
+	for (size_t i = 0; i < count; i++) {
+		results[i] = tree_check(&ops[i]);
+		if (results[i] != 0) {
+			continue;
+		}
+		TreeBatchEntry * entry = &entries[valid++];
+		entry->op = &ops[i];
+		entry->index = i;
+		entry->parentLength = tree_parent_length(ops[i].path);
+		entry->deferred = false;
+		if (ops[i].type == TREE_OP_MOVE) {
+			size_t targetParentLength = tree_parent_length(ops[i].target);
+			entry->deferred = targetParentLength != entry->parentLength
+			                  || memcmp(ops[i].path, ops[i].target, targetParentLength) != 0;
+		}
+	}
+	qsort(entries, valid, sizeof(TreeBatchEntry), tree_compare_entries);
+
+	ParsedPath parsed;
+	char component[MAX_FOLDER_NAME_LENGTH + 1];
+	char targetComponent[MAX_FOLDER_NAME_LENGTH + 1];
+
+	// Apply each group of operations in the same directory under a single write lock.
+	size_t first = 0;
+	while (first < valid && !entries[first].deferred) {
+		size_t parentLength = entries[first].parentLength;
+		size_t last = first + 1;
+		while (last < valid && !entries[last].deferred && entries[last].parentLength == parentLength
+		       && memcmp(entries[last].op->path, entries[first].op->path, parentLength) == 0) {
+			last++;
+		}
+
+		// Only the parent of the path is followed.
+		parse_path(entries[first].op->path, &parsed);
+		Tree * parent = tree_find(tree, &parsed, 0, parsed.depth - 1, true);
+
+		for (size_t i = first; i < last; i++) {
+			const TreeOp * op = entries[i].op;
+			if (parent == NULL) {
+				results[entries[i].index] = errno;
+				continue;
+			}
+			// The parent path is already known, only the last components are needed.
+			tree_last_component(op->path, parentLength, component);
+			switch (op->type) {
+				case TREE_OP_CREATE:
+					results[entries[i].index] = tree_create_child(root, parent, component);
+					break;
+				case TREE_OP_REMOVE:
+					results[entries[i].index] = tree_remove_child(root, parent, component);
+					break;
+				default:
+					tree_last_component(op->target, parentLength, targetComponent);
+					results[entries[i].index] = tree_move_child(root, parent, component, parent, targetComponent);
+					break;
+			}
+		}
+
+		if (parent != NULL) {
+			tree_trace_back(parent, true, root, true);
+		}
+		first = last;
+	}
+
+	// Moves between directories need two locks each, and are applied on their own.
+	for (size_t i = first; i < valid; i++) {
+		results[entries[i].index] = tree_move(tree, entries[i].op->path, entries[i].op->target);
+	}
+	int err = tree_commit(root, 0);
+	for (size_t i = 0; i < count && err != 0; i++) {
+		if (results[i] == 0) {
+			results[i] = err;
+		}
+	}
+
+	free(entries);
+	errno = 0;
+	return errno;
+}
+
+// Builds the tree saved in the checkpoint, and sets `*nodes` to its nodes, in the order of the
+// checkpoint. Nobody else can see the tree yet, so each node is filled in directly, in one go.
+// Returns NULL and sets errno on failure.
+Tree * tree_load(Checkpoint * checkpoint, Tree * * * nodes) {
+	size_t count = checkpointCount(checkpoint);
+	size_t capacity = 16;
+	const char * * names = malloc(capacity * sizeof(const char *));
+	*nodes = malloc(count * sizeof(Tree *));
+	Tree * tree = tree_new();
+	if (names == NULL || *nodes == NULL || tree == NULL) {
+		goto fail;
+	}
+
+	(*nodes)[0] = tree;
+	for (size_t node = 0; node < count; node++) {
+		Tree * parent = (*nodes)[node];
+		parent->id = checkpointId(checkpoint, node);
+		size_t first;
+		size_t children = checkpointChildren(checkpoint, node, &first);
+		if (children > capacity) {
+			capacity = children;
+			const char * * larger = realloc(names, capacity * sizeof(const char *));
+			if (larger == NULL) {
+				goto fail;
+			}
+			names = larger;
+		}
+		if (!hmap_reserve(&parent->contents, children)) {
+			goto fail;
+		}
+
+		for (size_t i = 0; i < children; i++) {
+			names[i] = checkpointName(checkpoint, first + i);
+			Tree * child = tree_new_node(parent);
+			if (child == NULL) {
+				goto fail;
+			} else if (!hmap_insert(&parent->contents, names[i], child)) {
+				tree_free_subtree(child);
+				goto fail;
+			}
+			(*nodes)[first + i] = child;
+		}
+		// The checkpoint keeps the names sorted.
+		if (!niBuild(&parent->names, names, children)) {
+			goto fail;
+		}
+	}
+	free(names);
+	return tree;
+
+fail:
+	free(names);
+	free(*nodes);
+	*nodes = NULL;
+	if (tree != NULL) {
+		tree_free(tree);
+	}
+	errno = ENOMEM;
+	return NULL;
+}
+
+int tree_compare_version_entries(const void * a, const void * b) {
+	return strcmp(((const TreeVersionEntry *)a)->name, ((const TreeVersionEntry *)b)->name);
+}
+
+// Saves the tree as a checkpoint of the given generation at `path`. No thread may change it
+// meanwhile. Returns 0 on success, and an error code otherwise.
+int tree_save(Tree * tree, const char * path, uint64_t generation) {
+	CheckpointWriter * writer = checkpointCreate(path, generation);
+	if (writer == NULL) {
+		return errno;
+	}
+
+	// The nodes in breadth-first order, with their names.
+	size_t count = 1, capacity = 16;
+	TreeVersionEntry * queue = malloc(capacity * sizeof(TreeVersionEntry));
+	if (queue == NULL) {
+		checkpointAbort(writer);
+		return ENOMEM;
+	}
+	queue[0] = (TreeVersionEntry){.name = "", .child = tree};
+
+	int err = 0;
+	for (size_t i = 0; i < count && err == 0; i++) {
+		HashMap * contents = &queue[i].child->contents;
+		size_t children = hmap_size(contents);
+		if (count + children > capacity) {
+			capacity = count + children > 2 * capacity ? count + children : 2 * capacity;
+			TreeVersionEntry * larger = realloc(queue, capacity * sizeof(TreeVersionEntry));
+			if (larger == NULL) {
+				err = ENOMEM;
+				break;
+			}
+			queue = larger;
+		}
+
+		const char * key;
+		void * value;
+		HashMapIterator it = hmap_iterator(contents);
+		for (size_t j = count; hmap_next(contents, &it, &key, &value); j++) {
+			queue[j] = (TreeVersionEntry){.name = key, .child = value};
+		}
+		qsort(queue + count, children, sizeof(TreeVersionEntry), tree_compare_version_entries);
+		count += children;
+		err = checkpointAppend(writer, tree_id(queue[i].child), queue[i].name, children);
+	}
+	free(queue);
+
+	if (err != 0) {
+		checkpointAbort(writer);
+		return err;
+	}
+	return checkpointPublish(writer);
+}
+
+// The state of replaying a log over the checkpoint it continues.
+typedef struct TreeReplay {
+	Tree * root;
+	Checkpoint * checkpoint; // NULL if there is none.
+	Tree * * loaded; // The nodes of the checkpoint, in its order.
+	bool indexed; // Whether the identifiers of the checkpoint were indexed yet.
+	HashMap created; // The nodes created since, by their identifiers.
+	uint64_t nextId; // Above all the identifiers seen so far.
+	// Nodes removed since, which later records may still refer to.
+	Tree * * removed;
+	size_t count, capacity;
+} TreeReplay;
+
+void tree_replay_key(uint64_t id, char key[17]) {
+	snprintf(key, 17, "%" PRIx64, id);
+}
+
+Tree * tree_replay_node(TreeReplay * replay, uint64_t id) {
+	char key[17];
+	tree_replay_key(id, key);
+	Tree * node = hmap_get(&replay->created, key);
+	if (node == NULL && replay->checkpoint != NULL) {
+		size_t index = checkpointFind(replay->checkpoint, id);
+		node = index != SIZE_MAX ? replay->loaded[index] : NULL;
+	}
+	return node;
+}
+
+// Applies a record of the log, in a single thread. Records which do not apply to the tree,
+// as they could not have been logged, are skipped. Returns 0 on success, or ENOMEM.
+int tree_replay_record(const WalRecord * record, void * arg) {
+	TreeReplay * replay = arg;
+	if (replay->checkpoint != NULL && !replay->indexed) {
+		if (checkpointIndexIds(replay->checkpoint) != 0) {
+			return ENOMEM;
+		}
+		replay->indexed = true;
+	}
+	Tree * parent = tree_replay_node(replay, record->parent);
+	if (parent == NULL) {
+		return 0;
+	}
+
+	switch (record->type) {
+		case WAL_CREATE: {
+			Tree * child = tree_new_node(parent);
+			if (child == NULL) {
+				return ENOMEM;
+			}
+			if (tree_insert_child(replay->root, parent, record->name, child) != 0) {
+				tree_free_subtree(child);
+				return errno == EEXIST ? 0 : errno;
+			}
+			child->id = record->child;
+			if (record->child >= replay->nextId) {
+				replay->nextId = record->child + 1;
+			}
+			char key[17];
+			tree_replay_key(record->child, key);
+			return hmap_insert(&replay->created, key, child) ? 0 : ENOMEM;
+		}
+		case WAL_REMOVE: {
+			Tree * child = hmap_get(&parent->contents, record->name);
+			if (child == NULL) {
+				return 0;
+			}
+			if (replay->count == replay->capacity) {
+				size_t capacity = replay->capacity == 0 ? 16 : 2 * replay->capacity;
+				Tree * * removed = realloc(replay->removed, capacity * sizeof(Tree *));
+				if (removed == NULL) {
+					return ENOMEM;
+				}
+				replay->removed = removed;
+				replay->capacity = capacity;
+			}
+			if (tree_unlink_child(replay->root, parent, record->name, child) != 0) {
+				return errno;
+			}
+			replay->removed[replay->count++] = child;
+			return 0;
+		}
+		default: {
+			Tree * targetParent = tree_replay_node(replay, record->targetParent);
+			if (targetParent == NULL) {
+				return 0;
+			}
+			int err = tree_move_child(replay->root, parent, record->name, targetParent, record->targetName);
+			return err == ENOMEM ? err : 0;
+		}
+	}
+}
+
+Tree * tree_open(const char * path) {
+	errno = 0;
+	if (path == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t length = strlen(path);
+	char * checkpointPath = malloc(length + sizeof(".image"));
+	if (checkpointPath == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(checkpointPath, path, length);
+	memcpy(checkpointPath + length, ".image", sizeof(".image"));
+
+	// Load the last checkpoint, if there is one, and replay the log continuing it.
+	TreeReplay replay = {.root = NULL, .checkpoint = checkpointOpen(checkpointPath), .loaded = NULL, .indexed = false,
+	                     .nextId = 1, .removed = NULL, .count = 0, .capacity = 0};
+	uint64_t generation = 0;
+	Tree * tree = NULL;
+	int err = 0;
+	if (replay.checkpoint != NULL) {
+		generation = checkpointGeneration(replay.checkpoint);
+		tree = tree_load(replay.checkpoint, &replay.loaded);
+		for (size_t i = 0; tree != NULL && i < checkpointCount(replay.checkpoint); i++) {
+			if (checkpointId(replay.checkpoint, i) >= replay.nextId) {
+				replay.nextId = checkpointId(replay.checkpoint, i) + 1;
+			}
+		}
+	} else if (errno == ENOENT) {
+		tree = tree_new();
+		errno = tree == NULL ? ENOMEM : 0;
+	}
+	if (tree == NULL) {
+		err = errno;
 	} else {
-		// Else, save the new parent pointer, and lock the entry protocols.
-		sourceTarget->newParent = targetParent;
-		nmLock(sourceTarget->monitor);
+		// The tree has no log yet, so replaying does not log anything.
+		replay.root = tree;
+		hmap_init(&replay.created);
+		err = walReplay(path, generation, tree_replay_record, &replay);
+		if (err == ENOENT || err == ESTALE) {
+			err = 0;
+		}
+		// Nodes removed while the log was written are still counted in their subtrees.
+		for (size_t i = 0; i < replay.count; i++) {
+			tree_free_subtree(replay.removed[i]);
+		}
+		free(replay.removed);
+		hmap_destroy(&replay.created);
+	}
+	free(replay.loaded);
+	if (replay.checkpoint != NULL) {
+		checkpointClose(replay.checkpoint);
 	}
-	// Release the metadata protection.
-	semV(sourceTarget->mutex);
 
-	// Perform the tracebacks
-	if (sameParent) {
-		tree_trace_back(targetParent, true, root, true);
+	// The recovered tree is saved as the next checkpoint, continued by a new, empty log,
+	// so the log only grows with the changes made since. Once the checkpoint is in place,
+	// the previous log is stale, and skipped if it remains.
+	Wal * wal = NULL;
+	if (err == 0) {
+		err = tree_save(tree, checkpointPath, generation + 1);
+	}
+	if (err == 0 && (wal = walCreate(path, generation + 1)) == NULL) {
+		err = errno;
+	}
+	if (err == 0 && (err = walPublish(wal)) != 0) {
+		walClose(wal);
+	}
+	free(checkpointPath);
+	if (err != 0) {
+		if (tree != NULL) {
+			tree_free(tree);
+		}
+		errno = err;
+		return NULL;
+	}
+
+	atomic_store(&((TreeRoot *)tree)->nextId, replay.nextId);
+	((TreeRoot *)tree)->wal = wal;
+	return tree;
+}
+
+// Asynchronous requests (see `tree_ring_open`).
+//
+// Every ring has a submission queue, which its owner pushes to and the workers pop from,
+// and a completion queue, the other way round. Both have room for all the requests in flight,
+// so pushing never fails. `pending` counts the requests submitted to any of the rings and not
+// claimed by a worker yet. A worker claims one by decrementing it, and then pops it from
+// whichever ring it finds it in, so idle workers sleep on a single futex for all the rings.
+// Rings are freed only once no worker scanning the list of rings can see them (see Epoch.h).
+
+// Workers of a tree, or twice the number of processors if 0. Applying requests blocks them,
+// for example on syncs of the log, so there are more of them than processors.
+#ifndef TREE_RING_WORKERS
+	#define TREE_RING_WORKERS 0
+#endif
+
+// Completions reaped at a time while closing a ring.
+#define TREE_RING_CLOSE_BATCH 16
+
+typedef struct TreeWorkers {
+	Tree * tree;
+	_Atomic(TreeRing *) rings; // Linked through `next`, changed under the `ringsMutex` of the root.
+	atomic_size_t ringCount;
+	atomic_size_t turn; // Rotates the ring workers look into first, so that none of them is starved.
+	atomic_size_t pending;
+	atomic_uint wakeups; // The futex word idle workers sleep on, bumped by every submission.
+	atomic_uint sleeping;
+	atomic_bool stopping;
+	size_t count;
+	pthread_t threads[];
+} TreeWorkers;
+
+struct TreeRing {
+	TreeWorkers * workers;
+	Ring requests; // Of TreeRequest.
+	Ring completions; // Of TreeCompletion.
+	size_t entries;
+	size_t inFlight; // Only used by the owner of the ring.
+	int eventFd;
+	atomic_bool signaled; // Whether the eventfd was written to since it was last reset.
+	_Atomic(TreeRing *) next;
+};
+
+// Claims one of the pending requests. Returns false if there are none.
+bool tree_workers_claim(TreeWorkers * workers) {
+	size_t pending = atomic_load(&workers->pending);
+	while (pending > 0) {
+		if (atomic_compare_exchange_weak(&workers->pending, &pending, pending - 1)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Pops a claimed request, and sets `*ring` to the ring it was submitted to. Requires an epoch
+// critical section, which keeps the rings from being freed. Every claim is matched by a request
+// pushed before `pending` was incremented, so the scan ends once it reaches that request.
+void tree_workers_take(TreeWorkers * workers, TreeRing ** ring, TreeRequest * request) {
+	size_t count = atomic_load(&workers->ringCount);
+	size_t skip = atomic_fetch_add_explicit(&workers->turn, 1, memory_order_relaxed) % (count > 0 ? count : 1);
+	while (true) {
+		size_t i = 0;
+		for (TreeRing * candidate = atomic_load(&workers->rings); candidate != NULL; candidate = atomic_load(&candidate->next)) {
+			if (i++ >= skip && ringPop(&candidate->requests, request)) {
+				*ring = candidate;
+				return;
+			}
+		}
+		skip = 0;
+	}
+}
+
+// Lets the workers know that `count` requests were submitted, waking them up with one call at most.
+void tree_workers_notify(TreeWorkers * workers, size_t count) {
+	atomic_fetch_add(&workers->pending, count);
+	atomic_fetch_add(&workers->wakeups, 1);
+	if (atomic_load(&workers->sleeping) > 0) {
+		futexWake(&workers->wakeups, count < workers->count ? (int)count : (int)workers->count);
+	}
+}
+
+// Makes the eventfd of the ring readable, unless it was made so since it was last reset.
+void tree_ring_signal(TreeRing * ring) {
+	if (!atomic_exchange(&ring->signaled, true)) {
+		uint64_t one = 1;
+		if (write(ring->eventFd, &one, sizeof(one)) != sizeof(one)) {
+			syserr("ring eventfd write");
+		}
+	}
+}
+
+// Applies a request, like the function of its type would.
+TreeCompletion tree_ring_apply(Tree * tree, const TreeRequest * request) {
+	TreeCompletion completion = {.user_data = request->user_data, .result = 0, .listing = NULL};
+	if (request->op.type == TREE_OP_LIST) {
+		completion.listing = tree_list(tree, request->op.path);
+		completion.result = completion.listing == NULL ? errno : 0;
 	} else {
-		if (targetParent == LCA) {
-				tree_trace_back(sourceParent, true, LCA, false);
-				tree_trace_back(targetParent, true, root, true);
-			} else {
-				tree_trace_back(targetParent, true, LCA, false);
-				tree_trace_back(sourceParent, true, root, true);
+		completion.result = tree_apply(tree, &request->op);
+	}
+	return completion;
+}
+
+void * tree_worker_run(void * arg) {
+	TreeWorkers * workers = arg;
+	while (true) {
+		// Read before looking for requests, so that a submission meanwhile is not slept through.
+		unsigned wakeups = atomic_load(&workers->wakeups);
+		if (!tree_workers_claim(workers)) {
+			if (atomic_load(&workers->stopping)) {
+				return NULL;
 			}
+			atomic_fetch_add(&workers->sleeping, 1);
+			if (atomic_load(&workers->pending) == 0) {
+				futexWait(&workers->wakeups, wakeups);
+			}
+			atomic_fetch_sub(&workers->sleeping, 1);
+			continue;
+		}
+
+		TreeRing * ring;
+		TreeRequest request;
+		epochEnter();
+		tree_workers_take(workers, &ring, &request);
+		epochExit();
+
+		TreeCompletion completion = tree_ring_apply(workers->tree, &request);
+
+		// The ring is not closed before the completion is reaped, but it may be right after.
+		epochEnter();
+		if (!ringPush(&ring->completions, &completion)) {
+			fatal("completion queue of a ring is full");
+		}
+		tree_ring_signal(ring);
+		epochExit();
 	}
+}
 
-	return errno;
-}
\ No newline at end of file
+// Starts the workers of the tree. Returns NULL and sets errno on failure.
+TreeWorkers * tree_workers_start(Tree * tree) {
+	size_t count = TREE_RING_WORKERS;
+	if (count == 0) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		count = processors > 0 ? 2 * (size_t)processors : 2;
+	}
+
+	TreeWorkers * workers = malloc(sizeof(TreeWorkers) + count * sizeof(pthread_t));
+	if (workers == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	workers->tree = tree;
+	atomic_init(&workers->rings, NULL);
+	atomic_init(&workers->ringCount, 0);
+	atomic_init(&workers->turn, 0);
+	atomic_init(&workers->pending, 0);
+	atomic_init(&workers->wakeups, 0);
+	atomic_init(&workers->sleeping, 0);
+	atomic_init(&workers->stopping, false);
+	workers->count = 0;
+
+	while (workers->count < count) {
+		int err = pthread_create(&workers->threads[workers->count], NULL, tree_worker_run, workers);
+		if (err != 0) {
+			tree_workers_stop(workers);
+			errno = err;
+			return NULL;
+		}
+		workers->count++;
+	}
+	return workers;
+}
+
+// Stops the workers, which must have no requests left, and frees them.
+void tree_workers_stop(TreeWorkers * workers) {
+	atomic_store(&workers->stopping, true);
+	atomic_fetch_add(&workers->wakeups, 1);
+	futexWake(&workers->wakeups, INT_MAX);
+	for (size_t i = 0; i < workers->count; i++) {
+		int err;
+		if ((err = pthread_join(workers->threads[i], NULL)) != 0) {
+			syserr("worker join %d", err);
+		}
+	}
+	free(workers);
+}
+
+void tree_ring_destroy(TreeRing * ring) {
+	close(ring->eventFd);
+	ringDestroy(&ring->requests);
+	ringDestroy(&ring->completions);
+	free(ring);
+}
+
+TreeRing * tree_ring_open(Tree * tree, size_t entries) {
+	errno = 0;
+	if (tree == NULL || tree_is_snapshot(tree) || entries == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	TreeRoot * root = (TreeRoot *)tree;
+
+	TreeRing * ring = malloc(sizeof(TreeRing));
+	if (ring == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	int err = ringInit(&ring->requests, entries, sizeof(TreeRequest));
+	if (err == 0 && (err = ringInit(&ring->completions, entries, sizeof(TreeCompletion))) != 0) {
+		ringDestroy(&ring->requests);
+	}
+	if (err == 0 && (ring->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		err = errno;
+		ringDestroy(&ring->requests);
+		ringDestroy(&ring->completions);
+	}
+	if (err != 0) {
+		free(ring);
+		errno = err;
+		return NULL;
+	}
+	ring->entries = entries;
+	ring->inFlight = 0;
+	atomic_init(&ring->signaled, false);
+
+	semP(&root->ringsMutex);
+	if (root->workers == NULL && (root->workers = tree_workers_start(tree)) == NULL) {
+		err = errno;
+	} else {
+		ring->workers = root->workers;
+		atomic_init(&ring->next, atomic_load(&ring->workers->rings));
+		atomic_store(&ring->workers->rings, ring);
+		atomic_fetch_add(&ring->workers->ringCount, 1);
+	}
+	semV(&root->ringsMutex);
+
+	if (err != 0) {
+		tree_ring_destroy(ring);
+		errno = err;
+		return NULL;
+	}
+	return ring;
+}
+
+int tree_ring_fd(TreeRing * ring) {
+	return ring->eventFd;
+}
+
+size_t tree_ring_submit(TreeRing * ring, const TreeRequest * requests, size_t count) {
+	if (count > ring->entries - ring->inFlight) {
+		count = ring->entries - ring->inFlight;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (!ringPush(&ring->requests, &requests[i])) {
+			fatal("submission queue of a ring is full");
+		}
+	}
+	ring->inFlight += count;
+	if (count > 0) {
+		tree_workers_notify(ring->workers, count);
+	}
+	return count;
+}
+
+size_t tree_ring_reap(TreeRing * ring, TreeCompletion * completions, size_t max) {
+	// Reset the eventfd before looking at the queue, so that completions pushed meanwhile set it again.
+	if (atomic_exchange(&ring->signaled, false)) {
+		uint64_t value;
+		if (read(ring->eventFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+			syserr("ring eventfd read");
+		}
+	}
+	size_t count = 0;
+	while (count < max && ringPop(&ring->completions, &completions[count])) {
+		count++;
+	}
+	ring->inFlight -= count;
+	// Completions may have been left behind for the next call.
+	if (count == max && ring->inFlight > 0) {
+		tree_ring_signal(ring);
+	}
+	return count;
+}
+
+void tree_ring_close(TreeRing * ring) {
+	TreeCompletion completions[TREE_RING_CLOSE_BATCH];
+	while (ring->inFlight > 0) {
+		size_t count = tree_ring_reap(ring, completions, TREE_RING_CLOSE_BATCH);
+		for (size_t i = 0; i < count; i++) {
+			free(completions[i].listing);
+		}
+		if (count == 0) {
+			struct pollfd readable = {.fd = ring->eventFd, .events = POLLIN};
+			if (poll(&readable, 1, -1) < 0 && errno != EINTR) {
+				syserr("ring poll");
+			}
+		}
+	}
+
+	TreeWorkers * workers = ring->workers;
+	TreeRoot * root = (TreeRoot *)workers->tree;
+	semP(&root->ringsMutex);
+	_Atomic(TreeRing *) * link = &workers->rings;
+	while (atomic_load(link) != ring) {
+		link = &atomic_load(link)->next;
+	}
+	atomic_store(link, atomic_load(&ring->next));
+	atomic_fetch_sub(&workers->ringCount, 1);
+	semV(&root->ringsMutex);
+
+	// Workers looking for requests may still be passing through the ring.
+	epochSynchronize();
+	tree_ring_destroy(ring);
+}
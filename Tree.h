@@ -1,15 +1,169 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
+typedef struct TreeListing TreeListing;
+
+typedef struct TreeListCursor TreeListCursor;
+
 Tree* tree_new();
 
+// Like `tree_new`, but the tree is durable: its changes are logged to a write-ahead log at `path`.
+// Changing operations return once their changes are durable, and concurrent ones share the syncs.
+// Opening loads the checkpoint image at `path` with ".image" appended, if there is one, replays
+// the log, and then saves the tree as the next checkpoint, so the log only holds the changes
+// made since the tree was last opened. Returns NULL and sets errno on failure.
+// If writing or syncing the log fails, changing operations still make their changes, but return
+// the error of the log (e.g. EIO), since they are not known to be durable, and so do all later ones.
+Tree* tree_open(const char* path);
+
 void tree_free(Tree*);
 
+// Returns a read-only, point-in-time view of the tree. Taking it copies nothing, and waits for no
+// other thread: the first write to each folder afterwards keeps its old contents, and readers of
+// the snapshot wait for the writes which were in progress. While there are snapshots, changing
+// operations fail with ENOMEM, changing nothing, if the old contents cannot be kept.
+// Snapshots can be read with `tree_list` and `tree_list_shared`, which take no locks on them.
+// Other operations fail with EROFS (`tree_list_open` with EINVAL). A snapshot must be freed
+// with `tree_free`, before the tree itself. Returns NULL and sets errno (EINVAL or ENOMEM) on failure.
+Tree* tree_snapshot(Tree* tree);
+
 char* tree_list(Tree* tree, const char* path);
 
+// Like `tree_list`, but returns a shared, read-only handle to the cached listing
+// of the directory instead of a fresh copy. Readers of an unchanged directory
+// share one buffer. The handle stays valid until `tree_listing_release`.
+const TreeListing* tree_list_shared(Tree* tree, const char* path);
+
+// Returns the comma-separated contents of a listing.
+const char* tree_listing_contents(const TreeListing* listing);
+
+// Returns the length of the contents of a listing.
+size_t tree_listing_length(const TreeListing* listing);
+
+// Releases a handle returned by `tree_list_shared`.
+void tree_listing_release(const TreeListing* listing);
+
+// Opens a cursor listing the folder at `path` in pages of at most `pageSize` names, in sorted
+// order. No locks are held between pages: each page resumes after the last name returned,
+// so names inserted or removed meanwhile are listed if and only if they come later.
+// Returns NULL and sets errno (EINVAL, ENOENT or ENOMEM) on failure.
+TreeListCursor* tree_list_open(Tree* tree, const char* path, size_t pageSize);
+
+// Returns the next page, comma-separated like `tree_list`, which the caller should free.
+// Returns NULL once all names have been listed (with errno set to 0), or on failure
+// (with errno set to ENOENT if the folder no longer exists, or ENOMEM).
+char* tree_list_next(TreeListCursor* cursor);
+
+// Frees a cursor returned by `tree_list_open`.
+void tree_list_close(TreeListCursor* cursor);
+
+// Returns the number of lock-free path lookups (made by `tree_list` and `tree_list_shared`)
+// which were served by the path cache of the tree, and of those which missed it.
+void tree_path_cache_stats(Tree* tree, size_t* hits, size_t* misses);
+
+// Lock contention of a folder, counted since it was created (only if built with TREE_STATS).
+typedef struct TreeNodeStats {
+    char* path;
+    unsigned long reader_entries, writer_entries;
+    unsigned long waits;        // Entries which had to wait for other threads.
+    unsigned long wait_ns;      // Total time spent waiting.
+} TreeNodeStats;
+
+// Returns the (at most) `k` folders of the tree with the most time spent waiting to enter them,
+// most contended first, and sets `*count` to their number. Folders moved during the call
+// may be missed. Returns NULL and sets errno on failure: ENOTSUP if built without TREE_STATS,
+// EINVAL if the arguments are invalid or the tree is a snapshot, and ENOMEM.
+TreeNodeStats* tree_stats_top(Tree* tree, size_t k, size_t* count);
+
+// Frees an array returned by `tree_stats_top`.
+void tree_stats_free(TreeNodeStats* stats, size_t count);
+
+// Turns the tracing of lock entries and exits on or off, in all trees. Every thread keeps
+// its latest events in a ring buffer of its own, so tracing can be left on under load.
+void tree_trace_enable(bool enabled);
+
+// Writes the events traced so far to `path`, to be printed by the `tree_trace` tool.
+// Returns 0 on success, and an error code otherwise.
+int tree_trace_dump(const char* path);
+
 int tree_create(Tree* tree, const char* path);
 
+// Like `tree_create`, but also creates all the missing folders along the path, like `mkdir -p`,
+// in a single descent. Returns 0 if the folder exists afterwards, even if it existed before.
+int tree_create_all(Tree* tree, const char* path);
+
 int tree_remove(Tree* tree, const char* path);
 
+// Like `tree_remove`, but also removes everything inside a non-empty folder.
+// The whole subtree is detached in one step, and freed later, outside of any locks.
+int tree_remove_recursive(Tree* tree, const char* path);
+
 int tree_move(Tree* tree, const char* source, const char* target);
+
+typedef enum TreeOpType {
+    TREE_OP_CREATE,
+    TREE_OP_REMOVE,
+    TREE_OP_MOVE,
+    TREE_OP_LIST, // Only in rings (see `tree_ring_open`), batches fail it with EINVAL.
+} TreeOpType;
+
+// A single operation of a batch. `target` is only used by moves.
+typedef struct TreeOp {
+    TreeOpType type;
+    const char* path;
+    const char* target;
+} TreeOp;
+
+// Applies `count` operations, storing the result each of them would have returned
+// from `tree_create`, `tree_remove` or `tree_move` in `results`.
+// Operations are grouped by the directory they modify, and each group is applied
+// in submission order under a single write lock on it, with the groups taken in
+// lexicographic order of their paths. Moves between two directories are applied
+// last, in submission order. Apart from that, operations in different directories
+// are not ordered with respect to each other.
+// Returns EINVAL if the arguments are invalid, and 0 otherwise.
+int tree_batch(Tree* tree, const TreeOp* ops, size_t count, int* results);
+
+typedef struct TreeRing TreeRing;
+
+// A request posted to a ring. Its paths must stay valid until its completion is reaped.
+typedef struct TreeRequest {
+    TreeOp op;
+    unsigned long long user_data; // Passed on to the completion, to tell which request it is of.
+} TreeRequest;
+
+typedef struct TreeCompletion {
+    unsigned long long user_data;
+    // What `tree_create`, `tree_remove` or `tree_move` returned, and for lists,
+    // 0 or the error `tree_list` set errno to.
+    int result;
+    char* listing; // What `tree_list` returned, to be freed by the caller, or NULL.
+} TreeCompletion;
+
+// Opens a ring for applying requests asynchronously: they are posted to its submission queue,
+// applied by the worker pool of the tree, started along with its first ring, and their results
+// are put in its completion queue. Submitting and reaping never wait for the locks of the tree.
+// At most `entries` requests may be in flight, that is submitted and not reaped yet.
+// A ring is used by one thread at a time, and must be closed before the tree is freed.
+// Returns NULL and sets errno on failure: EINVAL if the tree is a snapshot or `entries` is 0,
+// and ENOMEM or the error of creating the eventfd or the threads otherwise.
+TreeRing* tree_ring_open(Tree* tree, size_t entries);
+
+// Returns an eventfd which is readable while there are completions to reap, for use with
+// `poll` or `epoll`. It is reset by `tree_ring_reap`, so it should not be read otherwise.
+int tree_ring_fd(TreeRing* ring);
+
+// Posts the requests, waking the workers up once for all of them, and returns how many
+// of them were posted, in order: fewer than `count` if there is no room for all of them.
+// Requests are applied concurrently, not necessarily in the order they were posted.
+size_t tree_ring_submit(TreeRing* ring, const TreeRequest* requests, size_t count);
+
+// Moves at most `max` completions into `completions`, and returns their number.
+size_t tree_ring_reap(TreeRing* ring, TreeCompletion* completions, size_t max);
+
+// Waits for the requests in flight, discarding their completions, and frees the ring.
+void tree_ring_close(TreeRing* ring);
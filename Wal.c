@@ -0,0 +1,455 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "err.h"
+
+#include "Wal.h"
+
+/**
+ * The log starts with a header: the magic bytes and the generation of the checkpoint it continues.
+ * Every record is then its payload length and checksum (32 bits each), and the payload:
+ *   the type (8 bits), the parent (64 bits),
+ *   the child for creations, or the target parent for moves (64 bits),
+ *   the name, as its length (8 bits) and characters,
+ *   and the target name the same way, for moves.
+ * Integers are stored in the byte order of the machine.
+ */
+
+#define MAGIC "TREEWAL1"
+#define MAGIC_LENGTH 8
+#define HEADER_LENGTH (MAGIC_LENGTH + 8)
+#define RECORD_HEADER_LENGTH 8
+#define MAX_PAYLOAD_LENGTH (1 + 8 + 8 + 2 * (1 + MAX_FOLDER_NAME_LENGTH))
+
+#define INITIAL_CAPACITY 4096
+
+struct Wal {
+	int fd;
+	char * path;
+	char * newPath; // Where the log is written until it is published, NULL afterwards.
+
+	pthread_mutex_t mutex;
+	pthread_cond_t durableChanged;
+	// Records appended but not written out yet, and the buffer the leader is writing out.
+	char * buffer, * spare;
+	size_t length, capacity, spareCapacity;
+	uint64_t appended; // Position after the last appended record.
+	_Atomic(uint64_t) durable; // Position up to which the log is synced, or given up on.
+	bool syncing; // Whether a leader is writing out a batch.
+	atomic_int error; // The first failure to write out or sync a batch, after which nothing more is.
+};
+
+// The log and position of the last record appended by the thread.
+static _Thread_local Wal * threadWal = NULL;
+static _Thread_local uint64_t threadPosition = 0;
+
+static uint32_t checksum(const char * data, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static void lock(Wal * wal) {
+	int err;
+	if ((err = pthread_mutex_lock(&wal->mutex)) != 0) {
+		syserr("wal lock %d", err);
+	}
+}
+
+static void unlock(Wal * wal) {
+	int err;
+	if ((err = pthread_mutex_unlock(&wal->mutex)) != 0) {
+		syserr("wal unlock %d", err);
+	}
+}
+
+// Returns 0 on success, and an error code otherwise.
+static int writeAll(int fd, const char * data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0 && errno != EINTR) {
+			return errno;
+		} else if (written > 0) {
+			data += written;
+			length -= written;
+		}
+	}
+	return 0;
+}
+
+// Writes out and syncs everything appended so far, as the leader of a batch.
+// After a failure, the batches are dropped instead, and count as synced for the waiting threads,
+// which then see the error. Requires the mutex, and releases it meanwhile.
+static void flush(Wal * wal) {
+	wal->syncing = true;
+	char * batch = wal->buffer;
+	size_t length = wal->length;
+	size_t capacity = wal->capacity;
+	uint64_t position = wal->appended;
+	wal->buffer = wal->spare;
+	wal->capacity = wal->spareCapacity;
+	wal->length = 0;
+	wal->spare = batch;
+	wal->spareCapacity = capacity;
+	bool failed = atomic_load(&wal->error) != 0;
+	unlock(wal);
+
+	int err = 0;
+	if (!failed && (err = writeAll(wal->fd, batch, length)) == 0 && fdatasync(wal->fd) != 0) {
+		err = errno;
+	}
+
+	lock(wal);
+	if (err != 0 && !failed) {
+		atomic_store(&wal->error, err);
+	}
+	atomic_store(&wal->durable, position);
+	wal->syncing = false;
+	if ((err = pthread_cond_broadcast(&wal->durableChanged)) != 0) {
+		syserr("wal broadcast %d", err);
+	}
+}
+
+// Waits until the current batch is written out. Requires the mutex.
+static void waitForBatch(Wal * wal) {
+	int err;
+	if ((err = pthread_cond_wait(&wal->durableChanged, &wal->mutex)) != 0) {
+		syserr("wal wait %d", err);
+	}
+}
+
+// Returns 0 on success, and the error of the log otherwise.
+static int syncTo(Wal * wal, uint64_t position) {
+	if (position <= atomic_load(&wal->durable)) {
+		return atomic_load(&wal->error);
+	}
+	lock(wal);
+	while (atomic_load(&wal->durable) < position) {
+		if (!wal->syncing) {
+			flush(wal);
+		} else {
+			waitForBatch(wal);
+		}
+	}
+	unlock(wal);
+	return atomic_load(&wal->error);
+}
+
+int walSync(Wal * wal) {
+	return threadWal == wal ? syncTo(wal, threadPosition) : 0;
+}
+
+static int syncAll(Wal * wal) {
+	lock(wal);
+	uint64_t position = wal->appended;
+	unlock(wal);
+	return syncTo(wal, position);
+}
+
+static void append(Wal * wal, const char * data, size_t length) {
+	lock(wal);
+	while (wal->length + length > wal->capacity) {
+		size_t capacity = wal->capacity * 2 >= wal->length + length ? wal->capacity * 2 : wal->length + length;
+		char * buffer = realloc(wal->buffer, capacity);
+		if (buffer != NULL) {
+			wal->buffer = buffer;
+			wal->capacity = capacity;
+		} else if (!wal->syncing) {
+			// Make room by writing out the buffer instead, which then takes the spare one,
+			// always large enough for a record.
+			flush(wal);
+		} else {
+			waitForBatch(wal);
+		}
+	}
+	memcpy(wal->buffer + wal->length, data, length);
+	wal->length += length;
+	wal->appended += length;
+	threadWal = wal;
+	threadPosition = wal->appended;
+	unlock(wal);
+}
+
+static char * putInteger(char * end, uint64_t value) {
+	memcpy(end, &value, sizeof(value));
+	return end + sizeof(value);
+}
+
+static char * putName(char * end, const char * name) {
+	size_t length = strlen(name);
+	*end++ = (char)length;
+	memcpy(end, name, length);
+	return end + length;
+}
+
+static void appendRecord(Wal * wal, WalRecordType type, uint64_t parent, uint64_t other,
+                         const char * name, const char * targetName) {
+	char record[RECORD_HEADER_LENGTH + MAX_PAYLOAD_LENGTH];
+	char * payload = record + RECORD_HEADER_LENGTH;
+	char * end = payload;
+	*end++ = (char)type;
+	end = putInteger(end, parent);
+	end = putInteger(end, other);
+	end = putName(end, name);
+	if (targetName != NULL) {
+		end = putName(end, targetName);
+	}
+
+	uint32_t length = end - payload;
+	uint32_t sum = checksum(payload, length);
+	memcpy(record, &length, sizeof(length));
+	memcpy(record + sizeof(length), &sum, sizeof(sum));
+	append(wal, record, end - record);
+}
+
+void walAppendCreate(Wal * wal, uint64_t parent, const char * name, uint64_t child) {
+	appendRecord(wal, WAL_CREATE, parent, child, name, NULL);
+}
+
+void walAppendRemove(Wal * wal, uint64_t parent, const char * name) {
+	appendRecord(wal, WAL_REMOVE, parent, 0, name, NULL);
+}
+
+void walAppendMove(Wal * wal, uint64_t sourceParent, const char * sourceName,
+                   uint64_t targetParent, const char * targetName) {
+	appendRecord(wal, WAL_MOVE, sourceParent, targetParent, sourceName, targetName);
+}
+
+Wal * walCreate(const char * path, uint64_t generation) {
+	Wal * wal = calloc(1, sizeof(Wal));
+	if (wal == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size_t length = strlen(path);
+	wal->path = malloc(length + 1);
+	wal->newPath = malloc(length + sizeof(".new"));
+	wal->buffer = malloc(INITIAL_CAPACITY);
+	wal->spare = malloc(INITIAL_CAPACITY);
+	if (wal->path == NULL || wal->newPath == NULL || wal->buffer == NULL || wal->spare == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	memcpy(wal->path, path, length + 1);
+	memcpy(wal->newPath, path, length);
+	memcpy(wal->newPath + length, ".new", sizeof(".new"));
+	wal->capacity = wal->spareCapacity = INITIAL_CAPACITY;
+
+	int err;
+	if ((err = pthread_mutex_init(&wal->mutex, NULL)) != 0) {
+		errno = err;
+		goto fail;
+	}
+	if ((err = pthread_cond_init(&wal->durableChanged, NULL)) != 0) {
+		pthread_mutex_destroy(&wal->mutex);
+		errno = err;
+		goto fail;
+	}
+
+	wal->fd = open(wal->newPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (wal->fd < 0) {
+		pthread_cond_destroy(&wal->durableChanged);
+		pthread_mutex_destroy(&wal->mutex);
+		goto fail;
+	}
+
+	char header[HEADER_LENGTH];
+	memcpy(header, MAGIC, MAGIC_LENGTH);
+	putInteger(header + MAGIC_LENGTH, generation);
+	append(wal, header, HEADER_LENGTH);
+	return wal;
+
+fail:
+	err = errno;
+	free(wal->spare);
+	free(wal->buffer);
+	free(wal->newPath);
+	free(wal->path);
+	free(wal);
+	errno = err;
+	return NULL;
+}
+
+int walReplaceFile(const char * newPath, const char * path) {
+	if (rename(newPath, path) != 0) {
+		return errno;
+	}
+
+	// The rename itself is durable once the directory is synced.
+	const char * slash = strrchr(path, '/');
+	int dir;
+	if (slash == NULL) {
+		dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else if (slash == path) {
+		dir = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		char * directory = strndup(path, slash - path);
+		if (directory == NULL) {
+			return ENOMEM;
+		}
+		dir = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		free(directory);
+	}
+	if (dir < 0) {
+		return errno;
+	}
+	int err = fsync(dir) != 0 ? errno : 0;
+	close(dir);
+	return err;
+}
+
+int walPublish(Wal * wal) {
+	int err = syncAll(wal);
+	if (err != 0) {
+		return err;
+	}
+	err = walReplaceFile(wal->newPath, wal->path);
+	if (err != 0) {
+		return err;
+	}
+
+	free(wal->newPath);
+	wal->newPath = NULL;
+	return 0;
+}
+
+void walClose(Wal * wal) {
+	syncAll(wal);
+	close(wal->fd);
+	if (wal->newPath != NULL) {
+		// Never published, the previous log stays in place.
+		unlink(wal->newPath);
+		free(wal->newPath);
+	}
+	if (threadWal == wal) {
+		threadWal = NULL;
+	}
+	pthread_cond_destroy(&wal->durableChanged);
+	pthread_mutex_destroy(&wal->mutex);
+	free(wal->spare);
+	free(wal->buffer);
+	free(wal->path);
+	free(wal);
+}
+
+static uint64_t getInteger(const char * data) {
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+// Reads a name, given the end of the payload. Returns NULL if it does not fit in the payload.
+static const char * getName(const char * data, const char * end, char * name) {
+	if (data >= end || (unsigned char)*data > end - data - 1) {
+		return NULL;
+	}
+	size_t length = (unsigned char)*data++;
+	memcpy(name, data, length);
+	name[length] = '\0';
+	return data + length;
+}
+
+// Decodes a payload. Returns false if it is malformed.
+static bool decode(const char * payload, size_t length, WalRecord * record) {
+	const char * end = payload + length;
+	if (length < 1 + 8 + 8) {
+		return false;
+	}
+	record->type = (unsigned char)payload[0];
+	record->parent = getInteger(payload + 1);
+	uint64_t other = getInteger(payload + 1 + 8);
+	const char * data = getName(payload + 1 + 8 + 8, end, record->name);
+	switch (record->type) {
+		case WAL_CREATE:
+			record->child = other;
+			return data == end;
+		case WAL_REMOVE:
+			return data == end;
+		case WAL_MOVE:
+			record->targetParent = other;
+			return data != NULL && getName(data, end, record->targetName) == end;
+		default:
+			return false;
+	}
+}
+
+int walReplay(const char * path, uint64_t generation, int (*apply)(const WalRecord * record, void * arg), void * arg) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return errno;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		int err = errno;
+		close(fd);
+		return err;
+	}
+	size_t size = status.st_size;
+	char * data = malloc(size > 0 ? size : 1);
+	if (data == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+	size_t done = 0;
+	while (done < size) {
+		ssize_t chunk = pread(fd, data + done, size - done, done);
+		if (chunk < 0 && errno != EINTR) {
+			int err = errno;
+			free(data);
+			close(fd);
+			return err;
+		} else if (chunk == 0) {
+			size = done;
+		} else if (chunk > 0) {
+			done += chunk;
+		}
+	}
+	close(fd);
+
+	if (size < HEADER_LENGTH || memcmp(data, MAGIC, MAGIC_LENGTH) != 0) {
+		free(data);
+		return EINVAL;
+	}
+	uint64_t base = getInteger(data + MAGIC_LENGTH);
+	if (base != generation) {
+		free(data);
+		return base < generation ? ESTALE : EINVAL;
+	}
+
+	WalRecord * record = malloc(sizeof(WalRecord));
+	if (record == NULL) {
+		free(data);
+		return ENOMEM;
+	}
+	int err = 0;
+	size_t position = HEADER_LENGTH;
+	while (err == 0 && size - position >= RECORD_HEADER_LENGTH) {
+		uint32_t length, sum;
+		memcpy(&length, data + position, sizeof(length));
+		memcpy(&sum, data + position + sizeof(length), sizeof(sum));
+		const char * payload = data + position + RECORD_HEADER_LENGTH;
+		if (length > MAX_PAYLOAD_LENGTH || length > size - position - RECORD_HEADER_LENGTH
+		    || checksum(payload, length) != sum || !decode(payload, length, record)) {
+			break;
+		}
+		err = apply(record, arg);
+		position += RECORD_HEADER_LENGTH + length;
+	}
+
+	free(record);
+	free(data);
+	return err;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "path_utils.h"
+
+// A write-ahead log of the changes to a tree, for recovering it after a restart.
+//
+// Records name the nodes they change by identifiers, and never by paths. Nodes are numbered
+// as they are created, and keep their identifiers in the checkpoints, so identifiers are never
+// reused. A log continues a checkpoint image (see Checkpoint.h), identified by its generation
+// in the header of the log.
+// They are appended while the changed nodes are write-locked, so the records of each node
+// are in the order of its changes, and replaying them in log order reproduces the tree even
+// if other nodes were moved concurrently.
+//
+// Appending only copies the record to a buffer, and never fails: if the buffer cannot grow,
+// the appending thread writes it out to make room. Threads then wait for their records to become
+// durable after releasing their locks: the first one writes out and syncs everything appended
+// so far, while the ones arriving meanwhile wait for it, and then for one more batch at most.
+// Once writing or syncing the log fails, what has reached the disk is unknown, so nothing more
+// is written, and every thread waiting for its records gets the error from then on.
+
+typedef struct Wal Wal;
+
+typedef enum WalRecordType {
+	WAL_CREATE = 1,
+	WAL_REMOVE = 2, // Of a folder together with everything inside it.
+	WAL_MOVE = 3,
+} WalRecordType;
+
+typedef struct WalRecord {
+	WalRecordType type;
+	uint64_t parent; // The source parent, for moves.
+	uint64_t child; // The created node, for creations.
+	uint64_t targetParent; // For moves.
+	char name[MAX_FOLDER_NAME_LENGTH + 1]; // The source name, for moves.
+	char targetName[MAX_FOLDER_NAME_LENGTH + 1]; // For moves.
+} WalRecord;
+
+// Calls `apply` with every record of the log at `path`, in order, if it continues the checkpoint
+// of the given generation. Stops at the first incomplete or damaged record, which a crash may
+// have left behind, or at the first error returned by `apply`.
+// Returns 0 on success, and an error code otherwise: ENOENT if there is no log, ESTALE if it
+// continues an older checkpoint (whose successor thus already has all of its changes), EINVAL
+// if the file is not a log or it continues a newer checkpoint, or the error returned by `apply`.
+int walReplay(const char * path, uint64_t generation, int (*apply)(const WalRecord * record, void * arg), void * arg);
+
+// Starts a new log continuing the checkpoint of the given generation, to replace the one
+// at `path` once `walPublish` is called. Returns NULL and sets errno on failure.
+Wal * walCreate(const char * path, uint64_t generation);
+
+// Syncs everything appended so far, and replaces the previous log at the path of the new one.
+// Returns 0 on success, and an error code otherwise.
+int walPublish(Wal * wal);
+
+// Durably replaces the file at `path` with the one at `newPath`, which must be synced already.
+// Returns 0 on success, and an error code otherwise.
+int walReplaceFile(const char * newPath, const char * path);
+
+// Syncs everything appended so far, unless the log failed, and closes it.
+void walClose(Wal * wal);
+
+void walAppendCreate(Wal * wal, uint64_t parent, const char * name, uint64_t child);
+
+void walAppendRemove(Wal * wal, uint64_t parent, const char * name);
+
+void walAppendMove(Wal * wal, uint64_t sourceParent, const char * sourceName,
+                   uint64_t targetParent, const char * targetName);
+
+// Waits until all the records appended by the calling thread are durable.
+// Returns 0 on success, and the error of the log if it failed.
+int walSync(Wal * wal);
@@ -1,6 +1,7 @@
 // Simple test checking basic correctness of all functions.
 
-#include "../Tree.h"
+#include "Tree.h"
+#include "path_utils.h"
 
 #include <assert.h>
 #include <string.h>
@@ -8,8 +9,149 @@
 #include <stddef.h>
 #include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+
+#define KERNEL_PATHS 200
+#define KERNEL_PATH_LENGTH 320
+
+// Fills `path` with a random path sharing a random prefix with `base`. A quarter of them
+// are made invalid, by an invalid character, an empty folder name or a missing final '/'.
+static void random_path(char *path, const char *base, unsigned *seed) {
+	size_t length = rand_r(seed) % (strlen(base) + 1);
+	while (length > 0 && base[length - 1] != '/')
+		length--;
+	memcpy(path, base, length);
+	if (length == 0)
+		path[length++] = '/';
+	size_t end = length + rand_r(seed) % (KERNEL_PATH_LENGTH - length);
+	while (length + 1 < end) {
+		size_t name_end = length + 1 + rand_r(seed) % 40;
+		while (length < name_end && length + 1 < end)
+			path[length++] = 'a' + rand_r(seed) % 3;
+		path[length++] = '/';
+	}
+	path[length] = '\0';
+	if (rand_r(seed) % 4 == 0 && length > 1) {
+		const char defects[] = {'A', '\x80', '/', '\0'};
+		path[1 + rand_r(seed) % (length - 1)] = defects[rand_r(seed) % 4];
+	}
+}
+
+// Checks that the SIMD path kernels agree with the scalar ones.
+static void check_path_kernels(void) {
+	static char paths[KERNEL_PATHS][KERNEL_PATH_LENGTH + 1];
+	static ParsedPath scalar_parsed, simd_parsed;
+	unsigned seed = 1;
+	strcpy(paths[0], "/");
+	for (size_t i = 1; i < KERNEL_PATHS; i++)
+		random_path(paths[i], paths[rand_r(&seed) % i], &seed);
+	// A folder name of MAX_FOLDER_NAME_LENGTH + 1 letters.
+	memset(paths[1] + 1, 'a', MAX_FOLDER_NAME_LENGTH + 1);
+	paths[1][0] = paths[1][MAX_FOLDER_NAME_LENGTH + 2] = '/';
+	paths[1][MAX_FOLDER_NAME_LENGTH + 3] = '\0';
+
+	for (size_t i = 0; i < KERNEL_PATHS; i++) {
+		for (PathSimd simd = PATH_SIMD_SSE2; simd <= path_simd_supported(); simd++) {
+			path_simd_select(PATH_SIMD_SCALAR);
+			bool valid = parse_path(paths[i], &scalar_parsed);
+			assert(valid == is_path_valid(paths[i]));
+			path_simd_select(simd);
+			assert(valid == is_path_valid(paths[i]));
+			assert(valid == parse_path(paths[i], &simd_parsed));
+			if (!valid)
+				continue;
+			assert(simd_parsed.depth == scalar_parsed.depth);
+			assert(memcmp(simd_parsed.components, scalar_parsed.components,
+			              scalar_parsed.depth * sizeof(PathComponent)) == 0);
+
+			for (size_t j = 0; j < KERNEL_PATHS; j++) {
+				static ParsedPath other;
+				char lca[2][KERNEL_PATH_LENGTH + 1], suffix1[2][KERNEL_PATH_LENGTH + 1], suffix2[2][KERNEL_PATH_LENGTH + 1];
+				bool prefix[2];
+				size_t common[2];
+				if (!is_path_valid(paths[j]))
+					continue;
+				for (int k = 0; k < 2; k++) {
+					path_simd_select(k == 0 ? PATH_SIMD_SCALAR : simd);
+					parse_path(paths[j], &other);
+					split_paths_by_LCA(paths[i], paths[j], lca[k], suffix1[k], suffix2[k]);
+					prefix[k] = is_proper_prefix_of_path(paths[i], paths[j]);
+					common[k] = path_common_depth(&simd_parsed, &other);
+					assert(prefix[k] == is_proper_prefix_of_parsed_path(&simd_parsed, &other));
+				}
+				assert(strcmp(lca[0], lca[1]) == 0 && strcmp(suffix1[0], suffix1[1]) == 0
+				       && strcmp(suffix2[0], suffix2[1]) == 0);
+				assert(prefix[0] == prefix[1] && common[0] == common[1]);
+			}
+		}
+	}
+	path_simd_select(path_simd_supported());
+}
+
+// Applies requests through a ring, waiting for their completions on its eventfd.
+static void check_ring(void) {
+	Tree *tree = tree_new();
+	assert(tree_ring_open(tree, 0) == NULL && errno == EINVAL);
+	TreeRing *ring = tree_ring_open(tree, 4);
+	assert(ring != NULL);
+	TreeRequest requests[] = {
+		{{TREE_OP_CREATE, "/a/", NULL}, 1},
+		{{TREE_OP_CREATE, "/b/", NULL}, 2},
+		{{TREE_OP_CREATE, "/c/", NULL}, 3},
+		{{TREE_OP_CREATE, "/x", NULL}, 4},
+		{{TREE_OP_LIST, "/", NULL}, 5},
+	};
+	assert(tree_ring_submit(ring, requests, 5) == 4);
+	int results[6] = {-1, -1, -1, -1, -1, -1};
+	TreeCompletion completions[4];
+	size_t reaped = 0;
+	while (reaped < 4) {
+		struct pollfd readable = {.fd = tree_ring_fd(ring), .events = POLLIN};
+		assert(poll(&readable, 1, -1) == 1);
+		size_t count = tree_ring_reap(ring, completions, 4);
+		for (size_t i = 0; i < count; i++) {
+			assert(completions[i].listing == NULL);
+			results[completions[i].user_data] = completions[i].result;
+		}
+		reaped += count;
+	}
+	assert(results[1] == 0 && results[2] == 0 && results[3] == 0 && results[4] == EINVAL);
+	TreeRequest more[] = {
+		{{TREE_OP_MOVE, "/a/", "/c/a/"}, 6},
+		{{TREE_OP_LIST, "/d/", NULL}, 7},
+	};
+	assert(tree_ring_submit(ring, more, 2) == 2);
+	reaped = 0;
+	while (reaped < 2) {
+		struct pollfd readable = {.fd = tree_ring_fd(ring), .events = POLLIN};
+		assert(poll(&readable, 1, -1) == 1);
+		size_t count = tree_ring_reap(ring, completions, 4);
+		for (size_t i = 0; i < count; i++) {
+			assert(completions[i].user_data == 7 ? completions[i].result == ENOENT : completions[i].result == 0);
+			assert(completions[i].listing == NULL);
+		}
+		reaped += count;
+	}
+	assert(tree_ring_submit(ring, &requests[4], 1) == 1);
+	while (tree_ring_reap(ring, completions, 1) == 0) {
+		struct pollfd readable = {.fd = tree_ring_fd(ring), .events = POLLIN};
+		assert(poll(&readable, 1, -1) == 1);
+	}
+	assert(completions[0].result == 0 && strcmp(completions[0].listing, "b,c") == 0);
+	free(completions[0].listing);
+	// Closing waits for the requests still in flight.
+	assert(tree_ring_submit(ring, requests, 3) == 3);
+	tree_ring_close(ring);
+	char *list_content = tree_list(tree, "/");
+	assert(strcmp(list_content, "a,b,c") == 0);
+	free(list_content);
+	tree_free(tree);
+}
 
 int main() {
+	check_path_kernels();
+
 	Tree *tree = tree_new();
 	char *list_content = tree_list(tree, "/");
 	assert(strcmp(list_content, "") == 0);
@@ -28,6 +170,184 @@ int main() {
 	list_content = tree_list(tree, "/b/");
 	assert(strcmp(list_content, "c") == 0);
 	free(list_content);
+	const TreeListing *listing = tree_list_shared(tree, "/");
+	assert(strcmp(tree_listing_contents(listing), "a,b") == 0);
+	assert(tree_listing_length(listing) == 3);
+	const TreeListing *same_listing = tree_list_shared(tree, "/");
+	assert(same_listing == listing);
+	tree_listing_release(same_listing);
+	assert(tree_create(tree, "/c/") == 0);
+	assert(strcmp(tree_listing_contents(listing), "a,b") == 0);
+	tree_listing_release(listing);
+	listing = tree_list_shared(tree, "/");
+	assert(strcmp(tree_listing_contents(listing), "a,b,c") == 0);
+	tree_listing_release(listing);
+	size_t hits, misses, previous_hits;
+	tree_path_cache_stats(tree, &previous_hits, &misses);
+	list_content = tree_list(tree, "/a/b/");
+	free(list_content);
+	list_content = tree_list(tree, "/a/b/");
+	assert(strcmp(list_content, "") == 0);
+	free(list_content);
+	tree_path_cache_stats(tree, &hits, &misses);
+	assert(hits > previous_hits);
+	assert(tree_move(tree, "/a/", "/d/") == 0);
+	assert(tree_list(tree, "/a/b/") == NULL);
+	list_content = tree_list(tree, "/d/b/");
+	assert(strcmp(list_content, "") == 0);
+	free(list_content);
+	// Churn through more nodes than the pool keeps, so that cached entries expire.
+	for (int round = 0; round < 2; round++) {
+		char churn_path[] = "/x/a/a/a/";
+		for (char i = 'a'; i <= 'z'; i++) {
+			for (char j = 'a'; j <= 'z'; j++) {
+				for (char k = 'a'; k <= 'h'; k++) {
+					churn_path[3] = i;
+					churn_path[5] = j;
+					churn_path[7] = k;
+					assert(tree_create_all(tree, churn_path) == 0);
+				}
+			}
+		}
+		assert(tree_remove_recursive(tree, "/x/") == 0);
+		list_content = tree_list(tree, "/d/b/");
+		assert(strcmp(list_content, "") == 0);
+		free(list_content);
+	}
+	assert(tree_list(tree, "/x/a/") == NULL);
+	TreeOp ops[] = {
+		{TREE_OP_CREATE, "/e/f/", NULL},
+		{TREE_OP_CREATE, "/e/", NULL},
+		{TREE_OP_CREATE, "/e/g/", NULL},
+		{TREE_OP_CREATE, "/e/g/", NULL},
+		{TREE_OP_MOVE, "/e/g/", "/e/h/"},
+		{TREE_OP_MOVE, "/e/f/", "/b/f/"},
+		{TREE_OP_REMOVE, "/c/", NULL},
+		{TREE_OP_REMOVE, "/", NULL},
+		{TREE_OP_CREATE, "/x/y/", NULL},
+	};
+	int results[9];
+	assert(tree_batch(tree, ops, 9, results) == 0);
+	int expected[9] = {0, 0, 0, EEXIST, 0, 0, 0, EBUSY, ENOENT};
+	assert(memcmp(results, expected, sizeof(results)) == 0);
+	list_content = tree_list(tree, "/");
+	assert(strcmp(list_content, "b,d,e") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/e/");
+	assert(strcmp(list_content, "h") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/b/");
+	assert(strcmp(list_content, "c,f") == 0);
+	free(list_content);
+	assert(tree_create(tree, "/e/h/i/") == 0);
+	assert(tree_remove(tree, "/e/") == ENOTEMPTY);
+	assert(tree_remove_recursive(tree, "/e/") == 0);
+	assert(tree_list(tree, "/e/h/") == NULL);
+	assert(tree_remove_recursive(tree, "/e/") == ENOENT);
+	assert(tree_remove_recursive(tree, "/") == EBUSY);
+	list_content = tree_list(tree, "/");
+	assert(strcmp(list_content, "b,d") == 0);
+	free(list_content);
+	assert(tree_create_all(tree, "/p/q/r/") == 0);
+	assert(tree_create_all(tree, "/p/q/r/") == 0);
+	assert(tree_create_all(tree, "/p/s/") == 0);
+	assert(tree_create_all(tree, "/") == EEXIST);
+	assert(tree_create_all(tree, "/p/Q/") == EINVAL);
+	list_content = tree_list(tree, "/p/");
+	assert(strcmp(list_content, "q,s") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/p/q/");
+	assert(strcmp(list_content, "r") == 0);
+	free(list_content);
+	assert(tree_create(tree, "/p/a/") == 0);
+	assert(tree_create(tree, "/p/z/") == 0);
+	TreeListCursor *cursor = tree_list_open(tree, "/p/", 2);
+	list_content = tree_list_next(cursor);
+	assert(strcmp(list_content, "a,q") == 0);
+	free(list_content);
+	assert(tree_create(tree, "/p/b/") == 0);
+	assert(tree_create(tree, "/p/t/") == 0);
+	list_content = tree_list_next(cursor);
+	assert(strcmp(list_content, "s,t") == 0);
+	free(list_content);
+	list_content = tree_list_next(cursor);
+	assert(strcmp(list_content, "z") == 0);
+	free(list_content);
+	assert(tree_list_next(cursor) == NULL && errno == 0);
+	tree_list_close(cursor);
+	assert(tree_list_open(tree, "/x/", 2) == NULL && errno == ENOENT);
+	Tree *snapshot = tree_snapshot(tree);
+	assert(tree_create(tree, "/p/c/") == 0);
+	assert(tree_move(tree, "/p/q/", "/b/q/") == 0);
+	assert(tree_remove_recursive(tree, "/b/q/") == 0);
+	assert(tree_create(snapshot, "/p/d/") == EROFS);
+	list_content = tree_list(snapshot, "/p/");
+	assert(strcmp(list_content, "a,b,q,s,t,z") == 0);
+	free(list_content);
+	list_content = tree_list(snapshot, "/p/q/");
+	assert(strcmp(list_content, "r") == 0);
+	free(list_content);
+	assert(tree_list(snapshot, "/b/q/") == NULL && errno == ENOENT);
+	list_content = tree_list(tree, "/p/");
+	assert(strcmp(list_content, "a,b,c,s,t,z") == 0);
+	free(list_content);
+	tree_free(snapshot);
+	tree_free(tree);
+	unlink("tree_main.wal");
+	unlink("tree_main.wal.image");
+	tree = tree_open("tree_main.wal");
+	assert(tree_create(tree, "/a/") == 0);
+	assert(tree_create(tree, "/a/b/") == 0);
+	assert(tree_move(tree, "/a/b/", "/c/") == 0);
+	assert(tree_create_all(tree, "/c/d/e/") == 0);
+	assert(tree_remove(tree, "/a/") == 0);
+	tree_free(tree);
+	tree = tree_open("tree_main.wal");
+	list_content = tree_list(tree, "/");
+	assert(strcmp(list_content, "c") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/c/d/");
+	assert(strcmp(list_content, "e") == 0);
+	free(list_content);
+	tree_free(tree);
+	tree = tree_open("tree_main.wal");
+	assert(tree_move(tree, "/c/d/", "/d/") == 0);
+	tree_free(tree);
+	tree = tree_open("tree_main.wal");
+	list_content = tree_list(tree, "/");
+	assert(strcmp(list_content, "c,d") == 0);
+	free(list_content);
+	list_content = tree_list(tree, "/d/");
+	assert(strcmp(list_content, "e") == 0);
+	free(list_content);
+	tree_free(tree);
+	unlink("tree_main.wal");
+	unlink("tree_main.wal.image");
+	tree = tree_new();
+	assert(tree_create(tree, "/a/") == 0);
+	assert(tree_create(tree, "/a/b/") == 0);
+	size_t stats_count;
+	TreeNodeStats *stats = tree_stats_top(tree, 10, &stats_count);
+#ifdef TREE_STATS
+	assert(stats != NULL && stats_count == 3);
+	size_t root_stats = 0;
+	while (strcmp(stats[root_stats].path, "/") != 0)
+		root_stats++;
+	assert(stats[root_stats].writer_entries >= 1);
+	tree_stats_free(stats, stats_count);
+	assert(tree_stats_top(tree, 0, &stats_count) == NULL && errno == EINVAL);
+#else
+	assert(stats == NULL && errno == ENOTSUP);
+#endif
+	tree_free(tree);
+	tree_trace_enable(true);
+	tree = tree_new();
+	assert(tree_create(tree, "/a/") == 0);
+	assert(tree_move(tree, "/a/", "/b/") == 0);
+	tree_trace_enable(false);
+	assert(tree_trace_dump("tree_main.trace") == 0);
+	assert(tree_trace_dump("/nonexistent/tree_main.trace") == ENOENT);
 	tree_free(tree);
+	check_ring();
 	printf("OK!\n");
 }
\ No newline at end of file
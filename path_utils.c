@@ -1,6 +1,8 @@
 #include "path_utils.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,28 +14,306 @@
  * split_paths_by_LCA added by myself.
  */
 
-bool is_path_valid(const char* path)
+// Validation and comparison of paths go through kernels, picked once per process
+// by the instruction sets the CPU supports. All of them read exactly the bytes
+// they are given, SIMD ones a whole block at a time and the rest one by one.
+
+// Returned by `find_components` for an invalid path.
+#define INVALID_PATH SIZE_MAX
+
+typedef struct PathKernels {
+    // Check that `path[1..length)` consists of valid folder names, each followed by '/',
+    // and fill in the offsets and lengths of their components, unless `components` is NULL.
+    // Return their number, or INVALID_PATH.
+    size_t (*find_components)(const char* path, size_t length, PathComponent* components);
+    // Return the index of the first byte of `length` in which `path1` and `path2` differ,
+    // or `length` if there is none.
+    size_t (*mismatch)(const char* path1, const char* path2, size_t length);
+} PathKernels;
+
+// Record the component from `start` up to the '/' at `end`, and return whether it is valid.
+static inline bool add_component(PathComponent* components, size_t* depth, size_t start, size_t end)
 {
-    if (path == NULL)
+    size_t name_len = end - start;
+    if (name_len == 0 || name_len > MAX_FOLDER_NAME_LENGTH)
         return false;
-    size_t len = strlen(path);
-    if (len == 0 || len > MAX_PATH_LENGTH)
+    if (components) {
+        components[*depth].offset = start;
+        components[*depth].length = name_len;
+    }
+    (*depth)++;
+    return true;
+}
+
+static size_t find_components_scalar(const char* path, size_t length, PathComponent* components)
+{
+    size_t depth = 0;
+    size_t name_start = 1; // Start of current path component, just after '/'.
+    for (size_t i = 1; i < length; ++i) {
+        if (path[i] == '/') {
+            if (!add_component(components, &depth, name_start, i))
+                return INVALID_PATH;
+            name_start = i + 1;
+        } else if (path[i] < 'a' || path[i] > 'z') {
+            return INVALID_PATH;
+        }
+    }
+    return depth;
+}
+
+static size_t mismatch_scalar(const char* path1, const char* path2, size_t length)
+{
+    size_t i = 0;
+    while (i < length && path1[i] == path2[i])
+        i++;
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PATH_SIMD_X86 1
+#include <immintrin.h>
+
+// Record the components ending at the set bits of `slashes`, which are offsets from `base`.
+// `invalid` has the bits of bytes other than 'a'-'z' and '/' set.
+static inline bool add_block_components(uint32_t invalid, uint32_t slashes, size_t base,
+                                        size_t* name_start, PathComponent* components, size_t* depth)
+{
+    if (invalid)
         return false;
+    while (slashes) {
+        size_t end = base + __builtin_ctz(slashes);
+        if (!add_component(components, depth, *name_start, end))
+            return false;
+        *name_start = end + 1;
+        slashes &= slashes - 1;
+    }
+    return true;
+}
+
+// The last, partial block is copied into a buffer padded with letters,
+// which neither end a component nor are invalid.
+#define PADDING 'a'
+
+__attribute__((target("sse2")))
+static inline bool sse2_block(const char* block, size_t base, size_t* name_start,
+                              PathComponent* components, size_t* depth)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i*)block);
+    // Bytes of 0x80 and above are negative, so they are not letters either.
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('a' - 1)),
+                                    _mm_cmplt_epi8(bytes, _mm_set1_epi8('z' + 1)));
+    __m128i slashes = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('/'));
+    uint32_t valid = _mm_movemask_epi8(_mm_or_si128(letters, slashes));
+    return add_block_components(~valid & 0xFFFF, _mm_movemask_epi8(slashes), base,
+                                name_start, components, depth);
+}
+
+__attribute__((target("sse2")))
+static size_t find_components_sse2(const char* path, size_t length, PathComponent* components)
+{
+    size_t depth = 0;
+    size_t name_start = 1;
+    size_t i = 1;
+    for (; i + 16 <= length; i += 16) {
+        if (!sse2_block(path + i, i, &name_start, components, &depth))
+            return INVALID_PATH;
+    }
+    if (i < length) {
+        char block[16];
+        memset(block, PADDING, sizeof(block));
+        memcpy(block, path + i, length - i);
+        if (!sse2_block(block, i, &name_start, components, &depth))
+            return INVALID_PATH;
+    }
+    return depth;
+}
+
+__attribute__((target("sse2")))
+static size_t mismatch_sse2(const char* path1, const char* path2, size_t length)
+{
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes1 = _mm_loadu_si128((const __m128i*)(path1 + i));
+        __m128i bytes2 = _mm_loadu_si128((const __m128i*)(path2 + i));
+        uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes1, bytes2));
+        if (equal != 0xFFFF)
+            return i + __builtin_ctz(~equal);
+    }
+    return i + mismatch_scalar(path1 + i, path2 + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static inline bool avx2_block(const char* block, size_t base, size_t* name_start,
+                              PathComponent* components, size_t* depth)
+{
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)block);
+    __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('a' - 1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), bytes));
+    __m256i slashes = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('/'));
+    uint32_t valid = _mm256_movemask_epi8(_mm256_or_si256(letters, slashes));
+    return add_block_components(~valid, _mm256_movemask_epi8(slashes), base,
+                                name_start, components, depth);
+}
+
+__attribute__((target("avx2")))
+static size_t find_components_avx2(const char* path, size_t length, PathComponent* components)
+{
+    size_t depth = 0;
+    size_t name_start = 1;
+    size_t i = 1;
+    for (; i + 32 <= length; i += 32) {
+        if (!avx2_block(path + i, i, &name_start, components, &depth))
+            return INVALID_PATH;
+    }
+    if (i < length) {
+        char block[32];
+        memset(block, PADDING, sizeof(block));
+        memcpy(block, path + i, length - i);
+        if (!avx2_block(block, i, &name_start, components, &depth))
+            return INVALID_PATH;
+    }
+    return depth;
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const char* path1, const char* path2, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes1 = _mm256_loadu_si256((const __m256i*)(path1 + i));
+        __m256i bytes2 = _mm256_loadu_si256((const __m256i*)(path2 + i));
+        uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes1, bytes2));
+        if (equal != 0xFFFFFFFF)
+            return i + __builtin_ctz(~equal);
+    }
+    return i + mismatch_sse2(path1 + i, path2 + i, length - i);
+}
+#endif
+
+static const PathKernels kernels[] = {
+    [PATH_SIMD_SCALAR] = { find_components_scalar, mismatch_scalar },
+#ifdef PATH_SIMD_X86
+    [PATH_SIMD_SSE2] = { find_components_sse2, mismatch_sse2 },
+    [PATH_SIMD_AVX2] = { find_components_avx2, mismatch_avx2 },
+#endif
+};
+
+static const PathKernels* active_kernels;
+static pthread_once_t active_kernels_once = PTHREAD_ONCE_INIT;
+
+static void init_kernels(void)
+{
+    active_kernels = &kernels[path_simd_supported()];
+}
+
+static inline const PathKernels* get_kernels(void)
+{
+    pthread_once(&active_kernels_once, init_kernels);
+    return active_kernels;
+}
+
+PathSimd path_simd_supported(void)
+{
+#ifdef PATH_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return PATH_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return PATH_SIMD_SSE2;
+#endif
+    return PATH_SIMD_SCALAR;
+}
+
+void path_simd_select(PathSimd simd)
+{
+    assert(simd <= path_simd_supported());
+    pthread_once(&active_kernels_once, init_kernels);
+    active_kernels = &kernels[simd];
+}
+
+// Return the length of a path which may be valid, or 0 if it is not.
+static size_t check_path_ends(const char* path)
+{
+    if (path == NULL)
+        return 0;
+    size_t len = strnlen(path, MAX_PATH_LENGTH + 1);
+    if (len == 0 || len > MAX_PATH_LENGTH)
+        return 0;
     if (path[0] != '/' || path[len - 1] != '/')
+        return 0;
+    return len;
+}
+
+bool is_path_valid(const char* path)
+{
+    size_t len = check_path_ends(path);
+    return len > 0 && get_kernels()->find_components(path, len, NULL) != INVALID_PATH;
+}
+
+bool parse_path(const char* path, ParsedPath* parsed)
+{
+    size_t len = check_path_ends(path);
+    if (len == 0)
         return false;
-    const char* name_start = path + 1; // Start of current path component, just after '/'.
-    while (name_start < path + len) {
-        char* name_end = strchr(name_start, '/'); // End of current path component, at '/'.
-        if (!name_end || name_end == name_start || name_end > name_start + MAX_FOLDER_NAME_LENGTH)
-            return false;
-        for (const char* p = name_start; p != name_end; ++p)
-            if (*p < 'a' || *p > 'z')
-                return false;
-        name_start = name_end + 1;
+    size_t depth = get_kernels()->find_components(path, len, parsed->components);
+    if (depth == INVALID_PATH)
+        return false;
+    for (size_t i = 0; i < depth; ++i) {
+        PathComponent* component = &parsed->components[i];
+        component->hash = hmap_hash(path + component->offset, component->length);
     }
+    parsed->path = path;
+    parsed->length = len;
+    parsed->depth = depth;
     return true;
 }
 
+void copy_path_component(const ParsedPath* path, size_t i, char* component)
+{
+    size_t len = path->components[i].length;
+    memcpy(component, path_component(path, i), len);
+    component[len] = '\0';
+}
+
+size_t path_prefix_length(const ParsedPath* path, size_t depth)
+{
+    if (depth == 0)
+        return 1;
+    const PathComponent* last = &path->components[depth - 1];
+    return last->offset + last->length + 1; // Include the following '/'.
+}
+
+size_t path_common_depth(const ParsedPath* path1, const ParsedPath* path2)
+{
+    // A component is common if the paths match up to and including the '/' after it.
+    size_t length = path1->length < path2->length ? path1->length : path2->length;
+    size_t mismatch = get_kernels()->mismatch(path1->path, path2->path, length);
+    size_t low = 0, high = path1->depth;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const PathComponent* component = &path1->components[middle];
+        if (component->offset + component->length < mismatch)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+bool is_lesser_path_prefix(const ParsedPath* path1, size_t depth1, const ParsedPath* path2, size_t depth2)
+{
+    size_t len1 = path_prefix_length(path1, depth1);
+    size_t len2 = path_prefix_length(path2, depth2);
+    int order = memcmp(path1->path, path2->path, len1 < len2 ? len1 : len2);
+    return order < 0 || (order == 0 && len1 < len2);
+}
+
+bool is_proper_prefix_of_parsed_path(const ParsedPath* prefix, const ParsedPath* path)
+{
+    return prefix->length < path->length
+        && get_kernels()->mismatch(prefix->path, path->path, prefix->length) == prefix->length;
+}
+
 bool is_root_path(const char* path)
 {
     return path[0] == '/' && path[1] == '\0';
@@ -98,33 +378,19 @@ void make_path_to_parent(const char* path, char* result, char* component)
 }
 
 void split_paths_by_LCA(const char* path1, const char* path2, char* LCA, char* suffix1, char* suffix2) {
-    int lastSlash = 0;
-    int pos = 1;
-    while (path1[pos] != '\0' && path2[pos] != '\0') {
-        if (path1[pos] == path2[pos]) {
-            if (path1[pos] == '/') {
-                lastSlash = pos;
-            }
-            pos++;
-        } else {
-            break;
-        }
+    size_t len1 = strlen(path1);
+    size_t len2 = strlen(path2);
+    size_t mismatch = get_kernels()->mismatch(path1, path2, len1 < len2 ? len1 : len2);
+    // The LCA ends at the last '/' the paths have in common.
+    size_t lastSlash = mismatch > 0 ? mismatch - 1 : 0;
+    while (path1[lastSlash] != '/') {
+        lastSlash--;
     }
 
-    for (int i = 0; i <= lastSlash; i++) {
-        LCA[i] = path1[i];
-    }
+    memcpy(LCA, path1, lastSlash + 1);
     LCA[lastSlash + 1] = '\0';
-
-    int len1 = strlen(path1);
-    for (int i = lastSlash; i <= len1; i++) {
-        suffix1[i - lastSlash] = path1[i];
-    }
-
-    int len2 = strlen(path2);
-    for (int i = lastSlash; i <= len2; i++) {
-        suffix2[i - lastSlash] = path2[i];
-    }
+    memcpy(suffix1, path1 + lastSlash, len1 - lastSlash + 1);
+    memcpy(suffix2, path2 + lastSlash, len2 - lastSlash + 1);
 }
 
 void get_last_path_component(const char* path, char* component)
@@ -159,12 +425,7 @@ bool is_proper_prefix_of_path(const char* prefix, const char* path)
     	return false;
     }
 
-    bool result = true;
-    for (size_t i = 0; i < prefix_len; i++) {
-        result &= prefix[i] == path[i];
-    }
-
-    return result;
+    return get_kernels()->mismatch(prefix, path, prefix_len) == prefix_len;
 }
 
 // A wrapper for using strcmp in qsort.
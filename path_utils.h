@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "HashMap.h"
 
@@ -23,6 +25,65 @@
 // sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
 bool is_path_valid(const char* path);
 
+// A component of a parsed path: `length` bytes at `offset`, and their hash (see `hmap_hash`).
+typedef struct PathComponent {
+    uint16_t offset;
+    uint16_t length;
+    uint32_t hash;
+} PathComponent;
+
+// A valid path split into its components, so that looking them up in maps
+// needs neither copying nor hashing them again. Points into the parsed path.
+typedef struct ParsedPath {
+    const char* path;
+    size_t length;
+    size_t depth; // Number of components, 0 for "/".
+    PathComponent components[MAX_PATH_LENGTH / 2];
+} ParsedPath;
+
+// Return whether a path is valid (see `is_path_valid`), and if so, fill in `parsed`.
+// Checks and splits the path in a single pass. `path` must outlive `parsed`.
+bool parse_path(const char* path, ParsedPath* parsed);
+
+// Instruction sets which path validation and comparison can use. The best one the CPU
+// supports is picked on first use. Kernels compare 16 (SSE2) or 32 (AVX2) bytes at a time.
+typedef enum PathSimd {
+    PATH_SIMD_SCALAR,
+    PATH_SIMD_SSE2,
+    PATH_SIMD_AVX2,
+} PathSimd;
+
+// Return the best instruction set the CPU supports.
+PathSimd path_simd_supported(void);
+
+// Make path functions use the given instruction set, which must be supported, for testing
+// the kernels against each other. Must not run concurrently with other path functions.
+void path_simd_select(PathSimd simd);
+
+// Return a pointer to the component `i` of a parsed path (not null-terminated).
+static inline const char* path_component(const ParsedPath* path, size_t i)
+{
+    return path->path + path->components[i].offset;
+}
+
+// Copy the component `i` of a parsed path into `component`, a buffer of size
+// at least MAX_FOLDER_NAME_LENGTH + 1, null-terminated.
+void copy_path_component(const ParsedPath* path, size_t i, char* component);
+
+// Return the length of the prefix of a parsed path made of its first `depth` components.
+size_t path_prefix_length(const ParsedPath* path, size_t depth);
+
+// Return the number of leading components two parsed paths have in common,
+// that is, the depth of their LCA.
+size_t path_common_depth(const ParsedPath* path1, const ParsedPath* path2);
+
+// Same as `is_lesser_path`, for the prefixes of the first `depth1` and `depth2`
+// components of two parsed paths.
+bool is_lesser_path_prefix(const ParsedPath* path1, size_t depth1, const ParsedPath* path2, size_t depth2);
+
+// Same as `is_proper_prefix_of_path`, for parsed paths.
+bool is_proper_prefix_of_parsed_path(const ParsedPath* prefix, const ParsedPath* path);
+
 // Returns whether a path is "/".
 bool is_root_path(const char* path);
 
@@ -74,7 +135,7 @@ bool is_proper_prefix_of_path(const char* prefix, const char* path);
 
 // Return an array containing all keys, lexicographically sorted.
 // The result is null-terminated.
-// Keys are not copied, they are only valid as long as the map.
+// Keys are not copied, they are only valid until the map is modified.
 // The caller should free the result.
 const char** make_map_contents_array(HashMap* map);
 
@@ -0,0 +1,477 @@
+// Multi-threaded workload benchmark of the Tree library.
+//
+// Threads run a mix of list, create, remove and move operations on the folders of a tree
+// of the given shape, picked with a Zipf distribution, for a fixed time. The results are
+// printed as a single JSON object: throughput and latency percentiles per operation type.
+
+#include "Tree.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { OP_LIST, OP_CREATE, OP_REMOVE, OP_MOVE, OP_TYPES };
+
+static const char *op_names[OP_TYPES] = {"list", "create", "remove", "move"};
+
+// Latencies are kept in a log-linear histogram: 2^SUB_BITS buckets for every power of two,
+// so that percentiles are exact up to about 3%.
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS (64 * SUB_BUCKETS)
+
+typedef struct Histogram {
+	uint64_t counts[BUCKETS];
+	uint64_t total;
+	uint64_t succeeded;
+} Histogram;
+
+typedef struct Config {
+	int threads;
+	double duration;
+	int fanout;
+	int depth;
+	double skew; // Of the Zipf distribution, 0 for uniform.
+	unsigned weights[OP_TYPES];
+	uint64_t seed;
+	const char *wal; // Path of a write-ahead log, NULL for an in-memory tree.
+	size_t hot; // Number of most contended folders to report, see `tree_stats_top`.
+	const char *trace; // Where to dump the trace of the run, NULL to run without tracing.
+} Config;
+
+typedef struct Worker {
+	pthread_t thread;
+	uint64_t rng;
+	Histogram histograms[OP_TYPES];
+} Worker;
+
+static Config config = {
+	.threads = 4,
+	.duration = 5.0,
+	.fanout = 8,
+	.depth = 4,
+	.skew = 0.99,
+	.weights = {70, 10, 10, 10},
+	.seed = 1,
+	.wal = NULL,
+	.hot = 0,
+	.trace = NULL,
+};
+
+static Tree *tree;
+static char **paths; // All the folders of a full tree of the configured shape.
+static size_t path_count;
+static double *cdf; // Of the Zipf distribution over `paths`.
+static atomic_bool stopped = false;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double random_unit(uint64_t *state) {
+	return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t bucket_of(uint64_t value) {
+	if (value < SUB_BUCKETS) {
+		return value;
+	}
+	int exponent = 63 - __builtin_clzll(value) - SUB_BITS;
+	return (size_t)(exponent + 1) * SUB_BUCKETS + ((value >> exponent) - SUB_BUCKETS);
+}
+
+// The largest value which falls into the bucket.
+static uint64_t bucket_value(size_t bucket) {
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	int exponent = bucket / SUB_BUCKETS - 1;
+	return ((uint64_t)(bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << exponent) - 1;
+}
+
+static uint64_t percentile(const Histogram *histogram, double fraction) {
+	if (histogram->total == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)ceil(fraction * histogram->total);
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+		seen += histogram->counts[bucket];
+		if (seen >= rank && histogram->counts[bucket] > 0) {
+			return bucket_value(bucket);
+		}
+	}
+	return bucket_value(BUCKETS - 1);
+}
+
+static void append_path(const char *parent, size_t index, char *result) {
+	// Folder names are lowercase letters, so the index is written in base 26.
+	char name[16];
+	size_t length = 0;
+	do {
+		name[length++] = 'a' + index % 26;
+		index /= 26;
+	} while (index > 0);
+	size_t parent_length = strlen(parent);
+	memcpy(result, parent, parent_length);
+	memcpy(result + parent_length, name, length);
+	result[parent_length + length] = '/';
+	result[parent_length + length + 1] = '\0';
+}
+
+// Lists the folders of a full tree, level by level, and creates them.
+static void build_tree(void) {
+	size_t level_size = 1;
+	path_count = 0;
+	for (int level = 1; level <= config.depth; level++) {
+		level_size *= config.fanout;
+		path_count += level_size;
+	}
+	paths = malloc(path_count * sizeof(char *));
+	if (paths == NULL) {
+		fprintf(stderr, "tree_bench: out of memory\n");
+		exit(1);
+	}
+
+	size_t parents_begin = 0, parents_end = 0, count = 0;
+	for (int level = 1; level <= config.depth; level++) {
+		for (size_t parent = parents_begin; parent < (level == 1 ? 1 : parents_end); parent++) {
+			for (int child = 0; child < config.fanout; child++) {
+				char path[4096];
+				append_path(level == 1 ? "/" : paths[parent], child, path);
+				paths[count] = strdup(path);
+				if (paths[count] == NULL) {
+					fprintf(stderr, "tree_bench: out of memory\n");
+					exit(1);
+				}
+				tree_create(tree, paths[count]);
+				count++;
+			}
+		}
+		parents_begin = level == 1 ? 0 : parents_end;
+		parents_end = count;
+	}
+}
+
+// Ranks the folders in a random order, so that the hot ones are spread over all levels,
+// and computes the cumulative Zipf distribution over the ranks.
+static void build_distribution(void) {
+	uint64_t rng = config.seed;
+	for (size_t i = path_count - 1; i > 0; i--) {
+		size_t j = next_random(&rng) % (i + 1);
+		char *swapped = paths[i];
+		paths[i] = paths[j];
+		paths[j] = swapped;
+	}
+
+	cdf = malloc(path_count * sizeof(double));
+	if (cdf == NULL) {
+		fprintf(stderr, "tree_bench: out of memory\n");
+		exit(1);
+	}
+	double sum = 0;
+	for (size_t i = 0; i < path_count; i++) {
+		sum += 1.0 / pow((double)(i + 1), config.skew);
+		cdf[i] = sum;
+	}
+	for (size_t i = 0; i < path_count; i++) {
+		cdf[i] /= sum;
+	}
+}
+
+static const char *pick_path(uint64_t *rng) {
+	double u = random_unit(rng);
+	size_t low = 0, high = path_count - 1;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (cdf[middle] < u) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return paths[low];
+}
+
+static int pick_op(uint64_t *rng) {
+	unsigned total = 0;
+	for (int op = 0; op < OP_TYPES; op++) {
+		total += config.weights[op];
+	}
+	unsigned value = next_random(rng) % total;
+	for (int op = 0; op < OP_TYPES; op++) {
+		if (value < config.weights[op]) {
+			return op;
+		}
+		value -= config.weights[op];
+	}
+	return OP_LIST;
+}
+
+static void *run_worker(void *arg) {
+	Worker *worker = arg;
+	while (!atomic_load_explicit(&stopped, memory_order_relaxed)) {
+		int op = pick_op(&worker->rng);
+		const char *path = pick_path(&worker->rng);
+		const char *target = op == OP_MOVE ? pick_path(&worker->rng) : NULL;
+
+		uint64_t start = now_ns();
+		bool succeeded;
+		switch (op) {
+			case OP_LIST: {
+				char *list_content = tree_list(tree, path);
+				succeeded = list_content != NULL;
+				free(list_content);
+				break;
+			}
+			case OP_CREATE:
+				succeeded = tree_create(tree, path) == 0;
+				break;
+			case OP_REMOVE:
+				succeeded = tree_remove(tree, path) == 0;
+				break;
+			default:
+				succeeded = tree_move(tree, path, target) == 0;
+				break;
+		}
+		uint64_t latency = now_ns() - start;
+
+		Histogram *histogram = &worker->histograms[op];
+		histogram->counts[bucket_of(latency)]++;
+		histogram->total++;
+		histogram->succeeded += succeeded;
+	}
+	return NULL;
+}
+
+static bool parse_mix(const char *mix) {
+	char *end;
+	for (int op = 0; op < OP_TYPES; op++) {
+		unsigned long weight = strtoul(mix, &end, 10);
+		if (end == mix || (op < OP_TYPES - 1 ? *end != ',' : *end != '\0')) {
+			return false;
+		}
+		config.weights[op] = weight;
+		mix = end + 1;
+	}
+	return config.weights[0] + config.weights[1] + config.weights[2] + config.weights[3] > 0;
+}
+
+static void usage(const char *program) {
+	fprintf(stderr,
+	        "usage: %s [-t threads] [-d seconds] [-f fanout] [-D depth] [-z skew]\n"
+	        "       [-m list,create,remove,move] [-s seed] [-w wal-path] [-k hot-folders]\n"
+	        "       [-T trace-path]\n"
+	        "  -z  Zipf exponent of the choice of folders, 0 for uniform (default 0.99)\n"
+	        "  -m  relative weights of the operations (default 70,10,10,10)\n"
+	        "  -w  benchmark a durable tree, logged at the given path\n"
+	        "  -k  report the most contended folders (needs a TREE_STATS build)\n"
+	        "  -T  trace the run, and dump the trace to the given path (see tree_trace)\n",
+	        program);
+	exit(2);
+}
+
+static void parse_options(int argc, char **argv) {
+	int option;
+	while ((option = getopt(argc, argv, "t:d:f:D:z:m:s:w:k:T:")) != -1) {
+		switch (option) {
+			case 't':
+				config.threads = atoi(optarg);
+				break;
+			case 'd':
+				config.duration = atof(optarg);
+				break;
+			case 'f':
+				config.fanout = atoi(optarg);
+				break;
+			case 'D':
+				config.depth = atoi(optarg);
+				break;
+			case 'z':
+				config.skew = atof(optarg);
+				break;
+			case 'm':
+				if (!parse_mix(optarg)) {
+					usage(argv[0]);
+				}
+				break;
+			case 's':
+				config.seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'w':
+				config.wal = optarg;
+				break;
+			case 'k':
+				config.hot = strtoull(optarg, NULL, 10);
+				break;
+			case 'T':
+				config.trace = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc || config.threads < 1 || config.duration <= 0 || config.fanout < 1
+	    || config.depth < 1 || config.skew < 0) {
+		usage(argv[0]);
+	}
+	double folders = 0, level_size = 1;
+	for (int level = 1; level <= config.depth; level++) {
+		level_size *= config.fanout;
+		folders += level_size;
+	}
+	if (folders > 1e8 || config.depth > 100) {
+		fprintf(stderr, "tree_bench: the tree would be too large\n");
+		exit(2);
+	}
+}
+
+// Prints the most contended folders as a "hot" array of the result.
+static void print_hot_folders(TreeNodeStats *stats, size_t count) {
+	printf(", \"hot\": [");
+	for (size_t i = 0; i < count; i++) {
+		printf("%s{\"path\": \"%s\", \"reader_entries\": %lu, \"writer_entries\": %lu, "
+		       "\"waits\": %lu, \"wait_ns\": %lu}",
+		       i > 0 ? ", " : "", stats[i].path, stats[i].reader_entries, stats[i].writer_entries,
+		       stats[i].waits, stats[i].wait_ns);
+	}
+	printf("]");
+}
+
+int main(int argc, char **argv) {
+	parse_options(argc, argv);
+
+	if (config.wal != NULL) {
+		unlink(config.wal);
+		char image[4096];
+		snprintf(image, sizeof(image), "%s.image", config.wal);
+		unlink(image);
+		tree = tree_open(config.wal);
+	} else {
+		tree = tree_new();
+	}
+	if (tree == NULL) {
+		perror("tree_bench");
+		return 1;
+	}
+	build_tree();
+	build_distribution();
+
+	Worker *workers = calloc(config.threads, sizeof(Worker));
+	if (workers == NULL) {
+		fprintf(stderr, "tree_bench: out of memory\n");
+		return 1;
+	}
+	if (config.trace != NULL) {
+		tree_trace_enable(true);
+	}
+	uint64_t start = now_ns();
+	for (int i = 0; i < config.threads; i++) {
+		workers[i].rng = config.seed * 0x9e3779b97f4a7c15ULL + i + 1;
+		if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+			perror("tree_bench");
+			return 1;
+		}
+	}
+	struct timespec duration = {
+		.tv_sec = (time_t)config.duration,
+		.tv_nsec = (long)((config.duration - (time_t)config.duration) * 1e9),
+	};
+	while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+	}
+	atomic_store(&stopped, true);
+	for (int i = 0; i < config.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+	if (config.trace != NULL) {
+		tree_trace_enable(false);
+		// The buffers of the workers outlive them.
+		int err = tree_trace_dump(config.trace);
+		if (err != 0) {
+			fprintf(stderr, "tree_bench: tree_trace_dump: %s\n", strerror(err));
+			return 1;
+		}
+	}
+
+	Histogram *totals = calloc(OP_TYPES, sizeof(Histogram));
+	if (totals == NULL) {
+		fprintf(stderr, "tree_bench: out of memory\n");
+		return 1;
+	}
+	uint64_t all = 0;
+	for (int op = 0; op < OP_TYPES; op++) {
+		for (int i = 0; i < config.threads; i++) {
+			const Histogram *histogram = &workers[i].histograms[op];
+			for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+				totals[op].counts[bucket] += histogram->counts[bucket];
+			}
+			totals[op].total += histogram->total;
+			totals[op].succeeded += histogram->succeeded;
+		}
+		all += totals[op].total;
+	}
+
+	TreeNodeStats *hot = NULL;
+	size_t hot_count = 0;
+	if (config.hot > 0 && (hot = tree_stats_top(tree, config.hot, &hot_count)) == NULL) {
+		perror("tree_bench: tree_stats_top");
+		return 1;
+	}
+
+	printf("{\"threads\": %d, \"duration_s\": %.3f, \"fanout\": %d, \"depth\": %d, \"folders\": %zu, "
+	       "\"skew\": %g, \"seed\": %llu, \"durable\": %s, \"traced\": %s, \"mix\": {",
+	       config.threads, elapsed, config.fanout, config.depth, path_count, config.skew,
+	       (unsigned long long)config.seed, config.wal != NULL ? "true" : "false",
+	       config.trace != NULL ? "true" : "false");
+	for (int op = 0; op < OP_TYPES; op++) {
+		printf("%s\"%s\": %u", op > 0 ? ", " : "", op_names[op], config.weights[op]);
+	}
+	printf("}, \"ops_per_s\": %.1f, \"ops\": {", all / elapsed);
+	for (int op = 0; op < OP_TYPES; op++) {
+		const Histogram *histogram = &totals[op];
+		printf("%s\"%s\": {\"count\": %llu, \"succeeded\": %llu, \"ops_per_s\": %.1f, "
+		       "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+		       op > 0 ? ", " : "", op_names[op], (unsigned long long)histogram->total,
+		       (unsigned long long)histogram->succeeded, histogram->total / elapsed,
+		       (unsigned long long)percentile(histogram, 0.5),
+		       (unsigned long long)percentile(histogram, 0.99),
+		       (unsigned long long)percentile(histogram, 0.999));
+	}
+	printf("}");
+	if (hot != NULL) {
+		print_hot_folders(hot, hot_count);
+		tree_stats_free(hot, hot_count);
+	}
+	printf("}\n");
+
+	tree_free(tree);
+	for (size_t i = 0; i < path_count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(cdf);
+	free(totals);
+	free(workers);
+	return 0;
+}
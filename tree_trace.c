@@ -0,0 +1,147 @@
+// Prints a trace written by `tree_trace_dump`, one event per line.
+//
+// The buffers of the threads are each in the order of their events, so they are merged
+// by timestamp with a heap. Times are printed relative to the first event.
+
+#include "Trace.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Run {
+	TraceEvent *events;
+	uint64_t count;
+	uint64_t next;
+} Run;
+
+static Run *runs;
+static size_t run_count;
+// Indices of the runs with events left, in a min-heap by their next timestamps.
+static size_t *heap;
+static size_t heap_size;
+
+static void fail(const char *path, const char *reason) {
+	fprintf(stderr, "tree_trace: %s: %s\n", path, reason);
+	exit(1);
+}
+
+static void load(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		perror("tree_trace");
+		exit(1);
+	}
+	TraceDumpHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+	    || memcmp(header.magic, TRACE_DUMP_MAGIC, sizeof(header.magic)) != 0) {
+		fail(path, "not a trace");
+	}
+	if (header.buffers > SIZE_MAX / sizeof(Run)) {
+		fail(path, "damaged trace");
+	}
+	run_count = header.buffers;
+	runs = calloc(run_count, sizeof(Run));
+	heap = calloc(run_count, sizeof(size_t));
+	if (run_count > 0 && (runs == NULL || heap == NULL)) {
+		fail(path, "out of memory");
+	}
+	for (size_t i = 0; i < run_count; i++) {
+		if (fread(&runs[i].count, sizeof(uint64_t), 1, file) != 1
+		    || runs[i].count > TRACE_BUFFER_EVENTS) {
+			fail(path, "damaged trace");
+		}
+		runs[i].events = malloc(runs[i].count * sizeof(TraceEvent) + 1);
+		if (runs[i].events == NULL) {
+			fail(path, "out of memory");
+		}
+		if (fread(runs[i].events, sizeof(TraceEvent), runs[i].count, file) != runs[i].count) {
+			fail(path, "damaged trace");
+		}
+	}
+	fclose(file);
+}
+
+static uint64_t next_timestamp(size_t run) {
+	return runs[run].events[runs[run].next].timestamp;
+}
+
+static void sift_down(size_t i) {
+	while (2 * i + 1 < heap_size) {
+		size_t child = 2 * i + 1;
+		if (child + 1 < heap_size && next_timestamp(heap[child + 1]) < next_timestamp(heap[child])) {
+			child++;
+		}
+		if (next_timestamp(heap[i]) <= next_timestamp(heap[child])) {
+			return;
+		}
+		size_t swap = heap[i];
+		heap[i] = heap[child];
+		heap[child] = swap;
+		i = child;
+	}
+}
+
+static void print_event(const TraceEvent *event, uint64_t start) {
+	printf("%14.3f us %8" PRIu32 "  %-16s %#" PRIx64, (event->timestamp - start) / 1e3, event->thread,
+	       traceTypeName(event->type), event->node);
+	switch (event->type) {
+		case TRACE_TRACEBACK_BEGIN:
+		case TRACE_TRACEBACK_END:
+			printf("  up to %#" PRIx64 "%s%s", event->argument,
+			       (event->flags & TRACE_WRITE_LOCK) != 0 ? " write-locked" : "",
+			       (event->flags & TRACE_INCLUDING) != 0 ? " including" : "");
+			break;
+		case TRACE_FIND_TWO_BEGIN:
+			break;
+		case TRACE_FIND_TWO_END:
+			printf("  lca %#" PRIx64, event->argument);
+			break;
+		case TRACE_RESTART:
+			printf("  version %" PRIu64, event->argument);
+			break;
+		default:
+			printf("  reading %u writing %u waiting readers %u writers %u",
+			       traceCounter(event->argument, TRACE_READING), traceCounter(event->argument, TRACE_WRITING),
+			       traceCounter(event->argument, TRACE_WAITING_READERS),
+			       traceCounter(event->argument, TRACE_WAITING_WRITERS));
+	}
+	putchar('\n');
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s dump-file\n", argv[0]);
+		return 2;
+	}
+	load(argv[1]);
+
+	for (size_t i = 0; i < run_count; i++) {
+		if (runs[i].count > 0) {
+			heap[heap_size++] = i;
+		}
+	}
+	for (size_t i = heap_size; i-- > 0;) {
+		sift_down(i);
+	}
+
+	uint64_t start = heap_size > 0 ? next_timestamp(heap[0]) : 0;
+	while (heap_size > 0) {
+		Run *run = &runs[heap[0]];
+		print_event(&run->events[run->next++], start);
+		if (run->next == run->count) {
+			heap[0] = heap[--heap_size];
+		}
+		sift_down(0);
+	}
+
+	for (size_t i = 0; i < run_count; i++) {
+		free(runs[i].events);
+	}
+	free(runs);
+	free(heap);
+	return 0;
+}